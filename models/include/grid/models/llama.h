@@ -9,10 +9,21 @@
 #ifndef GRID_MODELS_LLAMA_H
 #define GRID_MODELS_LLAMA_H
 
+#include <chrono>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <typeinfo>
+#include <vector>
 
 #include <grid/tensor/tensor.h>
 #include <grid/tensor/mmap.h>
+#include <grid/util/spsc_queue.h>
 
 namespace grid {
 
@@ -36,15 +47,97 @@ class LLaMAModel
     size_t max_seq_len_;  // max sequence length
   };
 
+  /// CacheType lists the supported storage types of the key/value cache.
+  enum CacheType
+  {
+    kCacheModelType,  ///> data type of the model
+    kCacheFloat16,    ///> half-precision floats
+    kCacheInt8,       ///> 8-bit integers with a scale per position and head
+  };
+
+  /// CacheLayout lists the supported memory layouts of the key/value cache.
+  enum CacheLayout
+  {
+    kCacheSequenceMajor,  ///> {max_seq_len, n_kv_heads, head_size}
+    kCacheHeadMajor,      ///> {n_kv_heads, max_seq_len, head_size}, contiguous rows for each head
+  };
+
+  /// WeightType lists the supported storage types of the weight matrices.
+  enum WeightType
+  {
+    kWeightFileType,  ///> data type of the tensors in the file
+    kWeightQ8_0,      ///> float and half-precision weights quantized to Q8_0 when loaded
+    kWeightQ4_0,      ///> float and half-precision weights quantized to Q4_0 when loaded
+  };
+
+  /// Options defines optional configurations for loading and running a model.
+  struct Options
+  {
+    bool        mmap_ = true;                         // map the tensors into memory (mmap), or read them
+    bool        huge_pages_ = false;                  // read the tensors into huge pages (requires !mmap_)
+    size_t      prefix_cache_size_ = 0;               // memory budget of the prefix key/value cache; 0 disables it
+    CacheType   kv_cache_type_ = kCacheModelType;     // storage type of the key/value cache
+    CacheLayout kv_cache_layout_ = kCacheSequenceMajor; // memory layout of the key/value cache
+    size_t      threads_ = 0;                         // number of threads; 0 uses all cores
+    WeightType  weight_type_ = kWeightFileType;       // storage type of the weight matrices
+    bool        repack_weights_ = false;              // repack Q8_0 and Q4_0 weight matrices into panels
+    bool        mmap_populate_ = false;               // read the mapped file into memory when loaded
+    bool        mmap_lock_ = false;                   // lock the mapped file in memory, if permitted
+    MMap::Advice mmap_advice_ = MMap::kAdviceNormal;  // expected access pattern of the mapped file
+    bool        prefetch_ = false;                    // prefetch the next layer's weights in the background
+    bool        stream_layers_ = false;               // keep only the current and next layer resident
+    std::string tokenizer_cache_;                     // directory of tokenizer snapshots; empty disables it
+  };
+
   // default stream start and end markers.
   static constexpr uint32_t kBOS = 1;
   static constexpr uint32_t kEOS = 2;
 
+  /// kNoToken is the id of the token that passes the bytes of an incomplete character that are
+  /// left at the end of the generation.
+  static constexpr uint32_t kNoToken = ~uint32_t{0};
+
+  /// Token is a token of the prompt or a generated token that is passed to the TokenCallback.
+  struct Token
+  {
+    uint32_t    id_;                                  // token id or kNoToken
+    std::string text_;                                // complete UTF-8 characters decoded so far
+    size_t      position_;                            // position of the token in the sequence
+    bool        prompt_;                              // token of the prompt
+    std::chrono::nanoseconds duration_;               // time to compute the token; see Generate
+  };
+
+  /// TokenCallback receives the tokens in order and returns false to stop the generation.
+  using TokenCallback = std::function<bool(const Token&)>;
+
+  class TokenStream;
+
  public:
   virtual ~LLaMAModel() = default;
 
-  /// Predict predicts the next words from the input prompt.
-  virtual void Predict(std::string_view prompt, size_t steps) = 0;
+  /// Predict predicts the next words from the input prompt and writes the prompt and the words
+  /// to std::cout.
+  void Predict(std::string_view prompt, size_t steps);
+
+  /// Generate runs the prompt and generates tokens up to the position steps, and passes the
+  /// prompt tokens, except the begin token, and the generated tokens to the callback. It stops
+  /// early if the model generates the begin token, the callback returns false, or a stop is
+  /// requested. The duration of a token is the time of its forward pass and sampling; prompt
+  /// tokens that are run as a batch report the time of the batch with the last token.
+  ///
+  /// @param prompt    Prompt text.
+  /// @param steps     Maximum number of positions, including the prompt; at most max_seq_len_.
+  /// @param callback  Function that is called in the calling thread for each token.
+  /// @param stop      Stop token for cancelling the generation from another thread.
+  virtual void Generate(std::string_view prompt, size_t steps, const TokenCallback& callback,
+                        std::stop_token stop = {}) = 0;
+
+  /// Stream starts generating the tokens for the prompt on a separate thread; see Generate.
+  std::unique_ptr<TokenStream> Stream(std::string_view prompt, size_t steps);
+
+  /// Residency returns the size of the memory-mapped model file and the number of its bytes that
+  /// are resident in memory.
+  virtual std::tuple<size_t, size_t> Residency() const = 0;
 
   /// Load creates and loads the model from the provided file.
   ///
@@ -60,6 +153,43 @@ class LLaMAModel
   /// @param mmap   Enable to map the tensors into memory (mmap)
   /// @returns LLaMA model
   static LLaMAModel* Load(LLaMAFile& file, std::string_view device_name, bool mmap = true);
+
+  /// Load creates and loads the model from the provided file.
+  ///
+  /// @param file     LLaMA file.
+  /// @param options  Model options.
+  /// @returns LLaMA model
+  static LLaMAModel* Load(LLaMAFile& file, const Options& options);
+
+  /// Load creates and loads the model from the provided file.
+  ///
+  /// @param file     LLaMA file.
+  /// @param device   Accelerator.
+  /// @param options  Model options.
+  /// @returns LLaMA model
+  static LLaMAModel* Load(LLaMAFile& file, std::string_view device_name, const Options& options);
+};
+
+
+/// TokenStream runs the generation on a separate thread and passes the tokens to the consumer
+/// through a lock-free queue. The queue holds all tokens of the generation, so the generating
+/// thread never waits for the consumer. Destroying the stream cancels the generation.
+class LLaMAModel::TokenStream
+{
+ public:
+  TokenStream(LLaMAModel& model, std::string_view prompt, size_t steps);
+
+  /// Next waits for the next token and returns false at the end of the generation. It rethrows
+  /// an exception of the generation after the tokens that were generated before it.
+  bool Next(Token& token);
+
+  /// Cancel requests the generation to stop.
+  void Cancel()                                           { thread_.request_stop(); }
+
+ private:
+  SPSCQueue<Token>    queue_;
+  std::exception_ptr  exception_;
+  std::jthread        thread_;                          // requests stop and joins when destroyed
 };
 
 
@@ -73,6 +203,7 @@ class LLaMAFile
   {
     kKarpathy,    ///> https://github.com/karpathy/llama2.c
     kGgml,        ///> https://github.com/ggerganov/ggml
+    kGrid,        ///> native format with the tensors in the layout of the kernels
   };
 
   // TensorType enumerates all possible tensors for the model
@@ -111,18 +242,49 @@ class LLaMAFile
   /// GetTokenizer loads and/or returns the Vocab information.
   virtual void GetTokenizer(LLaMAVocab&) const = 0;
 
-  /// MmapTensors maps the tensors into memory (mmap).
-  virtual MMap* MapTensors() const = 0;
+  /// Paths returns the paths of all files of the model, including a separate tokenizer file.
+  virtual std::vector<std::string> Paths() const = 0;
+
+  /// GetCachedTokenizer maps the snapshot of the tokenizer in the cache directory, or loads the
+  /// tokenizer with GetTokenizer and writes the snapshot if the directory doesn't include a
+  /// snapshot for the current model files.
+  void GetCachedTokenizer(LLaMAVocab&, const std::string& cache_dir) const;
+
+  /// TokenizerKey returns the key of the tokenizer snapshots for the model files, which is a hash
+  /// of their paths, sizes, and modification times.
+  uint64_t TokenizerKey() const;
+
+  /// MmapTensors maps the tensors into memory (mmap) with the provided MMap::Flags, or reads
+  /// them with the provided number of threads for MMap::kRead.
+  virtual MMap* MapTensors(int flags = 0, size_t threads = 0) const = 0;
 
   /// PrintModelParameters prints the model informatio and parameter
   std::ostream& PrintModelInfo(std::ostream&) const;
 
-  /// GetTensor returns the address of the specified tensor and optional indices.
-  template <typename T, typename... Index>
-  auto GetTensor(char* base, TensorType type, Index... indices) const
+  /// kTensorTypes is the number of tensor types.
+  static constexpr size_t kTensorTypes = kOutput + 1;
+
+  /// TensorInfo describes a tensor in the tensor directory of the file.
+  struct TensorInfo
   {
-    auto [offset, size] = GetTensorOffset(type, sizeof...(indices), indices...);
-    return std::make_tuple(reinterpret_cast<T*>(base + offset), size);
+    size_t                offset = 0;           // offset in the mapped tensors (MapTensors)
+    size_t                size = 0;             // size in bytes; 0 for unused directory entries;
+                                                // GetTensorInfo throws for them
+    const std::type_info* data_type = nullptr;  // nullptr for unsupported data types
+    size_t                panel_rows = 1;       // rows of a panel, or 1 for row-major tensors
+    size_t                rows = 0;             // 0 for vectors
+    size_t                cols = 0;
+  };
+
+  /// GetTensorInfo returns the directory entry of the tensor of the type and layer. Tensors that
+  /// aren't per layer use layer 0.
+  const TensorInfo& GetTensorInfo(TensorType type, size_t layer = 0) const;
+
+  /// GetTensor returns the address and size of the tensor in the mapped tensors at base.
+  template <typename T>
+  std::tuple<T*, size_t> GetTensor(char* base, const TensorInfo& info) const
+  {
+    return std::make_tuple(reinterpret_cast<T*>(base + info.offset), info.size);
   }
 
   /// Open opens the specified model file.
@@ -132,10 +294,16 @@ class LLaMAFile
   static LLaMAFile* Open(Type file_type, std::string_view model_path, std::string_view tokenizer_path);
 
  protected:
-  /// GetTensorOffset returns the offset from the beginning of the file for the specified tensor
-  /// The optional additional arguments define additional indices, in this order:
-  ///   - layer
-  virtual std::tuple<size_t, size_t> GetTensorOffset(TensorType, size_t nargs, ...) const = 0;
+  /// SetTensorInfo sets the directory entry of the tensor of the type and layer.
+  void SetTensorInfo(TensorType type, size_t layer, const TensorInfo& info);
+
+  /// ValidateTensors checks that the directory includes all tensors of the model with a supported
+  /// data type and the dimensions of the parameters, and that they are within the mapped tensors
+  /// of mapped_size bytes. It is called at the end of Load, so malformed files fail when opened.
+  void ValidateTensors(size_t mapped_size) const;
+
+ private:
+  std::vector<TensorInfo> tensors_;   // indexed by layer * kTensorTypes + type
 };
 
 } // end namespace grid
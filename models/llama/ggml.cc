@@ -6,15 +6,16 @@
 // The contents of this file are confidential and proprietary to Chris Zankel.
 //
 
-#include <cstdarg>
 #include <string>
-#include <iostream>
-#include <fstream>
 #include <algorithm>
+#include <cstring>
+#include <regex>
+#include <thread>
 #include <typeinfo>
 
 #include <grid/models/llama.h>
 #include <grid/util/demangle.h>
+#include <grid/util/thread_pool.h>
 
 #include "ggml.h"
 
@@ -37,209 +38,294 @@ const char* TensorNames[] =
 };
 
 
-// ifstream_helper is a helper class to use template deduction to read data from an ifstream.
-struct ifstream_helper
+namespace {
+
+// ReadValue returns the (unaligned) value of type T at the address.
+template <typename T>
+T ReadValue(const char* data)
 {
-  ifstream_helper(std::ifstream& ifs) : ifs_(ifs) {}
+  T value;
+  memcpy(&value, data, sizeof(T));
+  return value;
+}
 
-  // read is a generic read of len bytes to destination dest
-  void read(char* dest, size_t len)
+// ConvertValue converts the value of the type at the address to T; strings are returned as a
+// std::string_view into the mapped file. The value was validated when the file was loaded.
+template <typename T>
+T ConvertValue(std::string_view key, GgmlType type, const char* data)
+{
+  if constexpr (std::is_same_v<T, std::string_view>)
   {
-    ifs_.read(dest, len);
+    if (type == kGgufTypeString)
+      return std::string_view(data + sizeof(uint64_t), ReadValue<uint64_t>(data));
   }
-
-  // read reads and returns a specific type, which requires to specify the type: read<TYPE>()
-  template <typename T>
-  T read()
+  else if constexpr (std::is_same_v<T, bool>)
   {
-    T value;
-    read(value);
-    return value;
+    if (type == kGgufTypeBool)
+      return *data != 0;
   }
-
-  // read reads a specific type into the provided variable; the template is deduced: read(VARIABLE)
-  template <typename T>
-  void read(T& value)
+  else if constexpr (std::is_arithmetic_v<T>)
   {
-    ifs_.read(reinterpret_cast<char*>(&value), sizeof(value));
+    switch (type)
+    {
+      case kGgufTypeU8:       return static_cast<T>(ReadValue<uint8_t>(data));
+      case kGgufTypeI8:       return static_cast<T>(ReadValue<int8_t>(data));
+      case kGgufTypeU16:      return static_cast<T>(ReadValue<uint16_t>(data));
+      case kGgufTypeI16:      return static_cast<T>(ReadValue<int16_t>(data));
+      case kGgufTypeU32:      return static_cast<T>(ReadValue<uint32_t>(data));
+      case kGgufTypeI32:      return static_cast<T>(ReadValue<int32_t>(data));
+      case kGgufTypeU64:      return static_cast<T>(ReadValue<uint64_t>(data));
+      case kGgufTypeI64:      return static_cast<T>(ReadValue<int64_t>(data));
+      case kGgufTypeFloat32:
+        if constexpr (std::is_floating_point_v<T>)
+          return static_cast<T>(ReadValue<float>(data));
+        break;
+      case kGgufTypeFloat64:
+        if constexpr (std::is_floating_point_v<T>)
+          return static_cast<T>(ReadValue<double>(data));
+        break;
+      default: break;
+    }
   }
+  throw std::runtime_error("failed to cast " + std::string(key) + " to " + Demangle(typeid(T).name()));
+}
 
-  // readstring reads and returns a string converted to std::string; the string is stored as <len><string>
-  std::string readstring()
+// ShardPaths returns the paths of all files of a model split into multiple files
+// ("<name>-00001-of-00003.gguf") for the path of any of the files, or the path otherwise.
+std::vector<std::string> ShardPaths(const std::string& path)
+{
+  static const std::regex split("(.*)-([0-9]{5})-of-([0-9]{5})\\.gguf");
+  std::smatch match;
+  if (!std::regex_match(path, match, split) || std::stoul(match[3]) == 0)
+    return {path};
+
+  std::vector<std::string> paths;
+  size_t count = std::stoul(match[3]);
+  char suffix[64];
+  for (size_t i = 1; i <= count; i++)
   {
-    std::string str;
-    uint64_t size;
-    read(size);
-    str.resize(size);
-    ifs_.read(&str[0], size);
-    return str;
+    snprintf(suffix, sizeof(suffix), "-%05zu-of-%05zu.gguf", i, count);
+    paths.push_back(match[1].str() + suffix);
   }
+  return paths;
+}
 
-  template <typename T>
-  auto readarray(size_t size)
-  {
-    if constexpr (std::is_same<T, std::string>::value)
-    {
-      std::vector<std::string> array(size);
-      for (size_t i = 0; i < size; i++)
-        array[i] = readstring();
-      return array;
-    }
-    else if constexpr (std::is_same<T, bool>::value)
-    {
-      std::vector<T> array;
-      for (size_t i = 0; i < size; i++)
-        array[i] = read<bool>();
-      return array;
-    }
-    else
-    {
-      std::vector<T> array;
-      array.resize(size);
-      ifs_.read(reinterpret_cast<char*>(&array[0]), sizeof(T) * size);
-      return array;
-    }
-  }
+// SkipValue advances the view past a value of the provided (non-array) type.
+void SkipValue(MMapView& view, GgmlType type)
+{
+  if (type == kGgufTypeString)
+    view.ReadStringView();
+  else if (type < std::size(GgmlTypeSize) && GgmlTypeSize[type] != 0)
+    view.Seek(GgmlTypeSize[type]);
+  else
+    throw std::runtime_error("invalid value type in key-value table " + std::to_string(type));
+}
 
-  std::ifstream& ifs_;
-};
+} // end of namespace
 
 
-GgmlFile::GgmlValue GgmlFile::ReadArray(ifstream_helper& is)
+const std::type_info* GgmlDataTypeInfo(GgmlDataType type)
 {
-  auto type = is.read<GgmlType>();
-  auto size = is.read<uint64_t>();
-
-  switch(type)
+  switch (type)
   {
-    case kGgufTypeU8:       return GgmlValue{type, size, is.readarray<uint8_t>(size)}; break;
-    case kGgufTypeI8:       return GgmlValue{type, size, is.readarray<int8_t>(size)}; break;
-    case kGgufTypeU16:      return GgmlValue{type, size, is.readarray<uint16_t>(size)}; break;
-    case kGgufTypeI16:      return GgmlValue{type, size, is.readarray<int16_t>(size)}; break;
-    case kGgufTypeU32:      return GgmlValue{type, size, is.readarray<uint32_t>(size)}; break;
-    case kGgufTypeI32:      return GgmlValue{type, size, is.readarray<int32_t>(size)}; break;
-    case kGgufTypeU64:      return GgmlValue{type, size, is.readarray<uint64_t>(size)}; break;
-    case kGgufTypeI64:      return GgmlValue{type, size, is.readarray<int64_t>(size)}; break;
-    case kGgufTypeFloat32:  return GgmlValue{type, size, is.readarray<float>(size)}; break;
-    case kGgufTypeFloat64:  return GgmlValue{type, size, is.readarray<double>(size)}; break;
-    case kGgufTypeBool:     return GgmlValue{type, size, is.readarray<bool>(size)}; break;
-    case kGgufTypeString:   return GgmlValue{type, size, is.readarray<std::string>(size)}; break;
-    default: throw std::runtime_error("invalid value type in key-value table " + std::to_string(type));
+    case kGgmlDataTypeF32:  return &typeid(float);
+    case kGgmlDataTypeF16:  return &typeid(grid::float16_t);
+    case kGgmlDataTypeBF16: return &typeid(grid::bfloat16_t);
+    case kGgmlDataTypeQ4_0: return &typeid(grid::BlockQ4_0);
+    case kGgmlDataTypeQ8_0: return &typeid(grid::BlockQ8_0);
+    case kGgmlDataTypeQ4_K: return &typeid(grid::BlockQ4_K);
+    case kGgmlDataTypeQ5_K: return &typeid(grid::BlockQ5_K);
+    case kGgmlDataTypeQ6_K: return &typeid(grid::BlockQ6_K);
+    default: return nullptr;
   }
 }
 
 
-std::tuple<std::string, GgmlFile::GgmlValue> GgmlFile::ReadKeyValue(ifstream_helper& is)
+std::tuple<std::string_view, GgmlFile::GgmlValue> GgmlFile::ReadKeyValue(MMapView& view)
 {
-  std::string key = is.readstring();
-  auto type = is.read<GgmlType>();
-  switch (type)
+  std::string_view key = view.ReadStringView();
+  auto type = static_cast<GgmlType>(view.Read<uint32_t>());
+
+  if (type != kGgufTypeArray)
   {
-    case kGgufTypeU8:       return std::make_tuple(key, GgmlValue{type, -1, is.read<uint8_t>()}); break;
-    case kGgufTypeI8:       return std::make_tuple(key, GgmlValue{type, -1, is.read<int8_t>()}); break;
-    case kGgufTypeU16:      return std::make_tuple(key, GgmlValue{type, -1, is.read<uint16_t>()}); break;
-    case kGgufTypeI16:      return std::make_tuple(key, GgmlValue{type, -1, is.read<int16_t>()}); break;
-    case kGgufTypeU32:      return std::make_tuple(key, GgmlValue{type, -1, is.read<uint32_t>()}); break;
-    case kGgufTypeI32:      return std::make_tuple(key, GgmlValue{type, -1, is.read<int32_t>()}); break;
-    case kGgufTypeU64:      return std::make_tuple(key, GgmlValue{type, -1, is.read<uint64_t>()}); break;
-    case kGgufTypeI64:      return std::make_tuple(key, GgmlValue{type, -1, is.read<int64_t>()}); break;
-    case kGgufTypeFloat32:  return std::make_tuple(key, GgmlValue{type, -1, is.read<float>()}); break;
-    case kGgufTypeFloat64:  return std::make_tuple(key, GgmlValue{type, -1, is.read<double>()}); break;
-    case kGgufTypeBool:     return std::make_tuple(key, GgmlValue{type, -1, is.read<bool>()}); break;
-    case kGgufTypeString:   return std::make_tuple(key, GgmlValue{type, -1, is.readstring()}); break;
-    case kGgufTypeArray:    return std::make_tuple(key, ReadArray(is)); break;
-    default: throw std::runtime_error("invalid value type in key-value table" + std::to_string(type));
+    const char* data = static_cast<const char*>(view.Address());
+    SkipValue(view, type);
+    return std::make_tuple(key, GgmlValue{type, type, 1, data});
   }
+
+  auto element_type = static_cast<GgmlType>(view.Read<uint32_t>());
+  auto count = view.Read<uint64_t>();
+  const char* data = static_cast<const char*>(view.Address());
+
+  if (element_type == kGgufTypeString)
+  {
+    for (uint64_t i = 0; i < count; i++)
+      view.ReadStringView();
+  }
+  else if (element_type < std::size(GgmlTypeSize) && GgmlTypeSize[element_type] != 0)
+  {
+    if (count > view.Remaining() / GgmlTypeSize[element_type])
+      throw std::runtime_error("array " + std::string(key) + " exceeds the file");
+    view.Seek(count * GgmlTypeSize[element_type]);
+  }
+  else
+    throw std::runtime_error("invalid array type in key-value table " + std::to_string(element_type));
+
+  return std::make_tuple(key, GgmlValue{type, element_type, count, data});
+}
+
+
+const GgmlFile::GgmlValue& GgmlFile::GetKeyValue(std::string_view key) const
+{
+  auto it = kv_map_.find(key);
+  if (it == kv_map_.end())
+    throw std::runtime_error(std::string(key) + " missing in model kv table");
+  return it->second;
 }
 
 
 template <typename T>
-const T& GgmlFile::GetValue(std::string key) const
+T GgmlFile::GetValue(std::string_view key) const
+{
+  const GgmlValue& value = GetKeyValue(key);
+  return ConvertValue<T>(key, value.type, value.data);
+}
+
+
+template <typename T>
+T GgmlFile::GetValue(std::string_view key, T default_value) const
 {
   auto it = kv_map_.find(key);
   if (it == kv_map_.end())
-    throw std::runtime_error(key + " missing in model kv table");
-  try {
-    return std::any_cast<const T&>(it->second.value);
-  } catch (...) {
-    throw std::runtime_error("failed to cast " + key + " to " + Demangle(typeid(T).name()));
-  }
+    return default_value;
+  return ConvertValue<T>(key, it->second.type, it->second.data);
 }
 
 
-const GgmlFile::GgmlTensor& GgmlFile::GetTensor(std::string key) const
+template <typename T>
+std::vector<T> GgmlFile::GetArray(std::string_view key) const
 {
-  auto it = tensor_map_.find(key);
-  if (it == tensor_map_.end())
-    throw std::runtime_error("no such tensor: " + key);
-  return it->second;
+  const GgmlValue& value = GetKeyValue(key);
+  if (value.type != kGgufTypeArray)
+    throw std::runtime_error(std::string(key) + " is not an array");
+
+  std::vector<T> array;
+  array.reserve(value.count);
+  const char* data = value.data;
+  for (uint64_t i = 0; i < value.count; i++)
+  {
+    array.push_back(ConvertValue<T>(key, value.element_type, data));
+    data += value.element_type == kGgufTypeString
+      ? sizeof(uint64_t) + ReadValue<uint64_t>(data)
+      : GgmlTypeSize[value.element_type];
+  }
+  return array;
 }
 
+
 //
 // GgmlFile
 //
 
-void GgmlFile::Load()
+void GgmlFile::LoadShard(GgmlShard& shard)
 {
-  std::ifstream ifs(path_, std::ios::in | std::ios::binary);
-  if (!ifs)
-    throw std::runtime_error("failed to open file");
-
-  ifstream_helper is(ifs);
-  is.read(magic_);
+  shard.mmap.reset(MMap::MMapFile(shard.path));
+  size_t file_size = shard.mmap->Size();
 
-  if (magic_ != kGgmlMagicGGUF)
-    throw std::runtime_error("not a 'gguf' file");
+  MMapView view(shard.mmap);
+  if (view.Read<uint32_t>() != kGgmlMagicGGUF)
+    throw std::runtime_error("not a 'gguf' file: " + shard.path);
 
-  is.read(version_);
-  if (version_ == 1)
+  auto version = view.Read<uint32_t>();
+  if (version == 1)
     throw std::runtime_error("gguf version 1 not supported");
 
-  is.read(n_tensors_);
-  is.read(n_kv_);
+  shard.n_tensors = view.Read<uint64_t>();
+  auto n_kv = view.Read<uint64_t>();
 
-  // read key-value information
-  for (uint64_t i = 0; i < n_kv_; ++i)
+  // the keys and values remain in the mapped file and are converted when accessed
+  for (uint64_t i = 0; i < n_kv; ++i)
   {
-    auto [key, value] = ReadKeyValue(is);
-    kv_map_[key] = value;
+    auto [key, value] = ReadKeyValue(view);
+    shard.kv_map[key] = value;
   }
 
-  model_arch_ = GetValue<std::string>("general.architecture");
-  ftype_ = static_cast<GgmlDataType>(GetValue<uint32_t>("general.file_type"));
+  size_t alignment = 32;
+  if (auto it = shard.kv_map.find("general.alignment"); it != shard.kv_map.end())
+    alignment = ConvertValue<uint32_t>(it->first, it->second.type, it->second.data);
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    throw std::runtime_error("invalid alignment " + std::to_string(alignment));
 
   //
-  // Tokens
+  // Tensors
   //
 
-  for (uint64_t i = 0; i < n_tensors_; ++i)
+  shard.tensors.reserve(shard.n_tensors);
+  for (uint64_t i = 0; i < shard.n_tensors; ++i)
   {
-    std::string name = is.readstring();
-    auto rank = is.read<int>();
-    auto dims = is.readarray<int64_t>(rank); // note that dims are inverse ordered
-    auto type = is.read<GgmlType>();
-    auto offset = is.read<size_t>();
+    std::string_view name = view.ReadStringView();
+    auto rank = view.Read<uint32_t>();
+    if (rank > 4)
+      throw std::runtime_error("invalid rank of tensor " + std::string(name));
+
+    // note that dims are inverse ordered, i.e. {cols, rows}
+    size_t count = 1;
+    size_t cols = 1;
+    for (uint32_t d = 0; d < rank; d++)
+    {
+      size_t dim = view.Read<uint64_t>();
+      if (d == 0)
+        cols = dim;
+      count *= dim;
+    }
+    size_t rows = rank > 1 ? count / std::max(cols, size_t{1}) : 0;
 
-    size_t size = GgmlFileTypeSize[ftype_];
-    for (int i = 0; i < rank; i++)
-      size *= dims[i];
+    auto type = static_cast<GgmlDataType>(view.Read<uint32_t>());
+    auto offset = view.Read<uint64_t>();
+    if (offset % alignment != 0)
+      throw std::runtime_error("tensor " + std::string(name) + " is not aligned");
 
-    tensor_map_[name] = GgmlTensor{type, offset, size};
+    // The size of tensors with an unsupported data type is 0.
+    size_t size = 0;
+    if (type >= 0 && type < kGgmlDataTypeCount && QuantSize[type] != 0)
+      size = count / QuantSize[type] * GgmlFileTypeSize[type];
+
+    shard.tensors.emplace_back(name, GgmlTensor{type, offset, size, rows, cols});
   }
 
-  // TODO: check for updated alignment in KV
-  size_t offset = ifs.tellg();
-  data_offset_ = (offset + 31) & -32;
+  shard.data_offset = (view.Offset() + alignment - 1) & ~(alignment - 1);
+  // compare without adding the offsets from the file, which could wrap around
+  for (auto& [name, tensor] : shard.tensors)
+    if (shard.data_offset > file_size || tensor.offset > file_size - shard.data_offset ||
+        tensor.size > file_size - shard.data_offset - tensor.offset)
+      throw std::runtime_error("tensor " + std::string(name) + " exceeds the file");
+}
 
-  ifs.seekg(0, ifs.end);
-  file_size_ = ifs.tellg();
-  ifs.close();
 
-  if (!ifs.good())
-    throw std::runtime_error("failed to read file");
+void GgmlFile::Load()
+{
+  std::vector<std::string> paths = ShardPaths(path_);
+  shards_.resize(paths.size());
+  for (size_t i = 0; i < paths.size(); i++)
+    shards_[i].path = paths[i];
+
+  // the startup time is bounded by the slowest shard instead of the sum of all shards, with at
+  // most a thread per core
+  size_t threads = std::min<size_t>(paths.size(), std::max(1U, std::thread::hardware_concurrency()));
+  ThreadPool(threads).Parallel(paths.size(), [this](size_t i) { LoadShard(shards_[i]); });
+
+  // the first shard includes the key-value table of the model
+  kv_map_ = std::move(shards_[0].kv_map);
+  if (GetValue<uint32_t>("split.count", 1) != shards_.size())
+    throw std::runtime_error("model is split into " + std::to_string(GetValue<uint32_t>("split.count")) +
+                             " files, found " + std::to_string(shards_.size()));
+
+  model_arch_ = GetValue<std::string_view>("general.architecture");
+  auto file_type = GetValue<uint32_t>("general.file_type");
+  ftype_ = file_type < std::size(GgmlFileToDataType) ? GgmlFileToDataType[file_type] : kGgmlDataTypeInvalid;
 
   parameters_.dim_ = GetValue<uint32_t>(model_arch_ + ".embedding_length");
-  parameters_.vocab_size_ = GetValue<std::vector<std::string>>("tokenizer.ggml.tokens").size();
+  parameters_.vocab_size_ = GetKeyValue("tokenizer.ggml.tokens").count;
   parameters_.hidden_dim_ = GetValue<uint32_t>(model_arch_ + ".feed_forward_length");
   parameters_.num_layers_ = GetValue<uint32_t>(model_arch_ + ".block_count");
   parameters_.num_heads_ = GetValue<uint32_t>(model_arch_ + ".attention.head_count");
@@ -249,62 +335,246 @@ void GgmlFile::Load()
   //llama.rope.dimension_count: 128
   //llama.attention.layer_norm_rms_epsilon: 1e-05
   //llama.rope.freq_base: 10000
+
+  // combine the tensors of the shards with offsets in the mapping of all shards (MMap::MMapFiles)
+  std::unordered_map<std::string_view, GgmlTensor> tensor_map;
+  size_t base = 0;
+  for (auto& shard : shards_)
+  {
+    tensor_map.reserve(tensor_map.size() + shard.n_tensors);
+    for (auto& [name, tensor] : shard.tensors)
+    {
+      auto [it, inserted] = tensor_map.emplace(name, tensor);
+      if (!inserted)
+        throw std::runtime_error("tensor " + std::string(name) + " exists in multiple files");
+      it->second.offset += base + shard.data_offset;
+    }
+    base = (base + shard.mmap->Size() + MMap::PageSize() - 1) & ~(MMap::PageSize() - 1);
+    shard.tensors.clear();
+  }
+
+  // the names are only looked up once to build the tensor directory
+  auto set_tensor = [&](TensorType type, size_t layer) {
+    char name[64];
+    snprintf(name, sizeof(name), TensorNames[type], static_cast<int>(layer));
+    auto it = tensor_map.find(name);
+    if (it == tensor_map.end())
+      throw std::runtime_error("no such tensor: " + std::string(name));
+    const GgmlTensor& tensor = it->second;
+    if (GgmlDataTypeInfo(tensor.type) == nullptr)
+      throw std::runtime_error("data type of tensor " + std::string(name) + " not supported");
+    SetTensorInfo(type, layer, TensorInfo{tensor.offset, tensor.size, GgmlDataTypeInfo(tensor.type), 1,
+                                          tensor.rows, tensor.cols});
+  };
+
+  for (size_t layer = 0; layer < parameters_.num_layers_; layer++)
+    for (auto type : {kAttentionRms, kAttentionQuery, kAttentionKey, kAttentionValue, kFeedForwardWo,
+                      kFeedForwardW1, kFeedForwardW2, kFeedForwardW3, kFeedForwardRms})
+      set_tensor(type, layer);
+  for (auto type : {kEmbeddings, kFinalRms, kOutput})
+    set_tensor(type, 0);
+
+  ValidateTensors(base);
 }
 
 
 const std::type_info& GgmlFile::DataType() const
 {
-  switch (ftype_)
-  {
-    case kGgmlDataTypeF32:  return typeid(float);
-    case kGgmlDataTypeF16:  return typeid(grid::float16_t);
-    default: throw std::runtime_error("DataType not supported");
-  }
+  if (const std::type_info* data_type = GgmlDataTypeInfo(ftype_))
+    return *data_type;
+  throw std::runtime_error("DataType not supported");
 }
 
 
 void GgmlFile::GetTokenizer(LLaMAVocab& vocab) const
 {
-  vocab.scores_.resize(parameters_.vocab_size_);
-  const auto tokens = GetValue<std::vector<std::string>>("tokenizer.ggml.tokens");
-  const auto scores = GetValue<std::vector<float>>("tokenizer.ggml.scores");
+  const auto tokens = GetArray<std::string_view>("tokenizer.ggml.tokens");
+  const auto scores = GetArray<float>("tokenizer.ggml.scores");
+  if (tokens.size() != parameters_.vocab_size_ || scores.size() != parameters_.vocab_size_)
+    throw std::runtime_error("tokens and scores don't match the vocabulary size");
+
   vocab.bos_token_ = GetValue<uint32_t>("tokenizer.ggml.bos_token_id");
   vocab.eos_token_ = GetValue<uint32_t>("tokenizer.ggml.eos_token_id");
-  vocab.add_bos_token_ = GetValue<bool>("tokenizer.ggml.add_bos_token");
-  vocab.add_eos_token_ = GetValue<bool>("tokenizer.ggml.add_eos_token");
+  vocab.add_bos_token_ = GetValue<bool>("tokenizer.ggml.add_bos_token", true);
+  vocab.add_eos_token_ = GetValue<bool>("tokenizer.ggml.add_eos_token", false);
+
+  vocab.Build(tokens, scores);
+}
+
+
+MMap* GgmlFile::MapTensors(int flags, size_t threads) const
+{
+  return MMap::MMapFiles(Paths(), flags, threads);
+}
+
+
+std::vector<std::string> GgmlFile::Paths() const
+{
+  std::vector<std::string> paths;
+  for (auto& shard : shards_)
+    paths.push_back(shard.path);
+  return paths;
+}
+
 
-  for (size_t i = 0; i < parameters_.vocab_size_; i++)
+//
+// GgmlWriter
+//
+
+GgmlWriter::GgmlWriter(const LLaMAModel::Parameters& parameters, const LLaMAVocab& vocab, uint32_t file_type)
+{
+  AddKeyValue("general.architecture", std::string("llama"));
+  AddKeyValue("general.file_type", file_type);
+  AddKeyValue("general.alignment", static_cast<uint32_t>(kAlignment));
+
+  AddKeyValue("llama.embedding_length", static_cast<uint32_t>(parameters.dim_));
+  AddKeyValue("llama.feed_forward_length", static_cast<uint32_t>(parameters.hidden_dim_));
+  AddKeyValue("llama.block_count", static_cast<uint32_t>(parameters.num_layers_));
+  AddKeyValue("llama.attention.head_count", static_cast<uint32_t>(parameters.num_heads_));
+  AddKeyValue("llama.attention.head_count_kv", static_cast<uint32_t>(parameters.num_kv_heads_));
+  AddKeyValue("llama.context_length", static_cast<uint32_t>(parameters.max_seq_len_));
+  AddKeyValue("llama.rope.dimension_count", static_cast<uint32_t>(parameters.dim_ / parameters.num_heads_));
+
+  std::vector<std::string> tokens(vocab.Size());
+  std::vector<float> scores(vocab.Size());
+  for (size_t i = 0; i < vocab.Size(); i++)
   {
-    vocab.tokens_[tokens[i]] = i;
-    vocab.scores_[i] = LLaMAVocab::TokenScore{tokens[i], scores[i]};
+    tokens[i] = vocab.Text(i);
+    scores[i] = vocab.Score(i);
   }
+
+  AddKeyValue("tokenizer.ggml.model", std::string("llama"));
+  AddKeyValue("tokenizer.ggml.tokens", tokens);
+  AddKeyValue("tokenizer.ggml.scores", scores);
+  AddKeyValue("tokenizer.ggml.bos_token_id", vocab.bos_token_);
+  AddKeyValue("tokenizer.ggml.eos_token_id", vocab.eos_token_);
+  AddKeyValue("tokenizer.ggml.add_bos_token", vocab.add_bos_token_);
+  AddKeyValue("tokenizer.ggml.add_eos_token", vocab.add_eos_token_);
 }
 
 
-MMap* GgmlFile::MapTensors() const
+std::string GgmlWriter::TensorName(LLaMAFile::TensorType type, size_t layer)
 {
-  return MMap::MMapFile(path_);
+  char name[64];
+  snprintf(name, sizeof(name), TensorNames[type], static_cast<int>(layer));
+  return name;
 }
 
 
-std::tuple<size_t, size_t> GgmlFile::GetTensorOffset(TensorType type, size_t nargs, ...) const
+size_t GgmlWriter::AddTensor(const std::string& name, GgmlDataType type, size_t rows, size_t cols)
 {
-  va_list va;
-  va_start(va, nargs);
-  std::string name = TensorNames[type];
+  if (type < 0 || type >= kGgmlDataTypeCount || QuantSize[type] == 0 || cols % QuantSize[type] != 0)
+    throw std::runtime_error("invalid data type for tensor " + name);
+
+  std::vector<uint64_t> dims{cols};
+  if (rows != 0)
+    dims.push_back(rows);
+
+  size_t size = std::max(rows, size_t{1}) * cols / QuantSize[type] * GgmlFileTypeSize[type];
+  tensors_.push_back(GgmlTensorInfo{name, type, dims, data_size_, size});
+  data_size_ += (size + kAlignment - 1) & ~(kAlignment - 1);
+  return size;
+}
+
 
-  if (nargs > 0)
+void GgmlWriter::WriteHeader(std::ostream& os) const
+{
+  std::string header;
+  uint32_t magic = kGgmlMagicGGUF;
+  uint32_t version = 3;
+  uint64_t n_tensors = tensors_.size();
+  header.append(reinterpret_cast<const char*>(&magic), sizeof(magic));
+  header.append(reinterpret_cast<const char*>(&version), sizeof(version));
+  header.append(reinterpret_cast<const char*>(&n_tensors), sizeof(n_tensors));
+  header.append(reinterpret_cast<const char*>(&n_kv_), sizeof(n_kv_));
+  header.append(kv_table_);
+
+  for (auto& tensor : tensors_)
   {
-    size_t len = name.size() + nargs * 100;
-    name.resize(len);
-    int cnt = vsnprintf(&name[0], len, TensorNames[type], va);
-    if (cnt < 0 || static_cast<size_t>(cnt) == len)
-      throw std::runtime_error("");
-    name.resize(cnt);
+    uint64_t length = tensor.name.size();
+    uint32_t rank = tensor.dims.size();
+    uint32_t type = tensor.type;
+    uint64_t offset = tensor.offset;
+    header.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    header.append(tensor.name);
+    header.append(reinterpret_cast<const char*>(&rank), sizeof(rank));
+    header.append(reinterpret_cast<const char*>(tensor.dims.data()), rank * sizeof(uint64_t));
+    header.append(reinterpret_cast<const char*>(&type), sizeof(type));
+    header.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
   }
 
-  const GgmlTensor& tensor = GetTensor(name);
-  return std::make_tuple(tensor.offset + data_offset_, tensor.size);
+  header.resize((header.size() + kAlignment - 1) & ~(kAlignment - 1), '\0');
+  os.write(header.data(), header.size());
+}
+
+
+void GgmlWriter::WriteTensor(std::ostream& os, const void* data, size_t size)
+{
+  if (next_tensor_ >= tensors_.size() || tensors_[next_tensor_].size != size)
+    throw std::runtime_error("tensor data doesn't match the added tensor");
+
+  static const char padding[kAlignment] = {};
+  os.write(static_cast<const char*>(data), size);
+  os.write(padding, ((size + kAlignment - 1) & ~(kAlignment - 1)) - size);
+  next_tensor_++;
+}
+
+
+template <typename T>
+void GgmlWriter::Append(const T& value)
+{
+  kv_table_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void GgmlWriter::Append(const std::string& value)
+{
+  Append(static_cast<uint64_t>(value.size()));
+  kv_table_.append(value);
+}
+
+void GgmlWriter::AddKeyValue(const std::string& key, uint32_t value)
+{
+  Append(key);
+  Append(static_cast<uint32_t>(kGgufTypeU32));
+  Append(value);
+  n_kv_++;
+}
+
+void GgmlWriter::AddKeyValue(const std::string& key, bool value)
+{
+  Append(key);
+  Append(static_cast<uint32_t>(kGgufTypeBool));
+  Append(static_cast<uint8_t>(value));
+  n_kv_++;
+}
+
+void GgmlWriter::AddKeyValue(const std::string& key, const std::string& value)
+{
+  Append(key);
+  Append(static_cast<uint32_t>(kGgufTypeString));
+  Append(value);
+  n_kv_++;
+}
+
+void GgmlWriter::AddKeyValue(const std::string& key, const std::vector<std::string>& values)
+{
+  Append(key);
+  Append(static_cast<uint32_t>(kGgufTypeArray));
+  Append(static_cast<uint32_t>(kGgufTypeString));
+  Append(static_cast<uint64_t>(values.size()));
+  for (auto& value : values)
+    Append(value);
+  n_kv_++;
+}
+
+void GgmlWriter::AddKeyValue(const std::string& key, const std::vector<float>& values)
+{
+  Append(key);
+  Append(static_cast<uint32_t>(kGgufTypeArray));
+  Append(static_cast<uint32_t>(kGgufTypeFloat32));
+  Append(static_cast<uint64_t>(values.size()));
+  kv_table_.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+  n_kv_++;
 }
 
 } // end of namespace grid
@@ -9,20 +9,22 @@
 #ifndef _GGML_H
 #define _GGML_H
 
-#include <any>
+#include <memory>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
-#include <map>
 
 #include <grid/models/llama.h>
+#include <grid/tensor/float16.h>
 #include <grid/tensor/mmap.h>
+#include <grid/tensor/quantized.h>
 #include <grid/tensor/tensor.h>
 
 #include "llama_vocab.h"
 
 namespace grid {
 
-struct ifstream_helper;
-
 enum GgmlMagic
 {
   kGgmlMagicGGJT = 0x67676a74u, // 'ggjt'
@@ -85,20 +87,19 @@ enum GgmlDataType
   kGgmlDataTypeQ5_K = 13,
   kGgmlDataTypeQ6_K = 14,
   kGgmlDataTypeQ8_K = 15,
-  kGgmlDataTypeI8,
-  kGgmlDataTypeI16,
-  kGgmlDataTypeI32,
+  // 16-23 are the IQ (importance matrix) quantizations
+  kGgmlDataTypeI8   = 24,
+  kGgmlDataTypeI16  = 25,
+  kGgmlDataTypeI32  = 26,
+  kGgmlDataTypeI64  = 27,
+  kGgmlDataTypeF64  = 28,
+  // 29 is IQ1_M
+  kGgmlDataTypeBF16 = 30,
   kGgmlDataTypeCount,
 };
 
-using float16_t=int16_t;
-
-const size_t kQuantsQ4_0 = 32;
-struct BlockQ4_0
-{
-  float16_t delta;
-  uint8_t qs[kQuantsQ4_0 / 2];
-};
+// Note that the Q4_0 and Q8_0 blocks are defined with the tensor library (grid/tensor/quantized.h).
+const size_t kQuantsQ4_0 = BlockQ4_0::kQuants;
 
 const size_t kQuantsQ4_1 = 32;
 struct BlockQ4_1
@@ -124,12 +125,7 @@ struct BlockQ5_1 {
   uint8_t qs[kQuantsQ5_0 / 2];
 };
 
-const size_t kQuantsQ8_0 = 32;
-struct BlockQ8_0
-{
-  float16_t delta;
-  uint8_t qs[kQuantsQ8_0];
-};
+const size_t kQuantsQ8_0 = BlockQ8_0::kQuants;
 
 const size_t kQuantsQ8_1 = 32;
 struct BlockQ8_1 {
@@ -138,12 +134,40 @@ struct BlockQ8_1 {
   uint8_t qs[kQuantsQ8_1];
 };
 
+// Sizes of a value or a block of values for each data type; 0 for unsupported types.
 static const size_t GgmlFileTypeSize[kGgmlDataTypeCount] =
 {
-  /* kF32 */  sizeof(float),
-  /* kF16 */  sizeof(float16_t),
-  /* kQ4_0 */ sizeof(BlockQ4_0),
-  // TODO: complete table
+  /* kGgmlDataTypeF32           */  sizeof(float),
+  /* kGgmlDataTypeF16           */  sizeof(float16_t),
+  /* kGgmlDataTypeQ4_0          */  sizeof(BlockQ4_0),
+  /* kGgmlDataTypeQ4_1          */  sizeof(BlockQ4_1),
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* kGgmlDataTypeQ5_0          */  sizeof(BlockQ5_0),
+  /* kGgmlDataTypeQ5_1          */  sizeof(BlockQ5_1),
+  /* kGgmlDataTypeQ8_0          */  sizeof(BlockQ8_0),
+  /* kGgmlDataTypeQ8_1          */  sizeof(BlockQ8_1),
+  /* kGgmlDataTypeQ2_K          */  0,
+  /* kGgmlDataTypeQ3_K          */  0,
+  /* kGgmlDataTypeQ4_K          */  sizeof(BlockQ4_K),
+  /* kGgmlDataTypeQ5_K          */  sizeof(BlockQ5_K),
+  /* kGgmlDataTypeQ6_K          */  sizeof(BlockQ6_K),
+  /* kGgmlDataTypeQ8_K          */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* kGgmlDataTypeI8            */  sizeof(int8_t),
+  /* kGgmlDataTypeI16           */  sizeof(int16_t),
+  /* kGgmlDataTypeI32           */  sizeof(int32_t),
+  /* kGgmlDataTypeI64           */  sizeof(int64_t),
+  /* kGgmlDataTypeF64           */  sizeof(double),
+  /* unused                     */  0,
+  /* kGgmlDataTypeBF16          */  sizeof(bfloat16_t),
 };
 
 // Note that UNKNOWN is -1
@@ -160,13 +184,33 @@ static const GgmlDataType GgmlFileToDataType[] =
   /*  8: MOSTLY_Q5_0 8          */  kGgmlDataTypeQ5_0,
   /*  9: MOSTLY_Q5_1 9          */  kGgmlDataTypeQ5_1,
   /* 10: MOSTLY_Q2_K 10         */  kGgmlDataTypeQ2_K,
-  /* 11: MOSTLY_Q3_K 11         */  kGgmlDataTypeQ3_K,
-  /* 12: MOSTLY_Q4_K 12         */  kGgmlDataTypeQ4_K,
-  /* 13: MOSTLY_Q5_K 13         */  kGgmlDataTypeQ5_K,
-  /* 14: MOSTLY_Q6_K 14         */  kGgmlDataTypeQ6_K,
+  /* 11: MOSTLY_Q3_K_S 11       */  kGgmlDataTypeQ3_K,
+  /* 12: MOSTLY_Q3_K_M 12       */  kGgmlDataTypeQ3_K,
+  /* 13: MOSTLY_Q3_K_L 13       */  kGgmlDataTypeQ3_K,
+  /* 14: MOSTLY_Q4_K_S 14       */  kGgmlDataTypeQ4_K,
+  /* 15: MOSTLY_Q4_K_M 15       */  kGgmlDataTypeQ4_K,
+  /* 16: MOSTLY_Q5_K_S 16       */  kGgmlDataTypeQ5_K,
+  /* 17: MOSTLY_Q5_K_M 17       */  kGgmlDataTypeQ5_K,
+  /* 18: MOSTLY_Q6_K 18         */  kGgmlDataTypeQ6_K,
+  /* 19: IQ types               */  kGgmlDataTypeInvalid,
+  /* 20: IQ types               */  kGgmlDataTypeInvalid,
+  /* 21: IQ types               */  kGgmlDataTypeInvalid,
+  /* 22: IQ types               */  kGgmlDataTypeInvalid,
+  /* 23: IQ types               */  kGgmlDataTypeInvalid,
+  /* 24: IQ types               */  kGgmlDataTypeInvalid,
+  /* 25: IQ types               */  kGgmlDataTypeInvalid,
+  /* 26: IQ types               */  kGgmlDataTypeInvalid,
+  /* 27: IQ types               */  kGgmlDataTypeInvalid,
+  /* 28: IQ types               */  kGgmlDataTypeInvalid,
+  /* 29: IQ types               */  kGgmlDataTypeInvalid,
+  /* 30: IQ types               */  kGgmlDataTypeInvalid,
+  /* 31: IQ types               */  kGgmlDataTypeInvalid,
+  /* 32: MOSTLY_BF16 32        */  kGgmlDataTypeBF16,
 };
 
-const size_t kQuantsQK_K = 0;  // not implemented
+// K-quants use super-blocks of 256 values; note that the file type only names the type of most
+// tensors, the _M variants, for example, store some tensors with Q6_K.
+const size_t kQuantsQK_K = BlockQ4_K::kQuants;
 static const size_t QuantSize[kGgmlDataTypeCount] =
 {
   /* kGgmlDataTypeF32           */  1,
@@ -185,27 +229,61 @@ static const size_t QuantSize[kGgmlDataTypeCount] =
   /* kGgmlDataTypeQ5_K          */  kQuantsQK_K,
   /* kGgmlDataTypeQ6_K          */  kQuantsQK_K,
   /* kGgmlDataTypeQ8_K          */  kQuantsQK_K,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
+  /* unused                     */  0,
   /* kGgmlDataTypeI8            */  1,
   /* kGgmlDataTypeI16           */  1,
   /* kGgmlDataTypeI32           */  1,
+  /* kGgmlDataTypeI64           */  1,
+  /* kGgmlDataTypeF64           */  1,
+  /* unused                     */  0,
+  /* kGgmlDataTypeBF16          */  1,
 };
 
+/// GgmlDataTypeInfo returns the type of the data type, or nullptr if it isn't supported.
+const std::type_info* GgmlDataTypeInfo(GgmlDataType type);
+
 
 /// GgmlFile handles file formats generated by the Ggml project:
+///
+/// Models split into multiple files ("<name>-00001-of-00003.gguf") are loaded from the path of
+/// any of the files. The headers of the files are read in parallel, and the tensors of all files
+/// are mapped into one range (see MMap::MMapFiles).
 class GgmlFile : public LLaMAFile
 {
+  // GgmlValue refers to a value in the key-value table of the memory-mapped file.
   struct GgmlValue
   {
-    GgmlType  type;
-    ssize_t   size;   // size for arrays, must be -1 otherwise.
-    std::any  value;
+    GgmlType    type;
+    GgmlType    element_type;   // type of the elements for arrays
+    uint64_t    count;          // number of elements for arrays, 1 otherwise
+    const char* data;           // address of the value or the first element
   };
 
   struct GgmlTensor
   {
-    GgmlType  type;
-    size_t    offset;
-    size_t    size;
+    GgmlDataType  type;
+    size_t        offset;         // offset in the mapping of all shards (MapTensors)
+    size_t        size;
+    size_t        rows;           // 0 for vectors
+    size_t        cols;
+  };
+
+  // GgmlShard is one of the files of a model that is split into multiple files (shards).
+  struct GgmlShard
+  {
+    std::string           path;
+    std::shared_ptr<MMap> mmap;           // keys, values, and tensor names refer to the mapping
+    size_t                data_offset;    // offset of the tensor data in the file
+    uint64_t              n_tensors;
+    std::unordered_map<std::string_view, GgmlValue> kv_map;
+    std::vector<std::tuple<std::string_view, GgmlTensor>> tensors;  // offsets from data_offset
   };
 
  public:
@@ -217,25 +295,30 @@ class GgmlFile : public LLaMAFile
   virtual const std::type_info& DataType() const;
   virtual void GetParameters(LLaMAModel::Parameters& p) const      { p = parameters_; }
   virtual void GetTokenizer(LLaMAVocab&) const;
-  virtual MMap* MapTensors() const;
+  virtual MMap* MapTensors(int flags, size_t threads) const;
+  virtual std::vector<std::string> Paths() const;
 
  protected:
-  // LLaMAFile::
-  virtual std::tuple<size_t, size_t> GetTensorOffset(TensorType, size_t num_indices, ...) const;
-
-  // ReadKeyValue reads the next key/value pair from the stream.
-  std::tuple<std::string, GgmlValue> ReadKeyValue(ifstream_helper& is);
+  // LoadShard maps the file of the shard and reads its key-value table and tensor information.
+  void LoadShard(GgmlShard& shard);
 
-  // ReadArray reads and returns a value for an array
-  GgmlValue ReadArray(ifstream_helper& is);
+  // ReadKeyValue reads the next key/value pair from the view without copying the value.
+  std::tuple<std::string_view, GgmlValue> ReadKeyValue(MMapView& view);
 
-  // GetValue looks up and returns the value for the provide key.
+  // GetKeyValue looks up and returns the value for the provided key.
   // It throws an exception if the key cannot be found.
-  template <typename T> const T& GetValue(std::string key) const;
+  const GgmlValue& GetKeyValue(std::string_view key) const;
+
+  // GetValue looks up and returns the value for the provided key converted to T, which can be an
+  // arithmetic type, bool, or std::string_view referring to the mapped file.
+  // It throws an exception if the key cannot be found or the value cannot be converted.
+  template <typename T> T GetValue(std::string_view key) const;
 
-  // GetTensor looks up and returns the tensor of the provided name.
-  // It throws an exception if the tensor cannot be found.
-  const GgmlTensor& GetTensor(std::string key) const;
+  // GetValue returns the value for the provided key or the default value if the key is missing.
+  template <typename T> T GetValue(std::string_view key, T default_value) const;
+
+  // GetArray looks up and returns the elements of the array for the provided key converted to T.
+  template <typename T> std::vector<T> GetArray(std::string_view key) const;
 
  private:
   LLaMAModel::Parameters  parameters_;
@@ -244,16 +327,68 @@ class GgmlFile : public LLaMAFile
   std::string     model_arch_;
   GgmlDataType    ftype_;
 
-  size_t          file_size_;
-  size_t          data_offset_;
+  std::vector<GgmlShard> shards_;
+
+  std::unordered_map<std::string_view, GgmlValue> kv_map_;
+};
 
-  uint32_t        magic_;
-  uint32_t        version_;
-  uint64_t        n_tensors_;
-  uint64_t        n_kv_;
 
-  std::unordered_map<std::string, GgmlValue> kv_map_;
-  std::unordered_map<std::string, GgmlTensor> tensor_map_;
+/// GgmlWriter writes a LLaMA model in the GGUF format (version 3).
+///
+/// The header includes the offsets of all tensors, so all tensors have to be added before the
+/// header is written. The tensor data is then written one tensor at a time in the same order,
+/// which allows to convert large models without holding all tensors in memory.
+class GgmlWriter
+{
+  struct GgmlTensorInfo
+  {
+    std::string           name;
+    GgmlDataType          type;
+    std::vector<uint64_t> dims;   // inverse ordered, i.e. {cols, rows}
+    size_t                offset;
+    size_t                size;
+  };
+
+ public:
+  /// Alignment of the tensor data.
+  static constexpr size_t kAlignment = 32;
+
+  /// Constructor
+  ///
+  /// @param parameters Model parameters.
+  /// @param vocab      Vocabulary and special tokens.
+  /// @param file_type  Dominant data type of the tensors (general.file_type).
+  GgmlWriter(const LLaMAModel::Parameters& parameters, const LLaMAVocab& vocab, uint32_t file_type);
+
+  /// TensorName returns the name of the tensor for the tensor type and layer (if applicable).
+  static std::string TensorName(LLaMAFile::TensorType type, size_t layer = 0);
+
+  /// AddTensor adds a tensor with the data type and dimensions {rows, cols}, or {cols} if rows is
+  /// 0, and returns the size of the tensor data in bytes.
+  size_t AddTensor(const std::string& name, GgmlDataType type, size_t rows, size_t cols);
+
+  /// WriteHeader writes the header including the key-value table and tensor information.
+  void WriteHeader(std::ostream& os) const;
+
+  /// WriteTensor writes the data of the next tensor, which has to be of the added size.
+  void WriteTensor(std::ostream& os, const void* data, size_t size);
+
+ private:
+  // Add* append a key-value pair to the key-value table.
+  void AddKeyValue(const std::string& key, uint32_t value);
+  void AddKeyValue(const std::string& key, bool value);
+  void AddKeyValue(const std::string& key, const std::string& value);
+  void AddKeyValue(const std::string& key, const std::vector<std::string>& values);
+  void AddKeyValue(const std::string& key, const std::vector<float>& values);
+
+  template <typename T> void Append(const T& value);
+  void Append(const std::string& value);
+
+  std::string                 kv_table_;
+  uint64_t                    n_kv_ = 0;
+  std::vector<GgmlTensorInfo> tensors_;
+  size_t                      data_size_ = 0;
+  size_t                      next_tensor_ = 0;
 };
 
 } // end of namespace grid
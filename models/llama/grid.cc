@@ -0,0 +1,215 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <grid/models/llama.h>
+
+#include "grid.h"
+
+namespace grid {
+
+namespace {
+
+size_t Align(size_t offset)
+{
+  return (offset + kGridAlignment - 1) & ~(kGridAlignment - 1);
+}
+
+} // end of namespace
+
+
+//
+// GridFile
+//
+
+void GridFile::Load()
+{
+  mmap_.reset(MMap::MMapFile(path_));
+  const char* base = static_cast<const char*>(mmap_->Address());
+  size_t file_size = mmap_->Size();
+
+  header_ = reinterpret_cast<const GridFileHeader*>(base);
+  if (file_size < sizeof(GridFileHeader) || header_->magic != kGridMagic)
+    throw std::runtime_error("not a 'grid' file");
+  if (header_->version != kGridVersion)
+    throw std::runtime_error("grid version " + std::to_string(header_->version) + " not supported");
+  if (header_->file_size != file_size || header_->num_layers == 0 ||
+      header_->num_layers > file_size / (kGridTensorTypes * sizeof(GridTensorEntry)))
+    throw std::runtime_error("grid file is truncated or invalid");
+
+  size_t entries = header_->num_layers * kGridTensorTypes;
+  if (sizeof(GridFileHeader) + entries * sizeof(GridTensorEntry) > header_->tokens_offset ||
+      header_->tokens_offset > file_size - sizeof(uint32_t) ||
+      header_->vocab_size > (file_size - header_->tokens_offset - sizeof(uint32_t)) /
+                            (sizeof(float) + sizeof(uint32_t)))
+    throw std::runtime_error("grid file is truncated or invalid");
+
+  parameters_.vocab_size_ =   header_->vocab_size;
+  parameters_.dim_ =          header_->dim;
+  parameters_.hidden_dim_ =   header_->hidden_dim;
+  parameters_.num_layers_ =   header_->num_layers;
+  parameters_.num_heads_ =    header_->num_heads;
+  parameters_.num_kv_heads_ = header_->num_kv_heads;
+  parameters_.max_seq_len_ =  header_->max_seq_len;
+
+  auto* directory = reinterpret_cast<const GridTensorEntry*>(base + sizeof(GridFileHeader));
+  for (size_t i = 0; i < entries; i++)
+  {
+    const GridTensorEntry& entry = directory[i];
+    auto* data_type = GgmlDataTypeInfo(static_cast<GgmlDataType>(entry.data_type));
+    if (entry.size != 0)
+      SetTensorInfo(static_cast<TensorType>(i % kGridTensorTypes), i / kGridTensorTypes,
+                    TensorInfo{entry.offset, entry.size, data_type, entry.panel_rows, entry.rows, entry.cols});
+  }
+
+  ValidateTensors(file_size);
+}
+
+
+const std::type_info& GridFile::DataType() const
+{
+  if (const std::type_info* data_type = GgmlDataTypeInfo(static_cast<GgmlDataType>(header_->data_type)))
+    return *data_type;
+  throw std::runtime_error("data type " + std::to_string(header_->data_type) + " not supported");
+}
+
+
+void GridFile::GetTokenizer(LLaMAVocab& vocab) const
+{
+  const char* base = static_cast<const char*>(mmap_->Address());
+  size_t vocab_size = header_->vocab_size;
+  auto* scores = reinterpret_cast<const float*>(base + header_->tokens_offset);
+  auto* offsets = reinterpret_cast<const uint32_t*>(scores + vocab_size);
+  const char* tokens = reinterpret_cast<const char*>(offsets + vocab_size + 1);
+  if (tokens + offsets[vocab_size] > base + mmap_->Size())
+    throw std::runtime_error("tokens exceed the grid file");
+
+  vocab.bos_token_ = header_->bos_token;
+  vocab.eos_token_ = header_->eos_token;
+  vocab.add_bos_token_ = header_->add_bos_token != 0;
+  vocab.add_eos_token_ = header_->add_eos_token != 0;
+
+  // the offsets must not decrease, so all tokens are within the last offset
+  std::vector<std::string_view> texts(vocab_size);
+  for (size_t i = 0; i < vocab_size; i++)
+  {
+    if (offsets[i] > offsets[i + 1])
+      throw std::runtime_error("token offsets of the grid file are invalid");
+    texts[i] = std::string_view(tokens + offsets[i], offsets[i + 1] - offsets[i]);
+  }
+  vocab.Build(texts, std::span(scores, vocab_size));
+}
+
+
+MMap* GridFile::MapTensors(int flags, size_t threads) const
+{
+  return MMap::MMapFile(path_, flags, threads);
+}
+
+
+//
+// GridWriter
+//
+
+GridWriter::GridWriter(const LLaMAModel::Parameters& parameters, const LLaMAVocab& vocab,
+                       GgmlDataType data_type)
+{
+  header_.magic = kGridMagic;
+  header_.version = kGridVersion;
+  header_.data_type = data_type;
+  header_.bos_token = vocab.bos_token_;
+  header_.eos_token = vocab.eos_token_;
+  header_.add_bos_token = vocab.add_bos_token_;
+  header_.add_eos_token = vocab.add_eos_token_;
+  header_.vocab_size = parameters.vocab_size_;
+  header_.dim = parameters.dim_;
+  header_.hidden_dim = parameters.hidden_dim_;
+  header_.num_layers = parameters.num_layers_;
+  header_.num_heads = parameters.num_heads_;
+  header_.num_kv_heads = parameters.num_kv_heads_;
+  header_.max_seq_len = parameters.max_seq_len_;
+
+  if (vocab.Size() != parameters.vocab_size_)
+    throw std::runtime_error("vocabulary doesn't match the vocabulary size");
+
+  for (size_t i = 0; i < vocab.Size(); i++)
+  {
+    token_offsets_.push_back(tokens_.size());
+    scores_.push_back(vocab.Score(i));
+    tokens_.append(vocab.Text(i));
+  }
+  token_offsets_.push_back(tokens_.size());
+  header_.max_token_length = vocab.max_token_length_;
+
+  directory_.resize(parameters.num_layers_ * kGridTensorTypes);
+  header_.tokens_offset = sizeof(GridFileHeader) + directory_.size() * sizeof(GridTensorEntry);
+  header_.file_size = Align(header_.tokens_offset + scores_.size() * sizeof(float) +
+                            token_offsets_.size() * sizeof(uint32_t) + tokens_.size());
+}
+
+
+size_t GridWriter::AddTensor(LLaMAFile::TensorType type, size_t layer, GgmlDataType data_type,
+                             size_t panel_rows, size_t rows, size_t cols)
+{
+  if (data_type < 0 || data_type >= kGgmlDataTypeCount || QuantSize[data_type] == 0 ||
+      cols % QuantSize[data_type] != 0)
+    throw std::runtime_error("invalid data type for tensor " + std::to_string(type));
+  if (type >= kGridTensorTypes || layer >= header_.num_layers)
+    throw std::runtime_error("invalid tensor " + std::to_string(type) + " of layer " + std::to_string(layer));
+
+  size_t index = layer * kGridTensorTypes + type;
+  auto& entry = directory_[index];
+  if (entry.size != 0)
+    throw std::runtime_error("tensor " + std::to_string(type) + " of layer " + std::to_string(layer) +
+                             " already added");
+
+  entry.data_type = data_type;
+  entry.panel_rows = panel_rows;
+  entry.rows = rows;
+  entry.cols = cols;
+  entry.offset = header_.file_size;
+  entry.size = std::max(rows, size_t{1}) * cols / QuantSize[data_type] * GgmlFileTypeSize[data_type];
+  header_.file_size = Align(header_.file_size + entry.size);
+  order_.push_back(index);
+  return entry.size;
+}
+
+
+void GridWriter::WriteHeader(std::ostream& os)
+{
+  os.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  os.write(reinterpret_cast<const char*>(directory_.data()), directory_.size() * sizeof(GridTensorEntry));
+  os.write(reinterpret_cast<const char*>(scores_.data()), scores_.size() * sizeof(float));
+  os.write(reinterpret_cast<const char*>(token_offsets_.data()), token_offsets_.size() * sizeof(uint32_t));
+  os.write(tokens_.data(), tokens_.size());
+
+  position_ = header_.tokens_offset + scores_.size() * sizeof(float) +
+              token_offsets_.size() * sizeof(uint32_t) + tokens_.size();
+}
+
+
+void GridWriter::WriteTensor(std::ostream& os, const void* data, size_t size)
+{
+  if (next_tensor_ >= order_.size() || directory_[order_[next_tensor_]].size != size)
+    throw std::runtime_error("tensor data doesn't match the added tensor");
+
+  static const char padding[kGridAlignment] = {};
+  auto& entry = directory_[order_[next_tensor_]];
+  os.write(padding, entry.offset - position_);
+  os.write(static_cast<const char*>(data), size);
+  position_ = entry.offset + size;
+  next_tensor_++;
+
+  // pad the file to its size after the last tensor
+  if (next_tensor_ == order_.size())
+  {
+    os.write(padding, header_.file_size - position_);
+    position_ = header_.file_size;
+  }
+}
+
+} // end of namespace grid
@@ -0,0 +1,151 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef _GRID_H
+#define _GRID_H
+
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <grid/models/llama.h>
+#include <grid/tensor/mmap.h>
+
+#include "ggml.h"
+#include "llama_vocab.h"
+
+namespace grid {
+
+// The grid file format stores the tensors in the layout of the kernels, i.e. quantized and
+// repacked into panels, so loading a model maps the file without converting or copying tensors.
+//
+// File layout (native byte order):
+//
+//   GridFileHeader
+//   GridTensorEntry[num_layers * kGridTensorTypes]    tensor directory
+//   float[vocab_size]                                 token scores
+//   uint32_t[vocab_size + 1]                          offsets of the tokens in the token strings
+//   char[]                                            token strings
+//   tensor data                                       aligned to kGridAlignment
+//
+// The directory has an entry for each tensor type of each layer, so a tensor is found by its
+// index. Tensors that aren't per layer use the entries of layer 0, and unused entries are empty.
+
+/// kGridMagic is the magic number of grid files ("GRID").
+static constexpr uint32_t kGridMagic = 0x44495247;
+
+/// kGridVersion is the version of the file format.
+static constexpr uint32_t kGridVersion = 1;
+
+/// kGridAlignment is the alignment of the tensor data (page size).
+static constexpr size_t kGridAlignment = 4096;
+
+/// kGridTensorTypes is the number of tensor types in the directory for each layer.
+static constexpr size_t kGridTensorTypes = LLaMAFile::kTensorTypes;
+
+struct GridFileHeader
+{
+  uint32_t  magic;
+  uint32_t  version;
+  uint32_t  data_type;          // dominant data type (GgmlDataType)
+  uint32_t  bos_token;
+  uint32_t  eos_token;
+  uint8_t   add_bos_token;
+  uint8_t   add_eos_token;
+  uint8_t   reserved[2];
+  uint64_t  vocab_size;
+  uint64_t  dim;
+  uint64_t  hidden_dim;
+  uint64_t  num_layers;
+  uint64_t  num_heads;
+  uint64_t  num_kv_heads;
+  uint64_t  max_seq_len;
+  uint64_t  max_token_length;
+  uint64_t  tokens_offset;      // offset of the token scores
+  uint64_t  file_size;
+};
+
+struct GridTensorEntry
+{
+  uint32_t  data_type;          // GgmlDataType
+  uint32_t  panel_rows;         // rows of a panel, or 1 for row-major tensors
+  uint64_t  rows;               // 0 for vectors
+  uint64_t  cols;
+  uint64_t  offset;             // offset from the beginning of the file
+  uint64_t  size;               // size in bytes; 0 for unused entries
+};
+
+static_assert(sizeof(GridFileHeader) == 104 && sizeof(GridTensorEntry) == 40);
+
+
+/// GridFile is a model file in the grid format.
+class GridFile : public LLaMAFile
+{
+ public:
+  /// Constructor
+  ///
+  /// @param path  Path of the model file.
+  GridFile(std::string_view path) : path_(path) {}
+
+  virtual ~GridFile() = default;
+
+  // LLaMAFile::
+  virtual void Load();
+  virtual const std::type_info& DataType() const;
+  virtual void GetParameters(LLaMAModel::Parameters& p) const { p = parameters_; }
+  virtual void GetTokenizer(LLaMAVocab&) const;
+  virtual MMap* MapTensors(int flags, size_t threads) const;
+  virtual std::vector<std::string> Paths() const { return {path_}; }
+
+ private:
+  std::string               path_;
+  std::unique_ptr<MMap>     mmap_;          // header, directory, and tokenizer
+  const GridFileHeader*     header_;
+  LLaMAModel::Parameters    parameters_;
+};
+
+
+/// GridWriter writes a model file in the grid format.
+///
+/// All tensors have to be added before the header is written, and the tensor data is then written
+/// one tensor at a time in the same order.
+class GridWriter
+{
+ public:
+  /// Constructor
+  ///
+  /// @param parameters Model parameters.
+  /// @param vocab      Vocabulary and special tokens.
+  /// @param data_type  Dominant data type of the tensors.
+  GridWriter(const LLaMAModel::Parameters& parameters, const LLaMAVocab& vocab, GgmlDataType data_type);
+
+  /// AddTensor adds the tensor of the type and layer with the data type and dimensions
+  /// {rows, cols}, or {cols} if rows is 0, and returns the size of the tensor data in bytes.
+  size_t AddTensor(LLaMAFile::TensorType type, size_t layer, GgmlDataType data_type, size_t panel_rows,
+                   size_t rows, size_t cols);
+
+  /// WriteHeader writes the header, tensor directory, and tokenizer.
+  void WriteHeader(std::ostream& os);
+
+  /// WriteTensor writes the data of the next tensor, which has to be of the added size.
+  void WriteTensor(std::ostream& os, const void* data, size_t size);
+
+ private:
+  GridFileHeader                header_{};
+  std::vector<GridTensorEntry>  directory_;
+  std::vector<float>            scores_;
+  std::vector<uint32_t>         token_offsets_;
+  std::string                   tokens_;
+  std::vector<size_t>           order_;         // directory indices in the order of AddTensor
+  size_t                        next_tensor_ = 0;
+  size_t                        position_ = 0;  // offset of the next write
+};
+
+} // end of namespace grid
+
+#endif // _GRID_H
@@ -6,7 +6,7 @@
 // The contents of this file are confidential and proprietary to Chris Zankel.
 //
 
-#include <cstdarg>
+#include <algorithm>
 #include <fstream>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -45,40 +45,44 @@ void KarpathyFile::Load()
   parameters_.max_seq_len_ = p.max_seq_len;
 
   ifs.seekg(0, ifs.end);
-  file_size_ = ifs.tellg();
+  size_t file_size = ifs.tellg();
   ifs.close();
 
   if (!ifs.good())
     throw std::runtime_error("failed to read file");
 
   // Note that Karpathy combines the weights for each tensor instead of separating tensors by layer
-  int head_size = p.dim/p.n_heads;
+  size_t dim = parameters_.dim_;
+  size_t hidden_dim = parameters_.hidden_dim_;
+  size_t kv_dim = p.n_heads > 0 ? dim * p.n_kv_heads / p.n_heads : 0;
+  size_t n_layers = parameters_.num_layers_;
   size_t offset = sizeof(FileParameters);
-  embeddings_ = offset;
-  offset += OffsetOf(p.vocab_size * p.dim);
-  attention_rms_ = offset;
-  offset += OffsetOf(p.n_layers * p.dim);
-  wq_ = offset;
-  offset += OffsetOf(p.n_layers * p.dim * p.n_heads * head_size);
-  wk_ = offset;
-  offset += OffsetOf(p.n_layers * p.dim * p.n_kv_heads * head_size);
-  wv_ = offset;
-  offset += OffsetOf(p.n_layers * p.dim * p.n_kv_heads * head_size);
-  wo_ = offset;
-  offset += OffsetOf(p.n_layers * p.dim * p.n_heads * head_size);
-  feed_forward_rms_ = offset;
-  offset += OffsetOf(p.n_layers * p.dim);
-  w1_ = offset;
-  offset += OffsetOf(p.n_layers * p.hidden_dim * p.dim);
-  w2_ = offset;
-  offset += OffsetOf(p.n_layers * p.hidden_dim * p.dim);
-  w3_ = offset;
-  offset += OffsetOf(p.n_layers * p.hidden_dim * p.dim);
-  final_rms_ = offset;
-  offset += OffsetOf(p.dim);
+
+  // add_tensors adds the tensors {rows, cols} of the type for the layers and advances the offset.
+  auto add_tensors = [&](TensorType type, size_t rows, size_t cols, size_t layers) {
+    size_t size = std::max(rows, size_t{1}) * cols * sizeof(float);
+    for (size_t layer = 0; layer < layers; layer++)
+      SetTensorInfo(type, layer, TensorInfo{offset + layer * size, size, &typeid(float), 1, rows, cols});
+    offset += layers * size;
+  };
+
+  add_tensors(kEmbeddings, parameters_.vocab_size_, dim, 1);
+  add_tensors(kAttentionRms, 0, dim, n_layers);
+  add_tensors(kAttentionQuery, dim, dim, n_layers);
+  add_tensors(kAttentionKey, kv_dim, dim, n_layers);
+  add_tensors(kAttentionValue, kv_dim, dim, n_layers);
+  add_tensors(kFeedForwardWo, dim, dim, n_layers);
+  add_tensors(kFeedForwardRms, 0, dim, n_layers);
+  add_tensors(kFeedForwardW1, hidden_dim, dim, n_layers);
+  add_tensors(kFeedForwardW2, dim, hidden_dim, n_layers);
+  add_tensors(kFeedForwardW3, hidden_dim, dim, n_layers);
+  add_tensors(kFinalRms, 0, dim, 1);
   // offset += seq_len * head_size * sizeof(value_type);  // skip freq_cis_{real|imag}
-  // wcls_weights_ = shared_weights ? w->token_embedding_table : offset;
-  // offset += ...
+
+  // the output shares the weights of the embeddings
+  SetTensorInfo(kOutput, 0, GetTensorInfo(kEmbeddings));
+
+  ValidateTensors(file_size);
 }
 
 
@@ -91,79 +95,36 @@ void KarpathyFile::GetTokenizer(LLaMAVocab& vocab) const
   int max_token_length = 0;
   ifs.read(reinterpret_cast<char*>(&max_token_length), sizeof(max_token_length));
 
-  vocab.max_token_length_ = max_token_length;
-  vocab.scores_.resize(parameters_.vocab_size_);
+  // the tokenizer file doesn't include the special tokens, which are the LLaMA defaults
+  vocab.bos_token_ = LLaMAModel::kBOS;
+  vocab.eos_token_ = LLaMAModel::kEOS;
+  vocab.add_bos_token_ = false;
+  vocab.add_eos_token_ = false;
+
+  std::vector<std::string> symbols(parameters_.vocab_size_);
+  std::vector<float> scores(parameters_.vocab_size_);
   for (size_t i = 0; i < parameters_.vocab_size_; i++)
   {
-    float score = 0.0f;
-    ifs.read(reinterpret_cast<char*>(&score), sizeof(score));
+    ifs.read(reinterpret_cast<char*>(&scores[i]), sizeof(float));
     int len = 0;
     ifs.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if (len > max_token_length)
+    if (len < 0 || len > max_token_length)
       throw std::runtime_error("token length exceeds max token length");
 
-    std::string symbol(len, '\0');
-    ifs.read(&symbol[0], len);
-
-    vocab.tokens_[symbol] = i;
-    vocab.scores_[i] = LLaMAVocab::TokenScore{symbol, score};
+    symbols[i].resize(len);
+    ifs.read(&symbols[i][0], len);
   }
 
-  ifs.close();
-}
-
+  std::vector<std::string_view> texts(symbols.begin(), symbols.end());
+  vocab.Build(texts, scores);
 
-MMap* KarpathyFile::MapTensors() const
-{
-  return MMap::MMapFile(path_);
+  ifs.close();
 }
 
 
-std::tuple<size_t, size_t> KarpathyFile::GetTensorOffset(TensorType type, size_t nargs, ...) const
+MMap* KarpathyFile::MapTensors(int flags, size_t threads) const
 {
-  va_list va;
-  va_start(va, nargs);
-
-  size_t layer = 0;
-  if (nargs > 0)
-    layer = va_arg(va, size_t);
-
-  int dim = parameters_.dim_;
-  int hidden_dim = parameters_.hidden_dim_;
-  int n_heads = parameters_.num_heads_;
-  int n_kv_heads = parameters_.num_kv_heads_;
-  int head_size = dim / n_heads;
-
-  size_t size, offset;
-  switch (type)
-  {
-    case kEmbeddings:     // fall through
-    case kOutput:         size = dim * parameters_.vocab_size_;
-                          offset = embeddings_; break;
-    case kAttentionQuery: size = dim * n_heads * head_size;
-                          offset = wq_ + OffsetOf(layer * size); break;
-    case kAttentionKey:   size = dim * n_kv_heads * head_size;
-                          offset = wk_ + OffsetOf(layer * size); break;
-    case kAttentionValue: size = dim * n_kv_heads * head_size;
-                          offset = wv_ + OffsetOf(layer * size); break;
-    case kFeedForwardWo:  size = n_kv_heads * head_size * dim;
-                          offset = wo_ + OffsetOf(layer * size); break;
-    case kFeedForwardW1:  size = hidden_dim * dim;
-                          offset = w1_ + OffsetOf(layer * size); break;
-    case kFeedForwardW2:  size = dim * hidden_dim;
-                          offset = w2_ + OffsetOf(layer * size); break;
-    case kFeedForwardW3:  size = hidden_dim * dim;
-                          offset = w3_ + OffsetOf(layer * size); break;
-    case kFeedForwardRms: size = dim;
-                          offset = feed_forward_rms_ + OffsetOf(layer * size); break;
-    case kAttentionRms:   size = dim;
-                          offset = attention_rms_ + OffsetOf(layer * size); break;
-    case kFinalRms:       size = dim;
-                          offset = final_rms_; break;
-    default: throw std::runtime_error("invalid tensor type " + std::to_string(type));
-  }
-
-  return std::make_tuple(offset, size * sizeof(float));
+  return MMap::MMapFile(path_, flags, threads);
 }
 
 } // end of namespace grid
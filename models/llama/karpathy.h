@@ -42,35 +42,14 @@ class KarpathyFile : public LLaMAFile
   virtual const std::type_info& DataType() const              { return typeid(float); }
   virtual void GetParameters(LLaMAModel::Parameters& p) const { p = parameters_; }
   virtual void GetTokenizer(LLaMAVocab&) const;
-  virtual MMap* MapTensors() const;
-
- protected:
-  // LLaMAFile::
-  virtual std::tuple<size_t, size_t> GetTensorOffset(LLaMAFile::TensorType, size_t nargs, ...) const;
-
- private:
-  // Data is stored as floats
-  size_t OffsetOf(size_t offset) const                        { return sizeof(float) * offset; }
+  virtual MMap* MapTensors(int flags, size_t threads) const;
+  virtual std::vector<std::string> Paths() const              { return {path_, tokenizer_path_}; }
 
  private:
   LLaMAModel::Parameters  parameters_;
 
   std::string tokenizer_path_;
   std::string path_;
-  size_t      file_size_;
-
-  // tensor offsets into the file.
-  size_t embeddings_;
-  size_t final_rms_;
-  size_t attention_rms_;
-  size_t feed_forward_rms_;
-  size_t wq_;
-  size_t wk_;
-  size_t wv_;
-  size_t wo_;
-  size_t w1_;
-  size_t w2_;
-  size_t w3_;
 };
 
 } // end of namespace grid
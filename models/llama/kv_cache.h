@@ -0,0 +1,430 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef _KV_CACHE_H
+#define _KV_CACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <grid/models/llama.h>
+#include <grid/tensor/float16.h>
+#include <grid/tensor/tensor.h>
+
+namespace grid {
+
+/// KVCache stores the keys and values of an attention layer for all positions of a sequence.
+///
+/// The keys and values are stored either in the data type of the model, as half-precision floats,
+/// or as 8-bit integers with a scale for each position and head. Vectors are quantized when they
+/// are stored and dequantized inside the dot products of the attention, so the full-precision
+/// cache is never materialized.
+///
+/// The cache is either sequence-major {max_seq_len, n_kv_heads, head_size}, or head-major
+/// {n_kv_heads, max_seq_len, head_size}, which keeps the rows of a head contiguous.
+template <typename T, typename Dev>
+class KVCache
+{
+  template <typename S> using Storage = Tensor<S, 3, DeviceMemory<Dev>>;
+  using Scales = Tensor<float, 2, DeviceMemory<Dev>>;
+
+ public:
+  KVCache() = default;
+
+  /// Constructor
+  ///
+  /// @param type         Storage type of the keys and values.
+  /// @param layout       Memory layout of the keys and values.
+  /// @param max_seq_len  Maximum number of positions.
+  /// @param n_kv_heads   Number of key/value heads.
+  /// @param head_size    Dimension of a head.
+  KVCache(LLaMAModel::CacheType type, LLaMAModel::CacheLayout layout,
+          size_t max_seq_len, size_t n_kv_heads, size_t head_size)
+    : type_(type),
+      layout_(layout),
+      max_seq_len_(max_seq_len),
+      n_kv_heads_(n_kv_heads),
+      head_size_(head_size),
+      kv_dim_(n_kv_heads * head_size)
+  {
+    std::array<size_t, 3> dims;
+    std::array<size_t, 2> scale_dims;
+    if (layout_ == LLaMAModel::kCacheSequenceMajor)
+    {
+      dims = {max_seq_len, n_kv_heads, head_size};
+      scale_dims = {max_seq_len, n_kv_heads};
+    }
+    else if (layout_ == LLaMAModel::kCacheHeadMajor)
+    {
+      dims = {n_kv_heads, max_seq_len, head_size};
+      scale_dims = {n_kv_heads, max_seq_len};
+    }
+    else
+      throw std::runtime_error("invalid key/value cache layout: " + std::to_string(layout_));
+
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        keys_ =         Storage<T>(dims, T{});
+        values_ =       Storage<T>(dims, T{});
+        break;
+      case LLaMAModel::kCacheFloat16:
+        keys16_ =       Storage<float16_t>(dims, float16_t{0.f});
+        values16_ =     Storage<float16_t>(dims, float16_t{0.f});
+        break;
+      case LLaMAModel::kCacheInt8:
+        keys8_ =        Storage<int8_t>(dims, int8_t{0});
+        values8_ =      Storage<int8_t>(dims, int8_t{0});
+        key_scales_ =   Scales(scale_dims, 0.f);
+        value_scales_ = Scales(scale_dims, 0.f);
+        break;
+      default:
+        throw std::runtime_error("invalid key/value cache type: " + std::to_string(type_));
+    }
+  }
+
+  /// Type returns the storage type of the cache.
+  LLaMAModel::CacheType Type() const                      { return type_; }
+
+  /// Layout returns the memory layout of the cache.
+  LLaMAModel::CacheLayout Layout() const                  { return layout_; }
+
+  /// Keys returns a view {count, head_size} of the keys of a head if stored in the data type of
+  /// the model.
+  auto Keys(size_t kv_head, size_t count)                 { return HeadView(keys_, kv_head, count); }
+
+  /// Values returns a view {count, head_size} of the values of a head if stored in the data type
+  /// of the model.
+  auto Values(size_t kv_head, size_t count)               { return HeadView(values_, kv_head, count); }
+
+  /// Store quantizes and stores the key and value vectors {kv_dim} at the provided position.
+  void Store(size_t pos, const T* key, const T* value)
+  {
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        StoreRow(keys_.Data(), nullptr, pos, key);
+        StoreRow(values_.Data(), nullptr, pos, value);
+        break;
+      case LLaMAModel::kCacheFloat16:
+        StoreRow(keys16_.Data(), nullptr, pos, key);
+        StoreRow(values16_.Data(), nullptr, pos, value);
+        break;
+      case LLaMAModel::kCacheInt8:
+        StoreRow(keys8_.Data(), key_scales_.Data(), pos, key);
+        StoreRow(values8_.Data(), value_scales_.Data(), pos, value);
+        break;
+    }
+  }
+
+  /// Scores computes the dot products of the query vectors {group, head_size} of the query heads
+  /// sharing the provided key/value head with its keys for the positions [first, first + count).
+  /// The scores of query head g are written to scores + g * stride.
+  void Scores(T* scores, size_t stride, const T* query, size_t group,
+              size_t kv_head, size_t first, size_t count) const
+  {
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        Scores(scores, stride, keys_.Data(), nullptr, query, group, kv_head, first, count);
+        break;
+      case LLaMAModel::kCacheFloat16:
+        Scores(scores, stride, keys16_.Data(), nullptr, query, group, kv_head, first, count);
+        break;
+      case LLaMAModel::kCacheInt8:
+        Scores(scores, stride, keys8_.Data(), key_scales_.Data(), query, group, kv_head, first, count);
+        break;
+    }
+  }
+
+  /// Accumulate computes, for each query head g of the group, the sum of the values of the
+  /// provided key/value head for the positions [first, first + count) weighted by the weights at
+  /// weights + g * weights_stride, and writes it to out + g * out_stride.
+  void Accumulate(T* out, size_t out_stride, const T* weights, size_t weights_stride, size_t group,
+                  size_t kv_head, size_t first, size_t count) const
+  {
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        Accumulate(out, out_stride, values_.Data(), nullptr, weights, weights_stride, group,
+                   kv_head, first, count);
+        break;
+      case LLaMAModel::kCacheFloat16:
+        Accumulate(out, out_stride, values16_.Data(), nullptr, weights, weights_stride, group,
+                   kv_head, first, count);
+        break;
+      case LLaMAModel::kCacheInt8:
+        Accumulate(out, out_stride, values8_.Data(), value_scales_.Data(), weights, weights_stride, group,
+                   kv_head, first, count);
+        break;
+    }
+  }
+
+  /// Dequantize converts the keys and values of a head for the positions [0, count) to the data
+  /// type of the model and writes them to contiguous {count, head_size} buffers.
+  void Dequantize(T* keys, T* values, size_t kv_head, size_t count) const
+  {
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        Dequantize(keys, keys_.Data(), nullptr, kv_head, count);
+        Dequantize(values, values_.Data(), nullptr, kv_head, count);
+        break;
+      case LLaMAModel::kCacheFloat16:
+        Dequantize(keys, keys16_.Data(), nullptr, kv_head, count);
+        Dequantize(values, values16_.Data(), nullptr, kv_head, count);
+        break;
+      case LLaMAModel::kCacheInt8:
+        Dequantize(keys, keys8_.Data(), key_scales_.Data(), kv_head, count);
+        Dequantize(values, values8_.Data(), value_scales_.Data(), kv_head, count);
+        break;
+    }
+  }
+
+  /// RowSize returns the size in bytes of the keys and values (including any scales) of a position.
+  size_t RowSize() const
+  {
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType: return 2 * kv_dim_ * sizeof(T);
+      case LLaMAModel::kCacheFloat16:   return 2 * kv_dim_ * sizeof(float16_t);
+      case LLaMAModel::kCacheInt8:      return 2 * (kv_dim_ * sizeof(int8_t) + n_kv_heads_ * sizeof(float));
+    }
+    return 0;
+  }
+
+  /// Read copies the keys and values of count positions starting from pos into the provided
+  /// buffer, which must be at least count * RowSize() bytes.
+  void Read(char* buffer, size_t pos, size_t count) const
+  {
+    auto read = [&]<typename S>(const S* data, size_t dim) {
+      for (size_t head = 0; head < n_kv_heads_; head++)
+      {
+        for (size_t i = 0; i < count; i++, buffer += dim * sizeof(S))
+          memcpy(buffer, data + Offset(head, pos + i) * dim, dim * sizeof(S));
+      }
+    };
+
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        read(keys_.Data(), head_size_);
+        read(values_.Data(), head_size_);
+        break;
+      case LLaMAModel::kCacheFloat16:
+        read(keys16_.Data(), head_size_);
+        read(values16_.Data(), head_size_);
+        break;
+      case LLaMAModel::kCacheInt8:
+        read(keys8_.Data(), head_size_);
+        read(values8_.Data(), head_size_);
+        read(key_scales_.Data(), 1);
+        read(value_scales_.Data(), 1);
+        break;
+    }
+  }
+
+  /// Write copies the keys and values of count positions from the provided buffer, as returned by
+  /// Read, to the positions starting from pos.
+  void Write(const char* buffer, size_t pos, size_t count)
+  {
+    auto write = [&]<typename S>(S* data, size_t dim) {
+      for (size_t head = 0; head < n_kv_heads_; head++)
+      {
+        for (size_t i = 0; i < count; i++, buffer += dim * sizeof(S))
+          memcpy(data + Offset(head, pos + i) * dim, buffer, dim * sizeof(S));
+      }
+    };
+
+    switch (type_)
+    {
+      case LLaMAModel::kCacheModelType:
+        write(keys_.Data(), head_size_);
+        write(values_.Data(), head_size_);
+        break;
+      case LLaMAModel::kCacheFloat16:
+        write(keys16_.Data(), head_size_);
+        write(values16_.Data(), head_size_);
+        break;
+      case LLaMAModel::kCacheInt8:
+        write(keys8_.Data(), head_size_);
+        write(values8_.Data(), head_size_);
+        write(key_scales_.Data(), 1);
+        write(value_scales_.Data(), 1);
+        break;
+    }
+  }
+
+ private:
+  // Offset returns the index of the row of a head and position in units of rows.
+  size_t Offset(size_t kv_head, size_t pos) const
+  {
+    return layout_ == LLaMAModel::kCacheHeadMajor ? kv_head * max_seq_len_ + pos : pos * n_kv_heads_ + kv_head;
+  }
+
+  // Stride returns the distance between the rows of consecutive positions in units of rows.
+  size_t Stride() const
+  {
+    return layout_ == LLaMAModel::kCacheHeadMajor ? 1 : n_kv_heads_;
+  }
+
+  // HeadView returns a view {count, head_size} of the rows of a head.
+  template <typename S>
+  auto HeadView(Storage<S>& storage, size_t kv_head, size_t count)
+  {
+    if (layout_ == LLaMAModel::kCacheHeadMajor)
+      return storage.View(kv_head, view::Extent(count));
+    else
+      return storage.View(view::Extent(count), kv_head);
+  }
+
+  // StoreRow converts the vectors of all heads to the storage type; 8-bit integers use symmetric
+  // quantization with a scale for each head.
+  template <typename S>
+  void StoreRow(S* data, float* scales, size_t pos, const T* src) const
+  {
+    for (size_t head = 0; head < n_kv_heads_; head++, src += head_size_)
+    {
+      size_t offset = Offset(head, pos);
+      S* dst = data + offset * head_size_;
+
+      if constexpr (std::is_same_v<S, int8_t>)
+      {
+        T max{0};
+        for (size_t i = 0; i < head_size_; i++)
+          max = std::max(max, std::abs(src[i]));
+
+        float scale = max / 127.f;
+        float inverse = scale != 0.f ? 1.f / scale : 0.f;
+        for (size_t i = 0; i < head_size_; i++)
+          dst[i] = static_cast<int8_t>(std::round(src[i] * inverse));
+        scales[offset] = scale;
+      }
+      else
+      {
+        for (size_t i = 0; i < head_size_; i++)
+          dst[i] = static_cast<S>(src[i]);
+      }
+    }
+  }
+
+  // Dequantize converts the rows of a head to the data type of the model.
+  template <typename S>
+  void Dequantize(T* dst, const S* src, const float* scales, size_t kv_head, size_t count) const
+  {
+    size_t offset = Offset(kv_head, 0);
+    size_t stride = Stride();
+
+    src += offset * head_size_;
+    for (size_t pos = 0; pos < count; pos++, src += stride * head_size_, dst += head_size_)
+    {
+      T scale{1};
+      if constexpr (std::is_same_v<S, int8_t>)
+        scale = scales[offset + pos * stride];
+
+      for (size_t i = 0; i < head_size_; i++)
+        dst[i] = static_cast<T>(src[i]) * scale;
+    }
+  }
+
+  // Row returns the row in the data type of the model, converting it into the buffer if needed.
+  template <typename S>
+  const T* Row(const S* src, T* buffer) const
+  {
+    if constexpr (std::is_same_v<S, T>)
+      return src;
+    else
+    {
+      for (size_t i = 0; i < head_size_; i++)
+        buffer[i] = static_cast<T>(src[i]);
+      return buffer;
+    }
+  }
+
+  // Scores computes the dot products with the queries of a group. Each key row is loaded (and
+  // converted) once and reused for all query heads of the group.
+  template <typename S>
+  void Scores(T* scores, size_t scores_stride, const S* keys, const float* scales,
+              const T* query, size_t group, size_t kv_head, size_t first, size_t count) const
+  {
+    size_t offset = Offset(kv_head, first);
+    size_t stride = Stride();
+    std::vector<T> buffer(std::is_same_v<S, T> ? 0 : head_size_);
+
+    keys += offset * head_size_;
+    for (size_t pos = 0; pos < count; pos++, keys += stride * head_size_)
+    {
+      const T* key = Row(keys, buffer.data());
+      const T* q = query;
+      for (size_t g = 0; g < group; g++, q += head_size_)
+      {
+        T sum{0};
+        for (size_t i = 0; i < head_size_; i++)
+          sum += key[i] * q[i];
+
+        if constexpr (std::is_same_v<S, int8_t>)
+          sum *= scales[offset + pos * stride];
+        scores[g * scores_stride + pos] = sum;
+      }
+    }
+  }
+
+  // Accumulate computes the weighted sums of the values for the queries of a group. Each value
+  // row is loaded (and converted) once and reused for all query heads of the group.
+  template <typename S>
+  void Accumulate(T* out, size_t out_stride, const S* values, const float* scales,
+                  const T* weights, size_t weights_stride, size_t group,
+                  size_t kv_head, size_t first, size_t count) const
+  {
+    size_t offset = Offset(kv_head, first);
+    size_t stride = Stride();
+    std::vector<T> buffer(std::is_same_v<S, T> ? 0 : head_size_);
+
+    for (size_t g = 0; g < group; g++)
+      std::fill_n(out + g * out_stride, head_size_, T{0});
+
+    values += offset * head_size_;
+    for (size_t pos = 0; pos < count; pos++, values += stride * head_size_)
+    {
+      const T* value = Row(values, buffer.data());
+      for (size_t g = 0; g < group; g++)
+      {
+        T weight = weights[g * weights_stride + pos];
+        if constexpr (std::is_same_v<S, int8_t>)
+          weight *= scales[offset + pos * stride];
+
+        T* o = out + g * out_stride;
+        for (size_t i = 0; i < head_size_; i++)
+          o[i] += weight * value[i];
+      }
+    }
+  }
+
+ private:
+  LLaMAModel::CacheType   type_;
+  LLaMAModel::CacheLayout layout_;
+  size_t                  max_seq_len_;
+  size_t                  n_kv_heads_;
+  size_t                  head_size_;
+  size_t                  kv_dim_;
+
+  Storage<T>              keys_;            // {max_seq_len, n_kv_heads, head_size} (sequence-major)
+  Storage<T>              values_;
+  Storage<float16_t>      keys16_;
+  Storage<float16_t>      values16_;
+  Storage<int8_t>         keys8_;
+  Storage<int8_t>         values8_;
+  Scales                  key_scales_;      // {max_seq_len, n_kv_heads} (sequence-major)
+  Scales                  value_scales_;
+};
+
+} // end of namespace grid
+
+#endif  // _KV_CACHE_H
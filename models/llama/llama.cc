@@ -6,8 +6,14 @@
 // The contents of this file are confidential and proprietary to Chris Zankel.
 //
 
+#include <chrono>
 #include <string>
+#include <fstream>
 #include <iostream>
+#include <utility>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <grid/util/demangle.h>
 
@@ -19,9 +25,17 @@
 #include "llama.h"
 #include "karpathy.h"
 #include "ggml.h"
+#include "grid.h"
 
 namespace grid {
 
+namespace {
+
+// kOutputInterval is the maximum time that Predict holds back generated text before writing it.
+constexpr std::chrono::milliseconds kOutputInterval{50};
+
+} // end of namespace
+
 //
 // LLaMAFile
 //
@@ -34,6 +48,7 @@ LLaMAFile* LLaMAFile::Open(Type file_type, std::string_view model_path)
   {
     case kKarpathy: file = new grid::KarpathyFile(model_path); break;
     case kGgml:     file = new grid::GgmlFile(model_path); break;
+    case kGrid:     file = new grid::GridFile(model_path); break;
     default: throw std::runtime_error("invalid model file type: " + std::to_string(file_type));
   }
 
@@ -73,35 +88,258 @@ std::ostream& LLaMAFile::PrintModelInfo(std::ostream& out) const
   return out;
 }
 
+
+uint64_t LLaMAFile::TokenizerKey() const
+{
+  // FNV-1a over the identity of the files instead of their contents, which would take longer
+  // to hash than loading the tokenizer
+  uint64_t key = 0xcbf29ce484222325;
+  auto hash = [&key](const void* data, size_t size) {
+    for (size_t i = 0; i < size; i++)
+      key = (key ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3;
+  };
+
+  for (auto& path : Paths())
+  {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      throw std::runtime_error("no such file: " + path);
+    uint64_t identity[] = {static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_mtime),
+                           static_cast<uint64_t>(st.st_ino)};
+    hash(path.data(), path.size());
+    hash(identity, sizeof(identity));
+  }
+  return key;
+}
+
+
+void LLaMAFile::GetCachedTokenizer(LLaMAVocab& vocab, const std::string& cache_dir) const
+{
+  uint64_t key = TokenizerKey();
+  std::string name = Paths()[0];
+  name = name.substr(name.find_last_of('/') + 1);
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%016llx.vocab", static_cast<unsigned long long>(key));
+  std::string path = cache_dir + "/" + name + suffix;
+  if (vocab.LoadSnapshot(path, key))
+    return;
+
+  GetTokenizer(vocab);
+
+  // the snapshot is written to a temporary file and renamed, so concurrently starting processes
+  // never map a partial snapshot; the cache is optional and write errors are ignored
+  std::string temp_path = path + "." + std::to_string(getpid());
+  std::ofstream ofs(temp_path, std::ios::out | std::ios::binary);
+  if (ofs)
+  {
+    vocab.WriteSnapshot(ofs, key);
+    ofs.close();
+    if (!ofs || rename(temp_path.c_str(), path.c_str()) != 0)
+      unlink(temp_path.c_str());
+  }
+}
+
+
+const LLaMAFile::TensorInfo& LLaMAFile::GetTensorInfo(TensorType type, size_t layer) const
+{
+  size_t index = layer * kTensorTypes + type;
+  if (type >= kTensorTypes || index >= tensors_.size() || tensors_[index].size == 0)
+    throw std::runtime_error("tensor " + std::to_string(type) + " of layer " + std::to_string(layer) +
+                             " not found");
+  return tensors_[index];
+}
+
+
+void LLaMAFile::SetTensorInfo(TensorType type, size_t layer, const TensorInfo& info)
+{
+  if (type >= kTensorTypes)
+    throw std::runtime_error("invalid tensor type " + std::to_string(type));
+  if ((layer + 1) * kTensorTypes > tensors_.size())
+    tensors_.resize((layer + 1) * kTensorTypes);
+  tensors_[layer * kTensorTypes + type] = info;
+}
+
+
+void LLaMAFile::ValidateTensors(size_t mapped_size) const
+{
+  LLaMAModel::Parameters params;
+  GetParameters(params);
+  if (params.num_heads_ == 0 || params.num_kv_heads_ == 0 || params.dim_ % params.num_heads_ != 0 ||
+      params.num_heads_ % params.num_kv_heads_ != 0)
+    throw std::runtime_error("invalid number of heads");
+
+  size_t vocab_size = params.vocab_size_;
+  size_t dim = params.dim_;
+  size_t hidden_dim = params.hidden_dim_;
+  size_t kv_dim = dim * params.num_kv_heads_ / params.num_heads_;
+
+  // dimensions {rows, cols} of the tensor types; rows are 0 for vectors
+  const size_t dimensions[kTensorTypes][2] =
+  {
+    {vocab_size, dim},    // kEmbeddings
+    {0, dim},             // kAttentionRms
+    {dim, dim},           // kAttentionQuery
+    {kv_dim, dim},        // kAttentionKey
+    {kv_dim, dim},        // kAttentionValue
+    {dim, dim},           // kFeedForwardWo
+    {hidden_dim, dim},    // kFeedForwardW1
+    {dim, hidden_dim},    // kFeedForwardW2
+    {hidden_dim, dim},    // kFeedForwardW3
+    {0, dim},             // kFeedForwardRms
+    {0, dim},             // kFinalRms
+    {vocab_size, dim},    // kOutput
+  };
+
+  auto validate = [&](TensorType type, size_t layer) {
+    const TensorInfo& info = GetTensorInfo(type, layer);
+    std::string name = "tensor " + std::to_string(type) + " of layer " + std::to_string(layer);
+    if (info.data_type == nullptr)
+      throw std::runtime_error("data type of " + name + " not supported");
+    if (info.rows != dimensions[type][0] || info.cols != dimensions[type][1])
+      throw std::runtime_error("dimensions of " + name + " don't match the model parameters");
+    if (info.offset > mapped_size || info.size > mapped_size - info.offset)
+      throw std::runtime_error(name + " exceeds the file");
+
+    // only quantized weight matrices can be stored in panels, which the kernels require to have
+    // kQuantizedPanelRows rows
+    bool panels = type != kEmbeddings && info.rows != 0 &&
+                  (*info.data_type == typeid(BlockQ8_0) || *info.data_type == typeid(BlockQ4_0));
+    if (info.panel_rows != 1 && (!panels || info.panel_rows != kQuantizedPanelRows))
+      throw std::runtime_error("invalid panel rows of " + name);
+  };
+
+  for (size_t layer = 0; layer < params.num_layers_; layer++)
+    for (auto type : {kAttentionRms, kAttentionQuery, kAttentionKey, kAttentionValue, kFeedForwardWo,
+                      kFeedForwardW1, kFeedForwardW2, kFeedForwardW3, kFeedForwardRms})
+      validate(type, layer);
+  for (auto type : {kEmbeddings, kFinalRms, kOutput})
+    validate(type, 0);
+}
+
 //
 // LLaMAModel
 //
 
-LLaMAModel* LLaMAModel::Load(LLaMAFile& file, std::string_view device_name, bool mmap)
+LLaMAModel* LLaMAModel::Load(LLaMAFile& file, std::string_view device_name, const Options& options)
 {
-  if (!mmap)
-    throw("only memory-mapped files currently supported");
-
   // TODO: because the model is templated, all supported data types need to be specialized here.
+  // Quantized weights are multiplied with float vectors and only supported by the base device.
   auto& data_type =  file.DataType();
-  if (data_type != typeid(float))
-    throw std::runtime_error("invalid data type, only float is supported");
+  // The data type of the file is the type of most weights; each weight is loaded with its own type.
+  bool quantized = data_type == typeid(BlockQ8_0) || data_type == typeid(BlockQ4_0) ||
+                   data_type == typeid(BlockQ4_K) || data_type == typeid(BlockQ5_K) ||
+                   data_type == typeid(BlockQ6_K) ||
+                   data_type == typeid(float16_t) || data_type == typeid(bfloat16_t);
+  if (data_type != typeid(float) && !quantized)
+    throw std::runtime_error("invalid data type, only float, float16, bfloat16, Q8_0, Q4_0, Q4_K, Q5_K, "
+                             "and Q6_K are supported");
+  if (options.stream_layers_ && (!options.mmap_ || options.mmap_lock_))
+    throw std::runtime_error("layer streaming requires memory-mapped and unlocked model files");
+  if ((quantized || options.weight_type_ != kWeightFileType || options.repack_weights_) && device_name != "")
+    throw std::runtime_error("quantized models are only supported by the base device");
 
 #if BUILD_CUDA
   if (device_name == "cuda")
-    return LLaMAModelT<float, device::Cuda>::Load(file);
+    return LLaMAModelT<float, device::Cuda>::Load(file, options);
   else
 #endif
   if (device_name == "")
-    return LLaMAModelT<float, device::Base>::Load(file);
+    return LLaMAModelT<float, device::Base>::Load(file, options);
   else
     throw std::runtime_error("invalid device name");
 }
 
 
+LLaMAModel* LLaMAModel::Load(LLaMAFile& file, const Options& options)
+{
+  return Load(file, std::string{}, options);
+}
+
+
+LLaMAModel* LLaMAModel::Load(LLaMAFile& file, std::string_view device_name, bool mmap)
+{
+  Options options;
+  options.mmap_ = mmap;
+  return Load(file, device_name, options);
+}
+
+
 LLaMAModel* LLaMAModel::Load(LLaMAFile& file, bool mmap)
 {
   return Load(file, std::string{}, mmap);
 }
 
+
+
+void LLaMAModel::Predict(std::string_view prompt, size_t steps)
+{
+  // Collect the text and write it when it completes a line or kOutputInterval has passed, instead
+  // of flushing the stream for every token.
+  std::string text;
+  auto output_time = std::chrono::steady_clock::now();
+  auto output = [&]() {
+    std::cout.write(text.data(), text.size()).flush();
+    text.clear();
+    output_time = std::chrono::steady_clock::now();
+  };
+
+  try
+  {
+    Generate(prompt, steps, [&](const Token& token) {
+      text += token.text_;
+      if (text.find('\n') != std::string::npos ||
+          std::chrono::steady_clock::now() - output_time >= kOutputInterval)
+        output();
+      return true;
+    });
+  }
+  catch (...)
+  {
+    // write the text that was generated before the error
+    output();
+    throw;
+  }
+  output();
+  std::cout << std::endl;
+}
+
+
+std::unique_ptr<LLaMAModel::TokenStream> LLaMAModel::Stream(std::string_view prompt, size_t steps)
+{
+  return std::make_unique<TokenStream>(*this, prompt, steps);
+}
+
+//
+// LLaMAModel::TokenStream
+//
+
+// The queue has a slot for each position and the remaining bytes of an incomplete character.
+LLaMAModel::TokenStream::TokenStream(LLaMAModel& model, std::string_view prompt, size_t steps)
+  : queue_(steps + 1),
+    thread_([this, &model, prompt = std::string(prompt), steps](std::stop_token stop) {
+      try
+      {
+        model.Generate(prompt, steps, [this](const Token& token) {
+          return queue_.TryPush(Token(token));
+        }, stop);
+      }
+      catch (...)
+      {
+        exception_ = std::current_exception();
+      }
+      queue_.Close();
+    })
+{}
+
+
+bool LLaMAModel::TokenStream::Next(Token& token)
+{
+  if (queue_.Pop(token))
+    return true;
+  if (exception_)
+    std::rethrow_exception(std::exchange(exception_, nullptr));
+  return false;
+}
+
 } // end of namespace grid
@@ -10,17 +10,28 @@
 #define _LLAMA_H
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <future>
 #include <memory>
+#include <span>
 #include <unordered_map>
+#include <variant>
 #include <vector>
 
 #include <grid/models/llama.h>
 
 #include <grid/tensor/mmap.h>
+#include <grid/tensor/quantized.h>
 #include <grid/tensor/tensor.h>
+#include <grid/util/demangle.h>
+#include <grid/util/thread_pool.h>
 
+#include "kv_cache.h"
+#include "llama_tokenizer.h"
 #include "llama_vocab.h"
+#include "prefetcher.h"
+#include "prefix_cache.h"
 
 using grid::view::Slice;
 using grid::view::Extent;
@@ -38,6 +49,33 @@ class LLaMAModelT : public LLaMAModel
   using Tensor1D = Tensor<T, 1, DeviceMemory<Dev>>;
   using Tensor2D = Tensor<T, 2, DeviceMemory<Dev>>;
 
+  /// Quantized and half-precision weights reference the blocks in the memory-mapped file and are
+  /// multiplied by the base device (only).
+  template <typename TBlock> using Quantized2D = Tensor<TBlock, 2, MemoryMapped>;
+
+  /// Weight is a weight matrix of the data type of the tensor in the file.
+  using Weight = std::conditional_t<std::is_same_v<Dev, device::Base> && std::is_same_v<T, float>,
+                                    std::variant<Tensor2D, Quantized2D<BlockQ8_0>, Quantized2D<BlockQ4_0>,
+                                                 Quantized2D<BlockQ4_K>, Quantized2D<BlockQ5_K>,
+                                                 Quantized2D<BlockQ6_K>, Quantized2D<float16_t>,
+                                                 Quantized2D<bfloat16_t>>,
+                                    std::variant<Tensor2D>>;
+
+  struct LLaMALayer;
+
+  /// Number of tokens of a block in the prefix cache.
+  static constexpr size_t kPrefixBlockSize = 32;
+
+  /// Number of cached positions processed by one attention task.
+  static constexpr size_t kAttentionChunkSize = 256;
+
+  /// Maximum number of prompt tokens processed in one batch.
+  static constexpr size_t kPrefillBatchSize = 128;
+
+  /// Maximum number of prompt tokens processed in one batch when streaming the layers, which
+  /// reads the weights of all layers once for each batch.
+  static constexpr size_t kStreamingPrefillBatchSize = 512;
+
  protected:
   LLaMAModelT() = default;
 
@@ -45,226 +83,469 @@ class LLaMAModelT : public LLaMAModel
   virtual ~LLaMAModelT() = default;
 
   // LLaMAModel::
-  virtual void Predict(std::string_view prompt, size_t steps);
+  virtual void Generate(std::string_view prompt, size_t steps, const TokenCallback& callback,
+                        std::stop_token stop = {});
+  virtual std::tuple<size_t, size_t> Residency() const    { return {mmap_->Size(), mmap_->Resident()}; }
 
   /// Load loads the LLaMA model from the provided file.
-  static LLaMAModelT<T, Dev>* Load(LLaMAFile& file);
+  static LLaMAModelT<T, Dev>* Load(LLaMAFile& file, const LLaMAModel::Options& options);
 
  protected:
   // EncodeBPE encodes the prompt into a token vector using byte-pair encoding
   void EncodeBPE(std::string_view prompt, std::vector<uint32_t>& token_ids);
 
-  // Decode decodes the provided current token.
-  std::string Decode(LLaMAVocab::token , LLaMAVocab::token);
-
   /// Forward runs a single forward run through the model (seq len = 1)
   void Forward(LLaMAVocab::token token, size_t);
 
+  /// ForwardPrompt runs the tokens for the positions [pos, pos + tokens.size()) as a batch through
+  /// the model to fill the key/value caches. Note that it doesn't compute any logits.
+  void ForwardPrompt(std::span<const LLaMAVocab::token> tokens, size_t pos);
+
+  /// Rope rotates the query {dim} and key {kv_dim} vectors for each head for position pos.
+  void Rope(T* q, T* k, size_t pos) const;
+
+  /// LoadWeight returns the weight matrix {rows, cols} for the tensor of the directory entry.
+  /// Float tensors are copied and quantized tensors reference the memory-mapped file. Float and
+  /// half-precision tensors are quantized if the weight type requests it, and Q8_0 and Q4_0
+  /// weights are repacked into panels of panel_rows rows if panel_rows is larger than 1.
+  Weight LoadWeight(const LLaMAFile& file, const LLaMAFile::TensorInfo& info, char* base,
+                    LLaMAModel::WeightType weight_type, size_t panel_rows);
+
+  /// QuantizeWeight quantizes the weight matrix {rows, cols} in parallel into panels of panel_rows
+  /// rows and releases the pages of the memory-mapped source.
+  template <typename TBlock, typename TSource>
+  Quantized2D<TBlock> QuantizeWeight(const std::tuple<TSource*, size_t>& source, size_t rows, size_t cols,
+                                     size_t panel_rows);
+
+  /// RepackWeight copies the quantized weight matrix {rows, cols} in parallel into panels of
+  /// panel_rows rows and releases the pages of the memory-mapped source.
+  template <typename TBlock>
+  Quantized2D<TBlock> RepackWeight(const std::tuple<TBlock*, size_t>& source, size_t rows, size_t cols,
+                                   size_t panel_rows);
+
+  /// MappedRanges returns the ranges of the weights that reference the memory-mapped file.
+  std::vector<Prefetcher::Range> MappedRanges(std::initializer_list<const Weight*> weights) const;
+
+  /// BeginLayer prepares the mapped weights of the layer, or of the output for index num_layers,
+  /// before they are used. When streaming, it waits until the weights are loaded and starts
+  /// loading the weights of the next index; otherwise, it prefetches the next weights if enabled.
+  void BeginLayer(size_t index, size_t next);
+
+  /// EndLayer releases the mapped weights of the layer or output when streaming.
+  void EndLayer(size_t index);
+
+  /// Embedding copies the embeddings vector {dim} of the token to x.
+  void Embedding(T* x, LLaMAVocab::token token) const;
+
+  /// Linear multiplies the weight matrix with the vector {dim} or each row of the matrix {seq, dim}:
+  /// y = W @ x, or Y = X @ W^T
+  template <typename TTensor>
+  static auto Linear(const Weight& weight, TTensor&& x)
+  {
+    constexpr size_t rank = std::remove_cvref_t<TTensor>::rank;
+    return std::visit([&x](const auto& w) -> Tensor<T, rank, DeviceMemory<Dev>> {
+      if constexpr (rank == 1)
+        return Matmul(w, std::forward<TTensor>(x));
+      else
+        return Matmul(std::forward<TTensor>(x), Transposed(w));
+    }, weight);
+  }
+
+  /// Transposed returns a transposed view of a weight matrix.
+  template <typename TWeight>
+  static auto Transposed(const TWeight& weight)
+  {
+    auto& dims = weight.Dimensions();
+    return weight.Reshape(std::array<size_t, 2>{dims[1], dims[0]},
+                          std::array<ssize_t, 2>{1, static_cast<ssize_t>(dims[1])});
+  }
+
+  /// Attention computes the attention of all heads for the query of the layer at position pos
+  /// and writes the result to scores_.
+  void Attention(const LLaMALayer& layer, size_t pos);
+
   /// Sample samples the current logits to a word.
   LLaMAVocab::token Sample();
   LLaMAVocab::token SampleArgMax();
 
+  /// RestorePrefix restores the key/value caches for the longest cached prefix of the tokens and
+  /// returns the number of restored positions.
+  size_t RestorePrefix(std::span<const LLaMAVocab::token> tokens);
+
+  /// SavePrefix adds the key/value caches for the provided (computed) tokens to the prefix cache.
+  void SavePrefix(std::span<const LLaMAVocab::token> tokens);
+
  private:
-  LLaMAModel::Parameters parameters_;
-  std::shared_ptr<MMap>  mmap_;
-  LLaMAVocab             vocab_;
-  size_t                 max_token_length_;
+  LLaMAModel::Parameters        parameters_;
+  std::shared_ptr<MMap>         mmap_;
+  LLaMAVocab                    vocab_;
+  size_t                        max_token_length_;
+  std::unique_ptr<PrefixCache>  prefix_cache_;
+  std::shared_ptr<ThreadPool>   thread_pool_;
+  std::unique_ptr<LLaMATokenizer> tokenizer_;
+  std::vector<std::shared_ptr<void>> quantized_weights_;  // weights quantized when loaded
+  std::unique_ptr<Prefetcher>   prefetcher_;
+  std::vector<std::vector<Prefetcher::Range>> prefetch_ranges_; // mapped weights of each layer and the output
+  bool                          stream_layers_ = false;
+  std::vector<std::future<void>> layer_loads_;  // pending loads of the layers and output when streaming
 
   struct LLaMALayer
   {
     // (note that dim = n_heads * head_size and n_kv_heads = n_heads for this implementation)
-    Tensor2D  wq_;              // {dim, n_heads * head_size}
-    Tensor2D  wk_;              // {dim, n_kv_heads * head_size}
-    Tensor2D  wv_;              // {dim, n_kv_heads * head_size}
-    Tensor2D  wo_;              // {n_heads * head_size, dim}
+    Weight    wq_;              // {dim, n_heads * head_size}
+    Weight    wk_;              // {dim, n_kv_heads * head_size}
+    Weight    wv_;              // {dim, n_kv_heads * head_size}
+    Weight    wo_;              // {n_heads * head_size, dim}
 
     // Weights for FFN
-    Tensor2D  w1_;              // {hidden_dim, dim}
-    Tensor2D  w2_;              // {dim, hidden_dim}
-    Tensor2D  w3_;              // {hidden_dim, dim}
+    Weight    w1_;              // {hidden_dim, dim}
+    Weight    w2_;              // {dim, hidden_dim}
+    Weight    w3_;              // {hidden_dim, dim}
 
     Tensor1D      att_norm_;        // {dim}
     Tensor1D  ffn_norm_;        // {dim}
 
     // Runtime tensors
-    Tensor2D      key_cache_;       // {kv_dim, max_sequence_length}
-    Tensor2D      value_cache_;     // {kv_dim, max_sequence_length}
+    KVCache<T, Dev> kv_cache_;
     Tensor1D      q_;
   };
 
-  Tensor2D  embeddings_;
+  Weight    embeddings_;        // {vocab_size, dim}
   Tensor1D  output_norm_;       // {dim}
-  Tensor2D  output_;            // {vocab_size, dim}
+  Weight    output_;            // {vocab_size, dim}
 
   // Runtime tensors
   Tensor1D      x_;                 // {dim}
   Tensor1D      xb_;
   Tensor1D      logits_;            // output {vocab_size}
   Tensor1D      scores_;            // {n_heads * head_size}
+  Tensor1D      k_;                 // {kv_dim}
+  Tensor1D      v_;                 // {kv_dim}
+  Tensor2D      att_;               // {n_heads, max_sequence_length}
+  Tensor2D      att_out_;           // {n_heads * n_chunks, head_size}
+  Tensor1D      att_max_;           // {n_heads * n_chunks}
+  Tensor1D      att_sum_;           // {n_heads * n_chunks}
 
   std::vector<LLaMALayer> layers_;
 };
 
 
 template <typename T, typename Dev>
-LLaMAModelT<T, Dev>* LLaMAModelT<T, Dev>::Load(LLaMAFile& file)
+LLaMAModelT<T, Dev>* LLaMAModelT<T, Dev>::Load(LLaMAFile& file, const LLaMAModel::Options& options)
 {
   auto* model = new LLaMAModelT<T, Dev>();
 
   file.GetParameters(model->parameters_);
-  file.GetTokenizer(model->vocab_);
-
-  model->mmap_ = std::shared_ptr<MMap>(file.MapTensors());
+  if (options.tokenizer_cache_.empty())
+    file.GetTokenizer(model->vocab_);
+  else
+    file.GetCachedTokenizer(model->vocab_, options.tokenizer_cache_);
+
+  int flags = (options.mmap_populate_ ? MMap::kPopulate : 0) |
+              (!options.mmap_ ? MMap::kRead : 0) | (options.huge_pages_ ? MMap::kHugePages : 0);
+  model->mmap_ = std::shared_ptr<MMap>(file.MapTensors(flags, options.threads_));
+  model->mmap_->Advise(options.mmap_advice_);
+  // fall back to reading the file asynchronously if the pages cannot be locked
+  if (options.mmap_lock_ && !model->mmap_->Lock())
+    model->mmap_->Advise(MMap::kAdviceWillNeed);
   char *base = static_cast<char*>(model->mmap_->Address());
+  model->thread_pool_ = std::make_shared<ThreadPool>(options.threads_);
+  model->tokenizer_ = std::make_unique<LLaMATokenizer>(model->vocab_, model->thread_pool_);
+  auto weight_type = options.weight_type_;
+  size_t panel_rows = options.repack_weights_ ? kQuantizedPanelRows : 1;
 
   auto& params = model->parameters_;
   size_t n_layers =   params.num_layers_;
-  size_t hidden_dim = params.hidden_dim_;
   size_t dim =        params.dim_;
   size_t kv_dim =     dim * params.num_kv_heads_ / params.num_heads_;
 
+  // the shapes of the tensors were validated when the file was loaded
+  auto load = [&](LLaMAFile::TensorType type, size_t layer = 0, size_t weight_panel_rows = 0) {
+    return model->LoadWeight(file, file.GetTensorInfo(type, layer), base, weight_type,
+                             weight_panel_rows != 0 ? weight_panel_rows : panel_rows);
+  };
+
   model->layers_.resize(n_layers);
   for (size_t i = 0; i < n_layers; i++)
   {
     auto& layer = model->layers_[i];
-    layer.att_norm_ =   Tensor({dim}, file.GetTensor<T>(base, LLaMAFile::kAttentionRms, i));
-    layer.wq_ =         Tensor({dim, dim}, file.GetTensor<T>(base, LLaMAFile::kAttentionQuery, i));
-    layer.wk_ =         Tensor({kv_dim, dim}, file.GetTensor<T>(base, LLaMAFile::kAttentionKey, i));
-    layer.wv_ =         Tensor({kv_dim, dim}, file.GetTensor<T>(base, LLaMAFile::kAttentionValue, i));
-    layer.wo_ =         Tensor({dim, dim}, file.GetTensor<T>(base, LLaMAFile::kFeedForwardWo, i));
-    layer.ffn_norm_ =   Tensor({dim}, file.GetTensor<T>(base, LLaMAFile::kFeedForwardRms, i));
-    layer.w1_ =         Tensor({hidden_dim, dim}, file.GetTensor<T>(base, LLaMAFile::kFeedForwardW1, i));
-    layer.w2_ =         Tensor({dim, hidden_dim}, file.GetTensor<T>(base, LLaMAFile::kFeedForwardW2, i));
-    layer.w3_ =         Tensor({hidden_dim, dim}, file.GetTensor<T>(base, LLaMAFile::kFeedForwardW3, i));
+    layer.att_norm_ =   Tensor({dim}, file.GetTensor<T>(base, file.GetTensorInfo(LLaMAFile::kAttentionRms, i)));
+    layer.wq_ =         load(LLaMAFile::kAttentionQuery, i);
+    layer.wk_ =         load(LLaMAFile::kAttentionKey, i);
+    layer.wv_ =         load(LLaMAFile::kAttentionValue, i);
+    layer.wo_ =         load(LLaMAFile::kFeedForwardWo, i);
+    layer.ffn_norm_ =   Tensor({dim}, file.GetTensor<T>(base, file.GetTensorInfo(LLaMAFile::kFeedForwardRms, i)));
+    layer.w1_ =         load(LLaMAFile::kFeedForwardW1, i);
+    layer.w2_ =         load(LLaMAFile::kFeedForwardW2, i);
+    layer.w3_ =         load(LLaMAFile::kFeedForwardW3, i);
+  }
+
+  model->embeddings_ =  load(LLaMAFile::kEmbeddings, 0, 1);
+  model->output_norm_=  Tensor({dim}, file.GetTensor<T>(base, file.GetTensorInfo(LLaMAFile::kFinalRms)));
+  model->output_     =  load(LLaMAFile::kOutput);
+
+  if (options.prefetch_ || options.stream_layers_)
+  {
+    for (auto& l : model->layers_)
+      model->prefetch_ranges_.push_back(model->MappedRanges({&l.wq_, &l.wk_, &l.wv_, &l.wo_, &l.w1_, &l.w2_, &l.w3_}));
+    model->prefetch_ranges_.push_back(model->MappedRanges({&model->output_}));
+    model->prefetcher_ = std::make_unique<Prefetcher>(model->mmap_);
   }
 
-  model->embeddings_ =  Tensor({params.vocab_size_, dim}, file.GetTensor<T>(base, LLaMAFile::kEmbeddings));
-  model->output_norm_=  Tensor({dim}, file.GetTensor<T>(base, LLaMAFile::kFinalRms));
-  model->output_     =  Tensor({params.vocab_size_, dim}, file.GetTensor<T>(base, LLaMAFile::kOutput));
+  // drop the pages read while loading, so the layers are only resident while they are used
+  if (options.stream_layers_)
+  {
+    model->stream_layers_ = true;
+    model->layer_loads_.resize(n_layers + 1);
+    for (auto& ranges : model->prefetch_ranges_)
+      for (auto [addr, size] : ranges)
+        model->mmap_->Release(addr, size);
+  }
 
   // Initialize runtime tensors
   model->x_ =           Tensor({dim}, Uninitialized<T>{});
   model->xb_ =          Tensor({dim}, Uninitialized<T>{});
   model->logits_ =      Tensor({params.vocab_size_}, Uninitialized<T>{});
   model->scores_ =      Tensor({dim}, Uninitialized<T>{});
-
+  model->k_ =           Tensor({kv_dim}, Uninitialized<T>{});
+  model->v_ =           Tensor({kv_dim}, Uninitialized<T>{});
+
+  size_t n_kv_heads = params.num_kv_heads_;
+  size_t head_size = dim / params.num_heads_;
+  size_t n_chunks = (params.max_seq_len_ + kAttentionChunkSize - 1) / kAttentionChunkSize;
+  model->att_ =         Tensor({params.num_heads_, params.max_seq_len_}, Uninitialized<T>{});
+  model->att_out_ =     Tensor({params.num_heads_ * n_chunks, head_size}, Uninitialized<T>{});
+  model->att_max_ =     Tensor({params.num_heads_ * n_chunks}, Uninitialized<T>{});
+  model->att_sum_ =     Tensor({params.num_heads_ * n_chunks}, Uninitialized<T>{});
   for (size_t i = 0; i < n_layers; i++)
   {
     auto& layer =        model->layers_[i];
-    layer.key_cache_ =   Tensor({params.max_seq_len_, kv_dim}, T{});
-    layer.value_cache_ = Tensor({params.max_seq_len_, kv_dim}, T{});
+    layer.kv_cache_ =    KVCache<T, Dev>(options.kv_cache_type_, options.kv_cache_layout_,
+                                         params.max_seq_len_, n_kv_heads, head_size);
     layer.q_ =           Tensor({dim}, Uninitialized<T>{});
   }
 
+  // Each block of the prefix cache holds the key and value rows of all layers.
+  if (options.prefix_cache_size_ > 0)
+    model->prefix_cache_ = std::make_unique<PrefixCache>(
+        kPrefixBlockSize, n_layers * kPrefixBlockSize * model->layers_[0].kv_cache_.RowSize(),
+        options.prefix_cache_size_);
+
   return model;
 }
 
 
-// Byte-Pair Encoding
 template <typename T, typename Dev>
-void LLaMAModelT<T, Dev>::EncodeBPE(std::string_view prompt, std::vector<LLaMAVocab::token>& tokens)
+auto LLaMAModelT<T, Dev>::LoadWeight(const LLaMAFile& file, const LLaMAFile::TensorInfo& info, char* base,
+                                     LLaMAModel::WeightType weight_type, size_t panel_rows) -> Weight
 {
-  if (vocab_.add_bos_token_)
-    tokens.push_back(vocab_.bos_token_);
+  auto& data_type = *info.data_type;
+  size_t rows = info.rows;
+  size_t cols = info.cols;
 
-  // TODO: SentencePiece uses a special 'LOWER ONE EIGHTH BLOCK' (underscore) character as a separator.
-  auto sep = vocab_.tokens_.find(std::string("\u2581"));
-
-  // split text into characters; handle utf-8 characters
-  std::string symbol;
-  for (size_t i = 0, utf_idx = 0; i < prompt.size(); i++)
+  if constexpr (std::variant_size_v<Weight> > 1)
   {
-    char c = prompt[i];
-
-    if (c  == ' ' && sep != vocab_.tokens_.end())
+    // rows that aren't a multiple of the block size keep their type
+    if (weight_type != LLaMAModel::kWeightFileType && cols % BlockQ8_0::kQuants == 0 &&
+        cols % BlockQ4_0::kQuants == 0)
     {
-      tokens.push_back(sep->second);
-      continue;
+      auto quantize = [&]<typename TSource>(TSource*) -> Weight {
+        auto source = file.GetTensor<TSource>(base, info);
+        if (weight_type == LLaMAModel::kWeightQ8_0)
+          return QuantizeWeight<BlockQ8_0>(source, rows, cols, panel_rows);
+        else
+          return QuantizeWeight<BlockQ4_0>(source, rows, cols, panel_rows);
+      };
+
+      if (data_type == typeid(T))
+        return quantize(static_cast<T*>(nullptr));
+      if (data_type == typeid(float16_t))
+        return quantize(static_cast<float16_t*>(nullptr));
+      if (data_type == typeid(bfloat16_t))
+        return quantize(static_cast<bfloat16_t*>(nullptr));
     }
+  }
 
-    symbol.push_back(c);
-    if (c < 0 && utf_idx++ < 4)
-      continue;
-
-    auto it = vocab_.tokens_.find(symbol);
-    if (it != vocab_.tokens_.end())
-      tokens.push_back(it->second);
-    else for (size_t j = 0; j < utf_idx; j++)
-      tokens.push_back(symbol[j] + 3);
+  if (data_type == typeid(T))
+    return Tensor2D(Tensor({rows, cols}, file.GetTensor<T>(base, info)));
 
-    symbol.clear();
-    utf_idx = 0;
+  if constexpr (std::variant_size_v<Weight> > 1)
+  {
+    // tensors that are stored in panels are used without copying them
+    size_t file_panel_rows = info.panel_rows;
+    auto mapped = [&]<typename TBlock>(TBlock*) -> Weight {
+      auto tensor = file.GetTensor<TBlock>(base, info);
+      if (file_panel_rows > 1)
+        return Quantized2D<TBlock>({rows, cols}, tensor, file_panel_rows);
+      if constexpr (std::is_same_v<TBlock, BlockQ8_0> || std::is_same_v<TBlock, BlockQ4_0>)
+      {
+        if (panel_rows > 1)
+          return RepackWeight(tensor, rows, cols, panel_rows);
+      }
+      return Quantized2D<TBlock>({rows, cols}, tensor);
+    };
+
+    if (data_type == typeid(BlockQ8_0))
+      return mapped(static_cast<BlockQ8_0*>(nullptr));
+    if (data_type == typeid(BlockQ4_0))
+      return mapped(static_cast<BlockQ4_0*>(nullptr));
+    if (data_type == typeid(BlockQ4_K))
+      return mapped(static_cast<BlockQ4_K*>(nullptr));
+    if (data_type == typeid(BlockQ5_K))
+      return mapped(static_cast<BlockQ5_K*>(nullptr));
+    if (data_type == typeid(BlockQ6_K))
+      return mapped(static_cast<BlockQ6_K*>(nullptr));
+    if (data_type == typeid(float16_t))
+      return mapped(static_cast<float16_t*>(nullptr));
+    if (data_type == typeid(bfloat16_t))
+      return mapped(static_cast<bfloat16_t*>(nullptr));
   }
 
-  while (1)
-  {
-    LLaMAVocab::token best_token;
-    float best_score = std::numeric_limits<float>::lowest();
-    int   best_index = -1;
+  throw std::runtime_error("unsupported data type of weight tensor " + Demangle(data_type.name()));
+}
 
-    for (size_t i = 0; i < tokens.size() - 1; i++)
-    {
-      auto symbol = vocab_.scores_[tokens[i]].text + vocab_.scores_[tokens[i + 1]].text;
-      auto it = vocab_.tokens_.find(symbol);
 
-      float score;
-      if (it != vocab_.tokens_.end() && (score = vocab_.scores_[it->second].score) > best_score)
-      {
-        best_score = score;
-        best_token = it->second;
-        best_index = i;
-      }
-    }
+template <typename T, typename Dev>
+template <typename TBlock, typename TSource>
+auto LLaMAModelT<T, Dev>::QuantizeWeight(const std::tuple<TSource*, size_t>& source, size_t rows, size_t cols,
+                                         size_t panel_rows) -> Quantized2D<TBlock>
+{
+  constexpr size_t kRowsPerTask = 16;
 
-    if (best_index == -1)
-      break;
+  auto [data, size] = source;
+  if (rows * cols * sizeof(TSource) > size)
+    throw std::runtime_error("weight tensor exceeds the size in the file");
 
-    tokens[best_index] = best_token;
-    tokens.erase(tokens.begin() + best_index + 1);
-  }
+  size_t blocks = cols / TBlock::kQuants;
+  std::shared_ptr<TBlock[]> buffer(new TBlock[rows * blocks]);
+
+  thread_pool_->Parallel((rows + kRowsPerTask - 1) / kRowsPerTask, [&](size_t task) {
+    std::vector<float> values(cols);
+    for (size_t row = task * kRowsPerTask; row < std::min(rows, (task + 1) * kRowsPerTask); row++)
+    {
+      const TSource* src = data + row * cols;
+      const float* x = values.data();
+      if constexpr (std::is_same_v<TSource, float>)
+        x = src;
+      else
+        std::transform(src, src + cols, values.begin(), [](TSource v) { return static_cast<float>(v); });
+      for (size_t b = 0; b < blocks; b++)
+        Quantize(x + b * TBlock::kQuants, buffer[PanelOffset(row, b, rows, blocks, panel_rows)]);
+    }
+  });
+
+  // the source pages aren't needed anymore; mapped pages are read again if the tensor is shared,
+  // and Release keeps the pages of files that were read into memory
+  mmap_->Release(data, rows * cols * sizeof(TSource));
+  quantized_weights_.push_back(buffer);
+  return Quantized2D<TBlock>({rows, cols}, std::make_tuple(buffer.get(), rows * blocks * sizeof(TBlock)),
+                             panel_rows);
+}
 
-  if (tokens.size() < 2)
-    throw std::runtime_error("expected at least 1 prompt token");
 
-  if (vocab_.add_eos_token_)
-    tokens.push_back(vocab_.eos_token_);
+template <typename T, typename Dev>
+template <typename TBlock>
+auto LLaMAModelT<T, Dev>::RepackWeight(const std::tuple<TBlock*, size_t>& source, size_t rows, size_t cols,
+                                       size_t panel_rows) -> Quantized2D<TBlock>
+{
+  auto [data, size] = source;
+  size_t blocks = cols / TBlock::kQuants;
+  if (cols % TBlock::kQuants != 0 || rows * blocks * sizeof(TBlock) > size)
+    throw std::runtime_error("weight tensor exceeds the size in the file");
+
+  std::shared_ptr<TBlock[]> buffer(new TBlock[rows * blocks]);
+
+  thread_pool_->Parallel((rows + panel_rows - 1) / panel_rows, [&](size_t panel) {
+    for (size_t row = panel * panel_rows; row < std::min(rows, (panel + 1) * panel_rows); row++)
+      for (size_t b = 0; b < blocks; b++)
+        buffer[PanelOffset(row, b, rows, blocks, panel_rows)] = data[row * blocks + b];
+  });
+
+  mmap_->Release(data, rows * blocks * sizeof(TBlock));
+  quantized_weights_.push_back(buffer);
+  return Quantized2D<TBlock>({rows, cols}, std::make_tuple(buffer.get(), rows * blocks * sizeof(TBlock)),
+                             panel_rows);
 }
 
 
+// Copied weights (float tensors, and quantized or repacked weights) are already in memory.
 template <typename T, typename Dev>
-std::string LLaMAModelT<T, Dev>::Decode(LLaMAVocab::token prev, LLaMAVocab::token token)
+std::vector<Prefetcher::Range>
+LLaMAModelT<T, Dev>::MappedRanges(std::initializer_list<const Weight*> weights) const
 {
-  std::string symbol = vocab_.scores_[token].text;
+  const char* begin = static_cast<const char*>(mmap_->Address());
+  const char* end = static_cast<const char*>(mmap_->End());
+
+  std::vector<Prefetcher::Range> ranges;
+  for (const Weight* weight : weights)
+    std::visit([&](const auto& w) {
+      if constexpr (!std::is_same_v<std::remove_cvref_t<decltype(w)>, Tensor2D>)
+      {
+        const char* data = reinterpret_cast<const char*>(w.Data());
+        if (data >= begin && data < end)
+          ranges.emplace_back(data, w.Size());
+      }
+    }, *weight);
+  return ranges;
+}
 
-  // if first token after <BOS> drop any space
-  if (prev == kBOS && symbol[0] == ' ')
-    symbol.erase(0,1);
 
-  // onvert raw bytes, e.g. <0x01> to actual bytes
-  if (symbol[0] == '<')
+// Streaming keeps at most two layers resident: the weights of the current layer, which are
+// released after use, and the weights of the next layer, which are loaded in the background.
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::BeginLayer(size_t index, size_t next)
+{
+  if (stream_layers_)
   {
-    if (symbol == "<unk>")
-      throw std::runtime_error("Failed to find symbol in vocab: " + std::to_string(token));
+    if (!layer_loads_[index].valid())
+      layer_loads_[index] = prefetcher_->Load(prefetch_ranges_[index]);
+    layer_loads_[index].get();
+    if (!layer_loads_[next].valid())
+      layer_loads_[next] = prefetcher_->Load(prefetch_ranges_[next]);
+  }
+  else if (prefetcher_)
+    prefetcher_->Prefetch(prefetch_ranges_[next]);
+}
+
+
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::EndLayer(size_t index)
+{
+  if (stream_layers_)
+    for (auto [addr, size] : prefetch_ranges_[index])
+      mmap_->Release(addr, size);
+}
+
 
-    auto end = symbol.find('>');
-    if (end != std::string::npos)
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::Embedding(T* x, LLaMAVocab::token token) const
+{
+  size_t dim = parameters_.dim_;
+  std::visit([&](const auto& embeddings) {
+    using weight_type = std::remove_cvref_t<decltype(embeddings)>;
+    if constexpr (std::is_same_v<weight_type, Tensor2D>)
+      std::copy_n(embeddings.Data() + token * dim, dim, x);
+    else
     {
-      symbol = symbol.substr(1, end - 1);
-      wchar_t x = std::stoul(symbol, nullptr, 16);
-      symbol = x;
+      constexpr size_t quants = weight_type::block_type::kQuants;
+      auto* blocks = embeddings.Data() + token * dim / quants;
+      for (size_t i = 0; i < dim / quants; i++)
+        Dequantize(blocks[i], x + i * quants);
     }
-  }
-  else
-  {
-    std::string sep("\u2581");
-    std::string::size_type pos = 0;
-    while ((pos = symbol.find(sep, pos)) != std::string::npos)
-      symbol.replace(pos, sep.size(), " "); // FIXME: doesn't work with gcc
-  }
+  }, embeddings_);
+}
+
 
-  return symbol;
+// Byte-Pair Encoding
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::EncodeBPE(std::string_view prompt, std::vector<LLaMAVocab::token>& tokens)
+{
+  tokens = tokenizer_->Encode(prompt);
+  if (tokens.size() - (vocab_.add_eos_token_ ? 1 : 0) < 2)
+    throw std::runtime_error("expected at least 1 prompt token");
 }
 
+
 // Note that this is a "lower-rank" implementation going through the calculation for each
 // token vector instead of combining a sequence into a matrix and using higher-rank tensors.
 template <typename T, typename Dev>
@@ -272,71 +553,32 @@ void LLaMAModelT<T, Dev>::Forward(LLaMAVocab::token token, size_t pos)
 {
   using namespace grid;
 
-  size_t dim = parameters_.dim_;
-  size_t n_heads = parameters_.num_heads_;
-  size_t n_kv_heads = parameters_.num_kv_heads_;
-  size_t head_size = dim / n_heads;
-  size_t kv_dim = parameters_.num_kv_heads_ * head_size;
-
-  x_ = embeddings_.View(token);
+  Embedding(x_.Data(), token);
 
-  for (auto& l: layers_)
+  for (size_t i = 0; i < layers_.size(); i++)
   {
+    auto& l = layers_[i];
+    BeginLayer(i, i + 1);
+
     // normalize input and element-multiply with weight.
     xb_ = RmsNorm(x_) * l.att_norm_;                      // (dim) * (dim) -> (dim)
 
-    // Insert Weight(xb) vectors into the key and value caches at row "pos"
-    l.key_cache_.View(pos) = Matmul(l.wk_, xb_);          // (kv_dim, dim) @ (dim) -> (kv_dim)
-    l.value_cache_.View(pos) = Matmul(l.wv_, xb_);        // (kv_dim, dim) @ (dim) -> (kv_dim)
-    l.q_ = Matmul(l.wq_, xb_);                            // (dim, dim) @ (dim)    -> (dim)
+    k_ = Linear(l.wk_, xb_);                              // (kv_dim, dim) @ (dim) -> (kv_dim)
+    v_ = Linear(l.wv_, xb_);                              // (kv_dim, dim) @ (dim) -> (kv_dim)
+    l.q_ = Linear(l.wq_, xb_);                            // (dim, dim) @ (dim)    -> (dim)
 
     // RoPE, rotate for each 'head'
-    auto q = l.q_.Data();
-    auto k = l.key_cache_.View(pos).Data();
-    for (size_t i = 0; i < dim; i+=2)
-    {
-      float rot = (float) pos / powf(10000.0f, (float)(i % head_size) / (float)head_size);
-      float fcr = cosf(rot);
-      float fci = sinf(rot);
-
-      float v0 = q[i];
-      float v1 = q[i+1];
-      q[i]   = v0 * fcr - v1 * fci;
-      q[i+1] = v0 * fci + v1 * fcr;
+    Rope(l.q_.Data(), k_.Data(), pos);
 
-      if (i < kv_dim)
-      {
-        float v0 = k[i];
-        float v1 = k[i+1];
-        k[i]   = v0 * fcr - v1 * fci;
-        k[i+1] = v0 * fci + v1 * fcr;
-      }
-    }
+    // Insert the key and value vectors into the key and value caches at row "pos"
+    l.kv_cache_.Store(pos, k_.Data(), v_.Data());
 
     // MultiHead(Q,K,V) = concat(head_1, ..., head_h) W_0, with head = Attention(Q_head,K_head,V_head)
-    for (size_t head = 0; head < n_heads; head++)
-    {
-      size_t head_offset = head * head_size;
-      size_t kv_head_offset = (head / (n_heads/n_kv_heads)) * head_size;
-
-      // Attention(Q,K,V) = softmax(Q * K^T / sqrt(kv_dim)) * V
-      //
-      // For a single token (seq = 1) at position pos, and looping through the head count, this
-      // reduces to:
-      // scores [head_offset:head_offset + head_size] =
-      //   softmax(K [:pos+1, head:head+head_size] @ q [head:head+head_size] @ V [:pos+1, head:head+head_size]
-      scores_.View(Extent(head_offset, head_size)) =
-        Matmul(
-          SoftMax(
-            Matmul(
-              l.key_cache_.View(Extent(pos + 1), Extent(kv_head_offset, head_size)),
-              l.q_.View(Extent(head_offset, head_size))) / sqrt(static_cast<T>(head_size))),
-          l.value_cache_.View(Extent(pos + 1), Extent(kv_head_offset, head_size)));
-    }
+    Attention(l, pos);
 
     // bring it all together
     // (dim, dim) @ (dim = n_heads * head_size) -> (dim)
-    x_ += Matmul(l.wo_, scores_);
+    x_ += Linear(l.wo_, scores_);
 
     // (dim) * (dim) -> (dim)
     xb_ = RmsNorm(x_) * l.ffn_norm_;
@@ -345,12 +587,200 @@ void LLaMAModelT<T, Dev>::Forward(LLaMAVocab::token token, size_t pos)
     // w1(x), w3(x)         -> (hidden_dim, dim) @ (dim)        -> (hidden_dim)
     // silu(w1(x)) * w3(x)  -> (hidden_dim) * (hiddem_dim)      -> (hidden_dim)
     // w2(...)              -> (dim, hidden_dim) @ (hidden_dim) -> (dim)
-    x_ += Matmul(l.w2_, Silu(Matmul(l.w1_, xb_)) * Matmul(l.w3_, xb_));
+    x_ += Linear(l.w2_, Silu(Linear(l.w1_, xb_)) * Linear(l.w3_, xb_));
+    EndLayer(i);
   }
 
   // Final RMS norm and classified into logits
   // (vocab_size, dim) @ ((dim, dim) * (dim)) -> (vocab_size)
-  logits_ = Matmul(output_, RmsNorm(x_) * output_norm_);
+  BeginLayer(layers_.size(), 0);
+  logits_ = Linear(output_, RmsNorm(x_) * output_norm_);
+  EndLayer(layers_.size());
+}
+
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::Rope(T* q, T* k, size_t pos) const
+{
+  size_t dim = parameters_.dim_;
+  size_t head_size = dim / parameters_.num_heads_;
+  size_t kv_dim = parameters_.num_kv_heads_ * head_size;
+
+  for (size_t i = 0; i < dim; i+=2)
+  {
+    float rot = (float) pos / powf(10000.0f, (float)(i % head_size) / (float)head_size);
+    float fcr = cosf(rot);
+    float fci = sinf(rot);
+
+    float v0 = q[i];
+    float v1 = q[i+1];
+    q[i]   = v0 * fcr - v1 * fci;
+    q[i+1] = v0 * fci + v1 * fcr;
+
+    if (i < kv_dim)
+    {
+      float v0 = k[i];
+      float v1 = k[i+1];
+      k[i]   = v0 * fcr - v1 * fci;
+      k[i+1] = v0 * fci + v1 * fcr;
+    }
+  }
+}
+
+// The prompt tokens are combined into {seq, dim} matrices, so the weights are read once for the
+// batch instead of once per token. The linear layers compute X @ W^T using a transposed view of
+// the weights, and the attention uses the fused causal attention operator for each head.
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::ForwardPrompt(std::span<const LLaMAVocab::token> tokens, size_t pos)
+{
+  // The batched path requires the fused attention operator, which is only available for the base device.
+  if constexpr (!std::is_same_v<Dev, device::Base>)
+  {
+    for (size_t i = 0; i < tokens.size(); i++)
+      Forward(tokens[i], pos + i);
+  }
+  else
+  {
+    size_t seq = tokens.size();
+    size_t dim = parameters_.dim_;
+    size_t n_heads = parameters_.num_heads_;
+    size_t n_kv_heads = parameters_.num_kv_heads_;
+    size_t head_size = dim / n_heads;
+    size_t kv_dim = n_kv_heads * head_size;
+    T scale = T{1} / sqrt(static_cast<T>(head_size));
+
+    Tensor2D x({seq, dim}, Uninitialized<T>{});
+    for (size_t i = 0; i < seq; i++)
+      Embedding(x.Data() + i * dim, tokens[i]);
+
+    for (size_t layer = 0; layer < layers_.size(); layer++)
+    {
+      auto& l = layers_[layer];
+      BeginLayer(layer, layer + 1 < layers_.size() ? layer + 1 : 0);
+
+      Tensor2D xb = Mul(RmsNorm(x), l.att_norm_);         // (seq, dim) * (dim) -> (seq, dim)
+      Tensor2D q = Linear(l.wq_, xb);                     // (seq, dim) @ (dim, dim) -> (seq, dim)
+      Tensor2D k = Linear(l.wk_, xb);                     // (seq, dim) @ (dim, kv_dim) -> (seq, kv_dim)
+      Tensor2D v = Linear(l.wv_, xb);                     // (seq, dim) @ (dim, kv_dim) -> (seq, kv_dim)
+
+      for (size_t i = 0; i < seq; i++)
+      {
+        Rope(q.Data() + i * dim, k.Data() + i * kv_dim, pos + i);
+        l.kv_cache_.Store(pos + i, k.Data() + i * kv_dim, v.Data() + i * kv_dim);
+      }
+
+      // Attention for each head over all cached positions including the batch, causal masked.
+      // The query heads sharing a key/value head run in the same task, so the key/value rows are
+      // dequantized once and stay in cache for all heads of the group.
+      Tensor2D scores({seq, dim}, Uninitialized<T>{});
+      size_t group = n_heads / n_kv_heads;
+      thread_pool_->Parallel(n_kv_heads, [&](size_t kv_head) {
+        Tensor2D keys, values;
+        if (l.kv_cache_.Type() != kCacheModelType)
+        {
+          keys = Tensor2D({pos + seq, head_size}, Uninitialized<T>{});
+          values = Tensor2D({pos + seq, head_size}, Uninitialized<T>{});
+          l.kv_cache_.Dequantize(keys.Data(), values.Data(), kv_head, pos + seq);
+        }
+
+        for (size_t head = kv_head * group; head < (kv_head + 1) * group; head++)
+        {
+          auto query = q.View(Extent(seq), Extent(head * head_size, head_size));
+          auto out = scores.View(Extent(seq), Extent(head * head_size, head_size));
+
+          if (l.kv_cache_.Type() == kCacheModelType)
+            out = grid::Attention(query, l.kv_cache_.Keys(kv_head, pos + seq),
+                                  l.kv_cache_.Values(kv_head, pos + seq), true, scale);
+          else
+            out = grid::Attention(query, keys.View(), values.View(), true, scale);
+        }
+      });
+
+      x += Linear(l.wo_, scores);                       // (seq, dim) @ (dim, dim) -> (seq, dim)
+      xb = Mul(RmsNorm(x), l.ffn_norm_);
+
+      // w2(silu(w1(x)) * w3(x)) -> (seq, hidden_dim) @ (hidden_dim, dim) -> (seq, dim)
+      x += Linear(l.w2_, Silu(Linear(l.w1_, xb)) * Linear(l.w3_, xb));
+      EndLayer(layer);
+    }
+  }
+}
+
+// Attention(Q,K,V) = softmax(Q * K^T / sqrt(head_size)) * V
+//
+// For a single token (seq = 1) at position pos, this reduces to the following for each head:
+//   scores [head_offset:head_offset + head_size] =
+//     softmax(K [:pos+1, head:head+head_size] @ q [head:head+head_size]) @ V [:pos+1, head:head+head_size]
+//
+// The cached positions are split into chunks, and the heads and chunks are distributed across
+// the threads. Each task computes the maximum m, the sum of exp(score - m), and the weighted sum
+// of the values o for its chunk. The partial results are then merged with:
+//   M = max(m_c), out = sum(exp(m_c - M) * o_c) / sum(exp(m_c - M) * s_c)
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::Attention(const LLaMALayer& l, size_t pos)
+{
+  size_t n_heads = parameters_.num_heads_;
+  size_t n_kv_heads = parameters_.num_kv_heads_;
+  size_t head_size = parameters_.dim_ / n_heads;
+  size_t count = pos + 1;
+  size_t n_chunks = (count + kAttentionChunkSize - 1) / kAttentionChunkSize;
+  T scale = T{1} / sqrt(static_cast<T>(head_size));
+
+  // Query heads sharing a key/value head are processed together, so each key and value row is
+  // read only once per group.
+  size_t group = n_heads / n_kv_heads;
+  size_t max_seq_len = parameters_.max_seq_len_;
+
+  thread_pool_->Parallel(n_kv_heads * n_chunks, [&](size_t index) {
+    size_t kv_head = index / n_chunks;
+    size_t chunk = index % n_chunks;
+    size_t head = kv_head * group;
+    size_t first = chunk * kAttentionChunkSize;
+    size_t size = std::min(kAttentionChunkSize, count - first);
+
+    T* att = att_.Data() + head * max_seq_len + first;
+    l.kv_cache_.Scores(att, max_seq_len, l.q_.Data() + head * head_size, group, kv_head, first, size);
+
+    for (size_t g = 0; g < group; g++)
+    {
+      T* scores = att + g * max_seq_len;
+      T max = std::numeric_limits<T>::lowest();
+      for (size_t i = 0; i < size; i++)
+        max = std::max(max, scores[i] *= scale);
+
+      T sum{0};
+      for (size_t i = 0; i < size; i++)
+        sum += scores[i] = std::exp(scores[i] - max);
+
+      size_t partial = (head + g) * n_chunks + chunk;
+      att_max_.Data()[partial] = max;
+      att_sum_.Data()[partial] = sum;
+    }
+
+    l.kv_cache_.Accumulate(att_out_.Data() + (head * n_chunks + chunk) * head_size, n_chunks * head_size,
+                           att, max_seq_len, group, kv_head, first, size);
+  });
+
+  for (size_t head = 0; head < n_heads; head++)
+  {
+    const T* max = att_max_.Data() + head * n_chunks;
+    const T* sum = att_sum_.Data() + head * n_chunks;
+    const T* out = att_out_.Data() + head * n_chunks * head_size;
+    T* scores = scores_.Data() + head * head_size;
+
+    T global_max = *std::max_element(max, max + n_chunks);
+    T global_sum{0};
+    std::fill_n(scores, head_size, T{0});
+    for (size_t chunk = 0; chunk < n_chunks; chunk++, out += head_size)
+    {
+      T weight = std::exp(max[chunk] - global_max);
+      global_sum += weight * sum[chunk];
+      for (size_t i = 0; i < head_size; i++)
+        scores[i] += weight * out[i];
+    }
+
+    for (size_t i = 0; i < head_size; i++)
+      scores[i] /= global_sum;
+  }
 }
 
 template <typename T, typename Dev>
@@ -381,29 +811,127 @@ LLaMAVocab::token LLaMAModelT<T, Dev>::Sample()
 }
 
 template <typename T, typename Dev>
-void LLaMAModelT<T, Dev>::Predict(std::string_view prompt, size_t steps)
+size_t LLaMAModelT<T, Dev>::RestorePrefix(std::span<const LLaMAVocab::token> tokens)
+{
+  if (!prefix_cache_)
+    return 0;
+
+  auto blocks = prefix_cache_->Find(tokens);
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    const char* data = blocks[i];
+    for (auto& l: layers_)
+    {
+      l.kv_cache_.Write(data, i * kPrefixBlockSize, kPrefixBlockSize);
+      data += kPrefixBlockSize * l.kv_cache_.RowSize();
+    }
+  }
+
+  return blocks.size() * kPrefixBlockSize;
+}
+
+
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::SavePrefix(std::span<const LLaMAVocab::token> tokens)
+{
+  if (!prefix_cache_)
+    return;
+
+  prefix_cache_->Insert(tokens, [&](size_t index, char* buffer) {
+    for (auto& l: layers_)
+    {
+      l.kv_cache_.Read(buffer, index * kPrefixBlockSize, kPrefixBlockSize);
+      buffer += kPrefixBlockSize * l.kv_cache_.RowSize();
+    }
+  });
+}
+
+
+template <typename T, typename Dev>
+void LLaMAModelT<T, Dev>::Generate(std::string_view prompt, size_t steps, const TokenCallback& callback,
+                                   std::stop_token stop)
 {
   using token = LLaMAVocab::token;
+  using clock = std::chrono::steady_clock;
+
+  // the key-value caches and attention scores hold max_seq_len_ positions
+  steps = std::min(steps, parameters_.max_seq_len_);
 
   std::vector<token> prompt_tokens;
   EncodeBPE(prompt, prompt_tokens);
 
-  size_t pos = 0;
   size_t prompt_token_size = prompt_tokens.size();
 
-  for (token curr = prompt_tokens[0]; pos < steps; pos++)
+  LLaMADecoder decoder(*tokenizer_);
+  Token next{};
+  bool running = true;
+  auto emit = [&](token prev, token curr, size_t pos, bool prompt, clock::duration duration) {
+    next.id_ = curr;
+    next.text_.clear();
+    decoder.Decode(prev, curr, next.text_);
+    next.position_ = pos;
+    next.prompt_ = prompt;
+    next.duration_ = duration;
+    running = callback(next);
+  };
+
+  // pass the bytes of an incomplete character that are left
+  auto flush = [&]() {
+    next.text_.clear();
+    decoder.Flush(next.text_);
+    if (next.text_.empty())
+      return;
+    next.id_ = kNoToken;
+    next.duration_ = {};
+    callback(next);
+  };
+
+  size_t pos = 0;
+  try
   {
-    Forward(curr, pos);
-    token prev = curr;
+    // Skip the positions of a cached prefix and run the remaining prompt tokens, except the last
+    // prompt token, which is run below to get the logits, in batches. The prompt tokens of a
+    // batch are passed after the batch.
+    auto start = clock::now();
+    auto emit_prompt = [&](size_t begin, size_t end) {
+      auto now = clock::now();
+      for (size_t i = begin + 1; i <= end && running; i++)
+        emit(prompt_tokens[i - 1], prompt_tokens[i], i, true, i == end ? now - start : clock::duration{});
+      start = clock::now();
+    };
+
+    pos = RestorePrefix(std::span(prompt_tokens).first(prompt_token_size - 1));
+    emit_prompt(0, pos);
+    for (size_t end = std::min(prompt_token_size - 1, steps); running && pos < end && !stop.stop_requested(); )
+    {
+      size_t count = std::min(end - pos, stream_layers_ ? kStreamingPrefillBatchSize : kPrefillBatchSize);
+      ForwardPrompt(std::span(prompt_tokens).subspan(pos, count), pos);
+      emit_prompt(pos, pos + count);
+      pos += count;
+    }
 
-    curr = (pos < prompt_token_size - 1) ? prompt_tokens[pos + 1] : Sample();
-    if (curr == kBOS)
-      break;
+    for (token curr = prompt_tokens[pos]; running && pos < steps && !stop.stop_requested(); pos++)
+    {
+      Forward(curr, pos);
+      token prev = curr;
 
-    std::string symbol = Decode(prev, curr);
-    std::cout << symbol << std::flush;
+      bool prompt = pos < prompt_token_size - 1;
+      curr = prompt ? prompt_tokens[pos + 1] : Sample();
+      if (curr == kBOS)
+        break;
+
+      emit(prev, curr, pos + 1, prompt, clock::now() - start);
+      start = clock::now();
+    }
   }
-  std::cout << std::endl;
+  catch (...)
+  {
+    flush();
+    throw;
+  }
+  flush();
+
+  SavePrefix(std::span(prompt_tokens).first(std::min(pos, prompt_token_size)));
 }
 
 } // end of namespace grid
@@ -0,0 +1,296 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <limits>
+#include <queue>
+#include <string>
+
+#include "llama_tokenizer.h"
+
+namespace grid {
+
+namespace {
+
+// SentencePiece uses a special 'LOWER ONE EIGHTH BLOCK' (underscore) character as a separator.
+constexpr std::string_view kSeparator = "\u2581";
+
+} // end of namespace
+
+
+LLaMATokenizer::LLaMATokenizer(const LLaMAVocab& vocab, std::shared_ptr<ThreadPool> thread_pool)
+  : vocab_(vocab),
+    thread_pool_(std::move(thread_pool)),
+    separator_(vocab.Find(kSeparator)),
+    splittable_(separator_ != LLaMAVocab::kInvalidToken),
+    unknown_(vocab.Find("<unk>"))
+{
+  // a token that includes a separator after another character could merge across chunks
+  for (size_t i = 0; i < vocab_.Size() && splittable_; i++)
+  {
+    std::string_view text = vocab_.Text(i);
+    for (size_t pos = text.find(kSeparator, 1); pos != std::string_view::npos;
+         pos = text.find(kSeparator, pos + 1))
+    {
+      if (pos < kSeparator.size() || text.substr(pos - kSeparator.size(), kSeparator.size()) != kSeparator)
+        splittable_ = false;
+    }
+  }
+
+  for (size_t c = 0; c < byte_tokens_.size(); c++)
+  {
+    char text[8];
+    snprintf(text, sizeof(text), "<0x%02X>", static_cast<unsigned>(c));
+    byte_tokens_[c] = vocab_.Find(text);
+  }
+
+  // decode all tokens once, so decoding a token is a lookup
+  piece_offsets_.resize(vocab_.Size() + 1);
+  for (size_t i = 0; i < vocab_.Size(); i++)
+  {
+    std::string_view text = vocab_.Text(i);
+    piece_offsets_[i] = pieces_.size();
+
+    if (i == vocab_.bos_token_ || i == vocab_.eos_token_ || i == unknown_)
+      continue;
+
+    if (text.size() == 6 && text.starts_with("<0x") && text.ends_with('>') &&
+        isxdigit(text[3]) && isxdigit(text[4]))
+      pieces_.push_back(static_cast<char>(std::stoul(std::string(text.substr(3, 2)), nullptr, 16)));
+    else
+    {
+      for (size_t pos; (pos = text.find(kSeparator)) != std::string_view::npos; )
+      {
+        pieces_.append(text.substr(0, pos)).push_back(' ');
+        text.remove_prefix(pos + kSeparator.size());
+      }
+      pieces_.append(text);
+    }
+  }
+  piece_offsets_[vocab_.Size()] = pieces_.size();
+}
+
+
+std::vector<std::string_view> LLaMATokenizer::Split(std::string_view text) const
+{
+  if (!splittable_ || thread_pool_ == nullptr)
+    return {text};
+
+  // Split before a space that follows an ASCII character other than a space: the character
+  // completes its symbol, and the tokens of the space start with a separator.
+  std::vector<std::string_view> chunks;
+  size_t begin = 0;
+  for (size_t pos = kChunkSize; pos < text.size(); pos++)
+  {
+    unsigned char prev = text[pos - 1];
+    if (text[pos] == ' ' && prev < 0x80 && prev != ' ' && pos - begin >= kChunkSize)
+    {
+      chunks.push_back(text.substr(begin, pos - begin));
+      begin = pos;
+    }
+  }
+  chunks.push_back(text.substr(begin));
+  return chunks;
+}
+
+
+auto LLaMATokenizer::EncodeChunk(std::string_view chunk, bool bos) const -> std::vector<token>
+{
+  std::vector<token> tokens;
+  if (bos)
+    tokens.push_back(vocab_.bos_token_);
+
+  // Split the text into characters, which are sized by their UTF-8 lead byte. A character that
+  // isn't in the vocabulary falls back to its byte tokens <0xNN>, or to the unknown token if the
+  // vocabulary doesn't include them.
+  for (size_t i = 0; i < chunk.size(); )
+  {
+    if (chunk[i] == ' ' && separator_ != LLaMAVocab::kInvalidToken)
+    {
+      tokens.push_back(separator_);
+      i++;
+      continue;
+    }
+
+    unsigned char lead = chunk[i];
+    size_t length = lead >= 0xf8 ? 1 : lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+    size_t end = i + 1;
+    while (end < chunk.size() && end - i < length &&
+           (static_cast<unsigned char>(chunk[end]) & 0xc0) == 0x80)
+      end++;
+
+    std::string_view symbol = chunk.substr(i, end - i);
+    i = end;
+
+    auto id = vocab_.Find(symbol);
+    if (id != LLaMAVocab::kInvalidToken)
+    {
+      tokens.push_back(id);
+      continue;
+    }
+
+    bool bytes = std::ranges::all_of(symbol, [&](unsigned char c) {
+      return byte_tokens_[c] != LLaMAVocab::kInvalidToken;
+    });
+    if (bytes)
+      for (unsigned char c : symbol)
+        tokens.push_back(byte_tokens_[c]);
+    else if (unknown_ != LLaMAVocab::kInvalidToken)
+      tokens.push_back(unknown_);
+  }
+
+  // Merge the pair with the highest score, the leftmost of equal scores, until no pair can be
+  // merged. The symbols form a linked list, and the candidate merges are kept in a priority queue
+  // that also holds candidates of symbols that have been merged since, which are skipped.
+  constexpr size_t kNone = std::numeric_limits<size_t>::max();
+  struct Symbol
+  {
+    LLaMAVocab::token token;
+    size_t            prev;
+    size_t            next;
+  };
+  struct Merge
+  {
+    float             score;
+    size_t            left;
+    size_t            right;
+    LLaMAVocab::token left_token;
+    LLaMAVocab::token right_token;
+    LLaMAVocab::token token;
+    bool operator<(const Merge& other) const
+    {
+      return score < other.score || (score == other.score && left > other.left);
+    }
+  };
+
+  std::vector<Symbol> symbols(tokens.size());
+  for (size_t i = 0; i < tokens.size(); i++)
+    symbols[i] = Symbol{tokens[i], i > 0 ? i - 1 : kNone, i + 1 < tokens.size() ? i + 1 : kNone};
+
+  std::priority_queue<Merge> merges;
+  auto add_merge = [&](size_t left, size_t right) {
+    if (left == kNone || right == kNone)
+      return;
+    auto id = vocab_.FindMerge(symbols[left].token, symbols[right].token);
+    if (id != LLaMAVocab::kInvalidToken)
+      merges.push(Merge{vocab_.Score(id), left, right, symbols[left].token, symbols[right].token, id});
+  };
+
+  for (size_t i = 0; i + 1 < symbols.size(); i++)
+    add_merge(i, i + 1);
+
+  while (!merges.empty())
+  {
+    Merge merge = merges.top();
+    merges.pop();
+
+    Symbol& left = symbols[merge.left];
+    Symbol& right = symbols[merge.right];
+    if (left.next != merge.right || left.token != merge.left_token || right.token != merge.right_token)
+      continue;
+
+    left.token = merge.token;
+    left.next = right.next;
+    if (right.next != kNone)
+      symbols[right.next].prev = merge.left;
+    right.token = LLaMAVocab::kInvalidToken;
+
+    add_merge(left.prev, merge.left);
+    add_merge(merge.left, left.next);
+  }
+
+  tokens.clear();
+  for (size_t i = symbols.empty() ? kNone : 0; i != kNone; i = symbols[i].next)
+    tokens.push_back(symbols[i].token);
+
+  return tokens;
+}
+
+
+auto LLaMATokenizer::Encode(std::string_view text) const -> std::vector<token>
+{
+  return std::move(Encode(std::span(&text, 1))[0]);
+}
+
+
+auto LLaMATokenizer::Encode(std::span<const std::string_view> texts) const
+  -> std::vector<std::vector<token>>
+{
+  // encode the chunks of all texts in parallel and concatenate the tokens of each text
+  std::vector<std::string_view> chunks;
+  std::vector<size_t> text_chunks(texts.size() + 1);
+  std::vector<bool> first;
+  for (size_t i = 0; i < texts.size(); i++)
+  {
+    text_chunks[i] = chunks.size();
+    for (auto chunk : Split(texts[i]))
+    {
+      first.push_back(chunks.size() == text_chunks[i]);
+      chunks.push_back(chunk);
+    }
+  }
+  text_chunks[texts.size()] = chunks.size();
+
+  std::vector<std::vector<token>> chunk_tokens(chunks.size());
+  auto encode = [&](size_t i) {
+    chunk_tokens[i] = EncodeChunk(chunks[i], first[i] && vocab_.add_bos_token_);
+  };
+  if (thread_pool_ != nullptr)
+    thread_pool_->Parallel(chunks.size(), encode);
+  else
+    for (size_t i = 0; i < chunks.size(); i++)
+      encode(i);
+
+  std::vector<std::vector<token>> tokens(texts.size());
+  for (size_t i = 0; i < texts.size(); i++)
+  {
+    for (size_t chunk = text_chunks[i]; chunk < text_chunks[i + 1]; chunk++)
+      tokens[i].insert(tokens[i].end(), chunk_tokens[chunk].begin(), chunk_tokens[chunk].end());
+    if (vocab_.add_eos_token_)
+      tokens[i].push_back(vocab_.eos_token_);
+  }
+  return tokens;
+}
+
+
+
+void LLaMADecoder::Decode(token prev, token curr, std::string& text)
+{
+  std::string_view piece = tokenizer_.Decode(curr);
+  if (prev == tokenizer_.Vocab().bos_token_ && tokenizer_.Vocab().Text(curr).starts_with(' '))
+    piece.remove_prefix(1);
+  pending_.append(piece);
+
+  // find the lead byte of the last character and hold it back if its continuation bytes are
+  // missing; invalid sequences are passed through
+  size_t complete = pending_.size();
+  for (size_t i = pending_.size(); i > 0 && pending_.size() - i < 4; i--)
+  {
+    unsigned char c = pending_[i - 1];
+    if ((c & 0xc0) == 0x80)
+      continue;
+    size_t length = c >= 0xf8 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    if (i - 1 + length > pending_.size())
+      complete = i - 1;
+    break;
+  }
+
+  text.append(pending_, 0, complete);
+  pending_.erase(0, complete);
+}
+
+
+void LLaMADecoder::Flush(std::string& text)
+{
+  text.append(pending_);
+  pending_.clear();
+}
+
+} // end of namespace grid
@@ -0,0 +1,108 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef _LLAMA_TOKENIZER_H
+#define _LLAMA_TOKENIZER_H
+
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <grid/util/thread_pool.h>
+
+#include "llama_vocab.h"
+
+namespace grid {
+
+/// LLaMATokenizer encodes texts into the tokens of a vocabulary using byte-pair encoding.
+///
+/// Texts are encoded in parallel, and long texts are split into chunks that are encoded in
+/// parallel. The chunks are split at spaces that no token of the vocabulary spans, so merges never
+/// cross chunks and the tokens are the same as for encoding the text as a whole. Texts are not
+/// split for vocabularies with tokens that span such a space.
+class LLaMATokenizer
+{
+ public:
+  using token = LLaMAVocab::token;
+
+  /// kChunkSize is the minimum size of the chunks that long texts are split into.
+  static constexpr size_t kChunkSize = 4096;
+
+  /// Constructor
+  ///
+  /// @param vocab        Vocabulary, which shares its tables with the provided vocabulary.
+  /// @param thread_pool  Thread pool for encoding in parallel; nullptr encodes in the calling thread.
+  explicit LLaMATokenizer(const LLaMAVocab& vocab, std::shared_ptr<ThreadPool> thread_pool = nullptr);
+
+  /// Encode encodes the text into tokens, including the begin and end tokens if the vocabulary
+  /// requests them.
+  std::vector<token> Encode(std::string_view text) const;
+
+  /// Encode encodes the texts; see Encode(std::string_view).
+  std::vector<std::vector<token>> Encode(std::span<const std::string_view> texts) const;
+
+  /// Decode returns the bytes of the token: separators are replaced with spaces, byte tokens
+  /// <0xNN> with the byte, and the begin, end, and unknown tokens are empty. It throws for
+  /// tokens that aren't in the vocabulary.
+  std::string_view Decode(token id) const
+  {
+    if (id >= vocab_.Size())
+      throw std::out_of_range("invalid token: " + std::to_string(id));
+    return std::string_view(pieces_).substr(piece_offsets_[id], piece_offsets_[id + 1] - piece_offsets_[id]);
+  }
+
+  /// Vocab returns the vocabulary.
+  const LLaMAVocab& Vocab() const                   { return vocab_; }
+
+ private:
+  // Split splits the text into chunks at spaces that no token spans.
+  std::vector<std::string_view> Split(std::string_view text) const;
+
+  // EncodeChunk encodes the chunk of a text, starting with the begin token if bos is true.
+  std::vector<token> EncodeChunk(std::string_view chunk, bool bos) const;
+
+  LLaMAVocab                  vocab_;
+  std::shared_ptr<ThreadPool> thread_pool_;
+  token                       separator_;       // "▁" or kInvalidToken
+  bool                        splittable_;      // no token spans a space after another character
+  token                       unknown_;         // "<unk>" or kInvalidToken
+  std::array<token, 256>      byte_tokens_;     // "<0xNN>" or kInvalidToken for each byte
+  std::string                 pieces_;          // decoded bytes of all tokens
+  std::vector<uint32_t>       piece_offsets_;   // offsets of the tokens in pieces_ {vocab_size + 1}
+};
+
+
+/// LLaMADecoder decodes a stream of tokens into text. It holds back the bytes of an incomplete
+/// UTF-8 character, for example, of byte tokens, until the character is complete, so the text
+/// only ends with a partial character after Flush.
+class LLaMADecoder
+{
+ public:
+  using token = LLaMAVocab::token;
+
+  explicit LLaMADecoder(const LLaMATokenizer& tokenizer) : tokenizer_(tokenizer) {}
+
+  /// Decode appends the text of the token that follows the token prev to the text. The leading
+  /// space of a token text that follows the begin token is dropped.
+  void Decode(token prev, token curr, std::string& text);
+
+  /// Flush appends the held back bytes to the text.
+  void Flush(std::string& text);
+
+ private:
+  const LLaMATokenizer& tokenizer_;
+  std::string           pending_;               // bytes of an incomplete character
+};
+
+} // end of namespace grid
+
+#endif  // _LLAMA_TOKENIZER_H
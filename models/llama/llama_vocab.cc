@@ -0,0 +1,277 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+#include <grid/tensor/mmap.h>
+
+#include "llama_vocab.h"
+
+namespace grid {
+
+namespace {
+
+// Hash returns the FNV-1a hash of the text.
+uint64_t Hash(std::string_view text)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : text)
+    hash = (hash ^ c) * 0x100000001b3;
+  return hash;
+}
+
+// Hash returns the hash of a pair of tokens.
+uint64_t Hash(uint32_t left, uint32_t right)
+{
+  uint64_t hash = ((uint64_t{left} << 32) | right) * 0x9e3779b97f4a7c15;
+  return hash ^ (hash >> 29);
+}
+
+// Slots returns the number of slots of a hash table for count entries (load factor <= 0.5).
+size_t Slots(size_t count)
+{
+  size_t slots = 16;
+  while (slots < 2 * count)
+    slots *= 2;
+  return slots;
+}
+
+} // end of namespace
+
+
+size_t LLaMAVocab::ImageSize() const
+{
+  return vocab_size_ * sizeof(float) + (vocab_size_ + 1) * sizeof(uint32_t) +
+         token_slots_ * sizeof(uint32_t) + merge_slots_ * sizeof(LLaMAVocabMerge) + strings_size_;
+}
+
+
+void LLaMAVocab::Attach(const char* data)
+{
+  image_ = data;
+  scores_ = reinterpret_cast<const float*>(data);
+  offsets_ = reinterpret_cast<const uint32_t*>(scores_ + vocab_size_);
+  tokens_ = offsets_ + vocab_size_ + 1;
+  merges_ = reinterpret_cast<const LLaMAVocabMerge*>(tokens_ + token_slots_);
+  strings_ = reinterpret_cast<const char*>(merges_ + merge_slots_);
+}
+
+
+void LLaMAVocab::Build(std::span<const std::string_view> texts, std::span<const float> scores)
+{
+  if (texts.size() != scores.size())
+    throw std::runtime_error("tokens and scores don't match");
+
+  vocab_size_ = texts.size();
+  token_slots_ = Slots(vocab_size_);
+  merge_slots_ = 0;
+  strings_size_ = 0;
+  max_token_length_ = 0;
+  for (auto text : texts)
+  {
+    strings_size_ += text.size();
+    max_token_length_ = std::max(max_token_length_, text.size());
+  }
+  if (strings_size_ > UINT32_MAX)
+    throw std::runtime_error("tokens exceed the vocabulary size limit");
+
+  // build the image without merges to find the merges with the token table
+  std::shared_ptr<uint32_t[]> buffer(new uint32_t[(ImageSize() + 3) / 4]());
+  Attach(reinterpret_cast<const char*>(buffer.get()));
+
+  // the image is owned and written only while it is built
+  std::copy(scores.begin(), scores.end(), const_cast<float*>(scores_));
+  auto* offsets = const_cast<uint32_t*>(offsets_);
+  auto* strings = const_cast<char*>(strings_);
+  for (size_t i = 0; i < vocab_size_; i++)
+  {
+    offsets[i + 1] = offsets[i] + texts[i].size();
+    memcpy(strings + offsets[i], texts[i].data(), texts[i].size());
+  }
+
+  // later tokens replace earlier tokens with the same text
+  auto* tokens = const_cast<uint32_t*>(tokens_);
+  for (size_t i = 0; i < vocab_size_; i++)
+  {
+    size_t slot = Hash(texts[i]) & (token_slots_ - 1);
+    while (tokens[slot] != 0 && Text(tokens[slot] - 1) != texts[i])
+      slot = (slot + 1) & (token_slots_ - 1);
+    tokens[slot] = i + 1;
+  }
+
+  // a token is the merge of any two tokens whose texts it concatenates
+  std::vector<LLaMAVocabMerge> merges;
+  for (size_t i = 0; i < vocab_size_; i++)
+  {
+    std::string_view text = Text(i);
+    if (Find(text) != i)
+      continue;
+    for (size_t split = 1; split < text.size(); split++)
+    {
+      token left = Find(text.substr(0, split));
+      token right = left != kInvalidToken ? Find(text.substr(split)) : kInvalidToken;
+      if (right != kInvalidToken)
+        merges.push_back(LLaMAVocabMerge{left, right, static_cast<token>(i)});
+    }
+  }
+
+  size_t tables_size = ImageSize() - strings_size_;
+  merge_slots_ = Slots(merges.size());
+
+  std::shared_ptr<uint32_t[]> image(new uint32_t[(ImageSize() + 3) / 4]);
+  memcpy(image.get(), buffer.get(), tables_size);
+  Attach(reinterpret_cast<const char*>(image.get()));
+  memcpy(const_cast<char*>(strings_), strings, strings_size_);
+
+  auto* merge_table = const_cast<LLaMAVocabMerge*>(merges_);
+  std::fill_n(merge_table, merge_slots_, LLaMAVocabMerge{0, 0, kInvalidToken});
+  for (auto& merge : merges)
+  {
+    size_t slot = Hash(merge.left, merge.right) & (merge_slots_ - 1);
+    while (merge_table[slot].token != kInvalidToken)
+      slot = (slot + 1) & (merge_slots_ - 1);
+    merge_table[slot] = merge;
+  }
+
+  storage_ = std::move(image);
+}
+
+
+auto LLaMAVocab::Find(std::string_view text) const -> token
+{
+  if (token_slots_ == 0)
+    return kInvalidToken;
+
+  for (size_t slot = Hash(text) & (token_slots_ - 1); tokens_[slot] != 0;
+       slot = (slot + 1) & (token_slots_ - 1))
+    if (Text(tokens_[slot] - 1) == text)
+      return tokens_[slot] - 1;
+  return kInvalidToken;
+}
+
+
+auto LLaMAVocab::FindMerge(token left, token right) const -> token
+{
+  if (merge_slots_ == 0)
+    return kInvalidToken;
+
+  for (size_t slot = Hash(left, right) & (merge_slots_ - 1); merges_[slot].token != kInvalidToken;
+       slot = (slot + 1) & (merge_slots_ - 1))
+    if (merges_[slot].left == left && merges_[slot].right == right)
+      return merges_[slot].token;
+  return kInvalidToken;
+}
+
+
+void LLaMAVocab::WriteSnapshot(std::ostream& os, uint64_t key) const
+{
+  LLaMAVocabHeader header{};
+  header.magic = kLLaMAVocabMagic;
+  header.version = kLLaMAVocabVersion;
+  header.key = key;
+  header.vocab_size = vocab_size_;
+  header.token_slots = token_slots_;
+  header.merge_slots = merge_slots_;
+  header.max_token_length = max_token_length_;
+  header.bos_token = bos_token_;
+  header.eos_token = eos_token_;
+  header.add_bos_token = add_bos_token_;
+  header.add_eos_token = add_eos_token_;
+  header.strings_size = strings_size_;
+  header.file_size = sizeof(header) + ImageSize();
+
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  os.write(image_, ImageSize());
+}
+
+
+bool LLaMAVocab::LoadSnapshot(const std::string& path, uint64_t key)
+{
+  if (access(path.c_str(), R_OK) != 0)
+    return false;
+
+  // empty or unreadable files fail to map
+  std::shared_ptr<MMap> mmap;
+  try
+  {
+    mmap.reset(MMap::MMapFile(path));
+  }
+  catch (...)
+  {
+    return false;
+  }
+
+  const char* base = static_cast<const char*>(mmap->Address());
+  size_t file_size = mmap->Size();
+  auto* header = reinterpret_cast<const LLaMAVocabHeader*>(base);
+  if (file_size < sizeof(LLaMAVocabHeader) || header->magic != kLLaMAVocabMagic ||
+      header->version != kLLaMAVocabVersion || header->key != key || header->file_size != file_size ||
+      header->strings_size > file_size)
+    return false;
+
+  LLaMAVocab vocab;
+  vocab.vocab_size_ = header->vocab_size;
+  vocab.token_slots_ = header->token_slots;
+  vocab.merge_slots_ = header->merge_slots;
+  vocab.strings_size_ = header->strings_size;
+  if ((vocab.token_slots_ & (vocab.token_slots_ - 1)) != 0 || vocab.token_slots_ <= vocab.vocab_size_ ||
+      (vocab.merge_slots_ & (vocab.merge_slots_ - 1)) != 0 ||
+      sizeof(LLaMAVocabHeader) + vocab.ImageSize() != file_size ||
+      header->bos_token >= vocab.vocab_size_ || header->eos_token >= vocab.vocab_size_)
+    return false;
+
+  // Validate the tables, so corrupt snapshots are rebuilt instead of reading outside the image,
+  // and the probes of the hash tables always end at an empty slot.
+  vocab.Attach(base + sizeof(LLaMAVocabHeader));
+  size_t max_token_length = 0;
+  if (vocab.offsets_[0] != 0 || vocab.offsets_[vocab.vocab_size_] != vocab.strings_size_)
+    return false;
+  for (size_t i = 0; i < vocab.vocab_size_; i++)
+  {
+    if (vocab.offsets_[i] > vocab.offsets_[i + 1])
+      return false;
+    max_token_length = std::max<size_t>(max_token_length, vocab.offsets_[i + 1] - vocab.offsets_[i]);
+  }
+  if (header->max_token_length != max_token_length)
+    return false;
+
+  auto* tokens_end = vocab.tokens_ + vocab.token_slots_;
+  if (std::find(vocab.tokens_, tokens_end, 0) == tokens_end ||
+      std::any_of(vocab.tokens_, tokens_end, [&](uint32_t slot) { return slot > vocab.vocab_size_; }))
+    return false;
+
+  size_t empty_merges = 0;
+  for (size_t i = 0; i < vocab.merge_slots_; i++)
+  {
+    const LLaMAVocabMerge& merge = vocab.merges_[i];
+    if (merge.token == kInvalidToken)
+      empty_merges++;
+    else if (merge.token >= vocab.vocab_size_ || merge.left >= vocab.vocab_size_ ||
+             merge.right >= vocab.vocab_size_)
+      return false;
+  }
+  if (vocab.merge_slots_ != 0 && empty_merges == 0)
+    return false;
+
+  vocab.max_token_length_ = max_token_length;
+  vocab.bos_token_ = header->bos_token;
+  vocab.eos_token_ = header->eos_token;
+  vocab.add_bos_token_ = header->add_bos_token != 0;
+  vocab.add_eos_token_ = header->add_eos_token != 0;
+  vocab.storage_ = std::move(mmap);
+
+  *this = std::move(vocab);
+  return true;
+}
+
+} // end of namespace grid
@@ -9,28 +9,124 @@
 #ifndef _LLAMA_VOCAB_H
 #define _LLAMA_VOCAB_H
 
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+
 namespace grid {
 
+// The vocabulary is stored in a single memory image that is used in place, and written to and
+// mapped from a snapshot file without converting it:
+//
+//   LLaMAVocabHeader                                   snapshot files only
+//   float[vocab_size]                                  token scores
+//   uint32_t[vocab_size + 1]                           offsets of the tokens in the token strings
+//   uint32_t[token_slots]                              hash table of the tokens (token + 1, 0 if empty)
+//   LLaMAVocabMerge[merge_slots]                       hash table of the merges of two tokens
+//   char[strings_size]                                 token strings
+//
+// Both hash tables use open addressing with linear probing and a power-of-two number of slots.
+
+/// kLLaMAVocabMagic is the magic number of vocabulary snapshots ("GVOC").
+static constexpr uint32_t kLLaMAVocabMagic = 0x434f5647;
+
+/// kLLaMAVocabVersion is the version of the snapshot format.
+static constexpr uint32_t kLLaMAVocabVersion = 1;
+
+struct LLaMAVocabHeader
+{
+  uint32_t  magic;
+  uint32_t  version;
+  uint64_t  key;                // key of the model files (LLaMAFile::TokenizerKey)
+  uint32_t  vocab_size;
+  uint32_t  token_slots;
+  uint32_t  merge_slots;
+  uint32_t  max_token_length;
+  uint32_t  bos_token;
+  uint32_t  eos_token;
+  uint8_t   add_bos_token;
+  uint8_t   add_eos_token;
+  uint8_t   reserved[6];
+  uint64_t  strings_size;
+  uint64_t  file_size;
+};
+
+/// LLaMAVocabMerge is an entry of the merge table: the token of the concatenated texts of the
+/// left and right tokens.
+struct LLaMAVocabMerge
+{
+  uint32_t  left;
+  uint32_t  right;
+  uint32_t  token;              // kInvalidToken for empty slots
+};
+
+static_assert(sizeof(LLaMAVocabHeader) == 64 && sizeof(LLaMAVocabMerge) == 12);
+
+
 /// LLaMAVocab contains the 'vocabs' (vocabularies).
 struct LLaMAVocab
 {
-  using symbol = std::string;
   using token = uint32_t;
 
-  struct TokenScore
+  /// kInvalidToken is returned by the lookups for texts that aren't in the vocabulary.
+  static constexpr token kInvalidToken = ~token{0};
+
+  /// Build builds the vocabulary from the texts and scores of the tokens, which are copied.
+  void Build(std::span<const std::string_view> texts, std::span<const float> scores);
+
+  /// Size returns the number of tokens.
+  size_t Size() const                               { return vocab_size_; }
+
+  /// Text returns the text of the token.
+  std::string_view Text(token id) const
   {
-    symbol text;
-    float score;
-  };
-
-  // TODO: are both members requiers or can it be combined?
-  std::unordered_map<symbol, token> tokens_;
-  std::vector<TokenScore> scores_;
-  size_t max_token_length_;
-  uint32_t bos_token_;
-  uint32_t eos_token_;
-  bool add_bos_token_;
-  bool add_eos_token_;
+    return std::string_view(strings_ + offsets_[id], offsets_[id + 1] - offsets_[id]);
+  }
+
+  /// Score returns the score of the token.
+  float Score(token id) const                       { return scores_[id]; }
+
+  /// Find returns the token of the text or kInvalidToken.
+  token Find(std::string_view text) const;
+
+  /// FindMerge returns the token of the concatenated texts of the left and right tokens, or
+  /// kInvalidToken. For texts that occur more than once, it only knows the token returned by Find.
+  token FindMerge(token left, token right) const;
+
+  /// WriteSnapshot writes the vocabulary with the key of the model files to the stream.
+  void WriteSnapshot(std::ostream& os, uint64_t key) const;
+
+  /// LoadSnapshot maps the snapshot file and uses it in place. It returns false if the file
+  /// doesn't exist, was written for a different key or version, or is truncated or corrupt.
+  bool LoadSnapshot(const std::string& path, uint64_t key);
+
+  size_t    max_token_length_ = 0;
+  uint32_t  bos_token_ = 1;
+  uint32_t  eos_token_ = 2;
+  bool      add_bos_token_ = false;
+  bool      add_eos_token_ = false;
+
+ private:
+  // Attach sets the tables to the memory image at data.
+  void Attach(const char* data);
+
+  // ImageSize returns the size of the memory image.
+  size_t ImageSize() const;
+
+  std::shared_ptr<const void> storage_;     // buffer or mapped snapshot of the memory image
+  const char*             image_ = nullptr;
+  size_t                  vocab_size_ = 0;
+  size_t                  token_slots_ = 0;
+  size_t                  merge_slots_ = 0;
+  size_t                  strings_size_ = 0;
+  const float*            scores_ = nullptr;
+  const uint32_t*         offsets_ = nullptr;
+  const uint32_t*         tokens_ = nullptr;
+  const LLaMAVocabMerge*  merges_ = nullptr;
+  const char*             strings_ = nullptr;
 };
 
 } // end of namespace grid
@@ -0,0 +1,127 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef _PREFETCHER_H
+#define _PREFETCHER_H
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <grid/tensor/mmap.h>
+
+namespace grid {
+
+/// Prefetcher reads ranges of a memory-mapped file into memory on a background thread, e.g. the
+/// weights of the next layer while the current layer is computed, so the compute threads don't
+/// stall on page faults.
+///
+/// Prefetch is a hint that is dropped if the computation has moved on, and Load returns a future
+/// for waiting until the ranges are resident.
+class Prefetcher
+{
+ public:
+  /// Range is the address and size of a range in the memory-mapped file.
+  using Range = std::tuple<const void*, size_t>;
+
+ private:
+  struct Job
+  {
+    std::vector<Range>                  ranges_;
+    std::shared_ptr<std::promise<void>> loaded_;    // set when the ranges are resident (Load)
+  };
+
+ public:
+  /// Constructor
+  ///
+  /// @param mmap   Memory-mapped file.
+  explicit Prefetcher(std::shared_ptr<MMap> mmap) : mmap_(std::move(mmap))
+  {
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  ~Prefetcher()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    available_.notify_one();
+    thread_.join();
+  }
+
+  // Copy constructor and assignments are not permissible
+  Prefetcher(const Prefetcher&) = delete;
+  Prefetcher& operator=(const Prefetcher&) = delete;
+
+  /// Prefetch queues the ranges for prefetching. Prefetches of earlier calls that haven't been
+  /// started are dropped as the computation has already moved past them.
+  void Prefetch(std::span<const Range> ranges)
+  {
+    {
+      std::lock_guard lock(mutex_);
+      std::erase_if(jobs_, [](const Job& job) { return !job.loaded_; });
+      jobs_.push_back(Job{{ranges.begin(), ranges.end()}, nullptr});
+    }
+    available_.notify_one();
+  }
+
+  /// Load queues the ranges for reading and returns a future that is ready when the ranges are
+  /// resident. Loads are processed in order and never dropped.
+  std::future<void> Load(std::span<const Range> ranges)
+  {
+    auto loaded = std::make_shared<std::promise<void>>();
+    auto future = loaded->get_future();
+    {
+      std::lock_guard lock(mutex_);
+      jobs_.push_back(Job{{ranges.begin(), ranges.end()}, std::move(loaded)});
+    }
+    available_.notify_one();
+    return future;
+  }
+
+ private:
+  // Run is the main function of the prefetch thread.
+  void Run()
+  {
+    for (;;)
+    {
+      Job job;
+      {
+        std::unique_lock lock(mutex_);
+        available_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (stop_)
+          return;
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+
+      for (auto [addr, size] : job.ranges_)
+        mmap_->Prefetch(addr, size);
+      if (job.loaded_)
+        job.loaded_->set_value();
+    }
+  }
+
+  std::shared_ptr<MMap>     mmap_;
+  std::thread               thread_;
+  std::deque<Job>           jobs_;
+  std::mutex                mutex_;
+  std::condition_variable   available_;
+  bool                      stop_ = false;
+};
+
+} // end of namespace grid
+
+#endif  // _PREFETCHER_H
@@ -0,0 +1,102 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <algorithm>
+
+#include "prefix_cache.h"
+
+namespace grid {
+
+PrefixCache::Node* PrefixCache::FindChild(Node* node, std::span<const token> block) const
+{
+  for (auto& child: node->children_)
+    if (std::equal(block.begin(), block.end(), child->tokens_.begin()))
+      return child.get();
+  return nullptr;
+}
+
+
+void PrefixCache::Touch(Node* node)
+{
+  lru_.splice(lru_.begin(), lru_, node->lru_);
+}
+
+
+bool PrefixCache::Evict(const Node* keep)
+{
+  // Note that nodes are always touched after their parents, so the least recently used node
+  // without any children is also the oldest leaf.
+  for (auto it = lru_.rbegin(); it != lru_.rend(); ++it)
+  {
+    Node* node = *it;
+    if (node == keep || !node->children_.empty())
+      continue;
+
+    lru_.erase(node->lru_);
+    size_ -= block_bytes_;
+
+    auto& siblings = node->parent_->children_;
+    siblings.erase(std::find_if(siblings.begin(), siblings.end(),
+                                [node](auto& child) { return child.get() == node; }));
+    return true;
+  }
+  return false;
+}
+
+
+std::vector<const char*> PrefixCache::Find(std::span<const token> tokens)
+{
+  std::vector<const char*> blocks;
+
+  Node* node = &root_;
+  for (size_t pos = 0; pos + block_size_ <= tokens.size(); pos += block_size_)
+  {
+    node = FindChild(node, tokens.subspan(pos, block_size_));
+    if (node == nullptr)
+      break;
+
+    Touch(node);
+    blocks.push_back(node->data_.get());
+  }
+
+  return blocks;
+}
+
+
+void PrefixCache::Insert(std::span<const token> tokens,
+                         const std::function<void(size_t, char*)>& fill)
+{
+  Node* node = &root_;
+  for (size_t pos = 0; pos + block_size_ <= tokens.size(); pos += block_size_)
+  {
+    auto block = tokens.subspan(pos, block_size_);
+    Node* child = FindChild(node, block);
+
+    if (child == nullptr)
+    {
+      // all other nodes of the current path have children and are never evicted
+      while (size_ + block_bytes_ > budget_)
+        if (!Evict(node))
+          return;
+
+      auto& next = node->children_.emplace_back(new Node{node, {block.begin(), block.end()}});
+      child = next.get();
+      child->data_.reset(new char[block_bytes_]);
+      child->lru_ = lru_.insert(lru_.begin(), child);
+      size_ += block_bytes_;
+
+      fill(pos / block_size_, child->data_.get());
+    }
+    else
+      Touch(child);
+
+    node = child;
+  }
+}
+
+} // end of namespace grid
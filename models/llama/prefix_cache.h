@@ -0,0 +1,98 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef _PREFIX_CACHE_H
+#define _PREFIX_CACHE_H
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "llama_vocab.h"
+
+namespace grid {
+
+/// PrefixCache keeps the key/value rows of previously computed token sequences so that requests
+/// sharing a prefix, such as a common system prompt, only need to compute their unique suffix.
+///
+/// Sequences are split into blocks of a fixed number of tokens (32 for the LLaMA models) and
+/// indexed by a trie where each edge is labeled by the tokens of one block. Edges are never split
+/// or merged, so only prefixes of complete blocks are shared. The cache holds the key/value data
+/// of each block as an opaque buffer; the layout is defined by the model. Blocks are evicted in
+/// least-recently-used order when the memory budget is exceeded, starting from the leaves.
+class PrefixCache
+{
+  using token = LLaMAVocab::token;
+
+  struct Node
+  {
+    Node*                               parent_;
+    std::vector<token>                  tokens_;    // block tokens (edge label)
+    std::unique_ptr<char[]>             data_;      // key/value data of the block
+    std::vector<std::unique_ptr<Node>>  children_;
+    std::list<Node*>::iterator          lru_;
+  };
+
+ public:
+  /// Constructor
+  ///
+  /// @param block_size   Number of tokens per block.
+  /// @param block_bytes  Size of the key/value data of a block in bytes.
+  /// @param budget       Maximum memory used for key/value data in bytes.
+  PrefixCache(size_t block_size, size_t block_bytes, size_t budget)
+    : block_size_(block_size),
+      block_bytes_(block_bytes),
+      budget_(budget),
+      size_(0),
+      root_{nullptr}
+  {}
+
+  // Copy constructor and assignments are not permissible
+  PrefixCache(const PrefixCache&) = delete;
+  PrefixCache& operator=(const PrefixCache&) = delete;
+
+  /// Find returns the key/value data of the cached blocks for the longest cached prefix of the
+  /// provided tokens. Only complete blocks are considered.
+  std::vector<const char*> Find(std::span<const token> tokens);
+
+  /// Insert adds all complete blocks of the provided tokens that are not cached yet. The fill
+  /// function is called with the block index and a buffer of BlockBytes() to copy the key/value
+  /// data of the block.
+  void Insert(std::span<const token> tokens, const std::function<void(size_t, char*)>& fill);
+
+  /// BlockSize returns the number of tokens per block.
+  size_t BlockSize() const                                { return block_size_; }
+
+  /// Size returns the memory currently used for the cached blocks in bytes.
+  size_t Size() const                                     { return size_; }
+
+ private:
+  // FindChild returns the child node matching the tokens of the block or nullptr.
+  Node* FindChild(Node* node, std::span<const token> block) const;
+
+  // Touch moves the node to the front of the LRU list.
+  void Touch(Node* node);
+
+  // Evict removes the least recently used leaf node other than the provided node. It returns
+  // false if no node could be evicted.
+  bool Evict(const Node* keep);
+
+ private:
+  size_t            block_size_;
+  size_t            block_bytes_;
+  size_t            budget_;
+  size_t            size_;
+  Node              root_;
+  std::list<Node*>  lru_;       // most recently used nodes first
+};
+
+} // end of namespace grid
+
+#endif  // _PREFIX_CACHE_H
@@ -0,0 +1,115 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include "prefix_cache.h"
+
+#include "gtest/gtest.h"
+
+using grid::PrefixCache;
+using token = grid::LLaMAVocab::token;
+
+namespace {
+
+// Fill writes the first token of the block and the block index into the key/value data.
+std::function<void(size_t, char*)> Fill(const std::vector<token>& tokens, size_t block_size,
+                                        size_t* calls = nullptr)
+{
+  return [&tokens, block_size, calls](size_t index, char* buffer) {
+    token data[2] = {tokens[index * block_size], static_cast<token>(index)};
+    memcpy(buffer, data, sizeof(data));
+    if (calls != nullptr)
+      (*calls)++;
+  };
+}
+
+// Sequence returns count tokens starting with first.
+std::vector<token> Sequence(token first, size_t count)
+{
+  std::vector<token> tokens(count);
+  std::iota(tokens.begin(), tokens.end(), first);
+  return tokens;
+}
+
+} // end of namespace
+
+
+TEST(PrefixCache, FindInsert)
+{
+  PrefixCache cache(4, 8, 1024);
+  auto tokens = Sequence(100, 10);
+
+  // only complete blocks are inserted and found
+  size_t calls = 0;
+  cache.Insert(tokens, Fill(tokens, 4, &calls));
+  EXPECT_EQ(calls, 2);
+  EXPECT_EQ(cache.Size(), 16);
+
+  auto blocks = cache.Find(tokens);
+  ASSERT_EQ(blocks.size(), 2);
+  EXPECT_EQ(reinterpret_cast<const token*>(blocks[0])[0], 100);
+  EXPECT_EQ(reinterpret_cast<const token*>(blocks[1])[0], 104);
+  EXPECT_EQ(reinterpret_cast<const token*>(blocks[1])[1], 1);
+  EXPECT_EQ(cache.Find(std::span(tokens).first(7)).size(), 1);
+
+  // a sequence that shares the first block only adds its second block
+  auto other = tokens;
+  other[5] = 0;
+  calls = 0;
+  cache.Insert(other, Fill(other, 4, &calls));
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(cache.Size(), 24);
+  EXPECT_EQ(cache.Find(other).size(), 2);
+  EXPECT_EQ(cache.Find(Sequence(0, 8)).size(), 0);
+}
+
+TEST(PrefixCache, EvictLeastRecentlyUsed)
+{
+  // the budget holds three blocks
+  PrefixCache cache(4, 8, 24);
+  auto a = Sequence(100, 8);
+  auto b = Sequence(200, 4);
+  auto c = Sequence(300, 4);
+
+  cache.Insert(a, Fill(a, 4));
+  cache.Insert(b, Fill(b, 4));
+  EXPECT_EQ(cache.Size(), 24);
+
+  // using a makes b the least recently used leaf, which is evicted for c
+  EXPECT_EQ(cache.Find(a).size(), 2);
+  cache.Insert(c, Fill(c, 4));
+  EXPECT_EQ(cache.Size(), 24);
+  EXPECT_EQ(cache.Find(b).size(), 0);
+  EXPECT_EQ(cache.Find(a).size(), 2);
+  EXPECT_EQ(cache.Find(c).size(), 1);
+
+  // the leaf of a is evicted before its parent, which is used by the path being inserted
+  auto d = a;
+  d[4] = 0;
+  cache.Find(c);
+  cache.Insert(d, Fill(d, 4));
+  EXPECT_EQ(cache.Size(), 24);
+  EXPECT_EQ(cache.Find(d).size(), 2);
+  EXPECT_EQ(cache.Find(a).size(), 1);
+  EXPECT_EQ(cache.Find(c).size(), 1);
+}
+
+TEST(PrefixCache, Budget)
+{
+  // blocks that exceed the budget are not inserted
+  PrefixCache cache(4, 8, 4);
+  auto tokens = Sequence(0, 8);
+  size_t calls = 0;
+  cache.Insert(tokens, Fill(tokens, 4, &calls));
+  EXPECT_EQ(calls, 0);
+  EXPECT_EQ(cache.Size(), 0);
+  EXPECT_EQ(cache.Find(tokens).size(), 0);
+}
@@ -0,0 +1,170 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "llama_tokenizer.h"
+#include "llama_vocab.h"
+
+#include "gtest/gtest.h"
+
+using grid::LLaMADecoder;
+using grid::LLaMATokenizer;
+using grid::LLaMAVocab;
+using grid::ThreadPool;
+
+namespace {
+
+// MakeVocab builds a vocabulary of the control tokens, optionally the byte tokens, and the texts.
+LLaMAVocab MakeVocab(const std::vector<std::string>& texts, bool byte_tokens = true)
+{
+  std::vector<std::string> tokens{"<unk>", "<s>", "</s>"};
+  for (int i = 0; i < 256 && byte_tokens; i++)
+  {
+    char text[8];
+    snprintf(text, sizeof(text), "<0x%02X>", i);
+    tokens.push_back(text);
+  }
+  tokens.insert(tokens.end(), texts.begin(), texts.end());
+
+  std::vector<std::string_view> views(tokens.begin(), tokens.end());
+  std::vector<float> scores(tokens.size());
+  for (size_t i = 0; i < tokens.size(); i++)
+    scores[i] = static_cast<float>(tokens[i].size());
+
+  LLaMAVocab vocab;
+  vocab.Build(views, scores);
+  return vocab;
+}
+
+// Decode decodes the tokens, starting after the begin token.
+std::string Decode(const LLaMATokenizer& tokenizer, const std::vector<LLaMAVocab::token>& tokens)
+{
+  LLaMADecoder decoder(tokenizer);
+  std::string text;
+  for (size_t i = 1; i < tokens.size(); i++)
+    decoder.Decode(tokens[i - 1], tokens[i], text);
+  decoder.Flush(text);
+  return text;
+}
+
+} // end of namespace
+
+
+TEST(Tokenizer, EncodeMerges)
+{
+  LLaMAVocab vocab = MakeVocab({"▁", "h", "e", "l", "o", "he", "ll", "hell", "hello", "▁hello"});
+  vocab.add_bos_token_ = true;
+  LLaMATokenizer tokenizer(vocab);
+
+  auto tokens = tokenizer.Encode(" hello hell");
+  ASSERT_EQ(tokens.size(), 4);
+  EXPECT_EQ(tokens[0], vocab.bos_token_);
+  EXPECT_EQ(tokens[1], vocab.Find("▁hello"));
+  EXPECT_EQ(tokens[2], vocab.Find("▁"));
+  EXPECT_EQ(tokens[3], vocab.Find("hell"));
+}
+
+TEST(Tokenizer, EncodeNonAscii)
+{
+  LLaMAVocab vocab = MakeVocab({"▁", "h", "l", "o", "w", "r", "d", "ö"});
+  vocab.add_bos_token_ = true;
+  LLaMATokenizer tokenizer(vocab);
+
+  // 'é' isn't in the vocabulary and falls back to its bytes, 'ö' is
+  auto tokens = tokenizer.Encode("héllo wörld");
+  std::vector<LLaMAVocab::token> expected{
+    vocab.bos_token_, vocab.Find("h"), vocab.Find("<0xC3>"), vocab.Find("<0xA9>"), vocab.Find("l"),
+    vocab.Find("l"), vocab.Find("o"), vocab.Find("▁"), vocab.Find("w"), vocab.Find("ö"),
+    vocab.Find("r"), vocab.Find("l"), vocab.Find("d")};
+  EXPECT_EQ(tokens, expected);
+  EXPECT_EQ(Decode(tokenizer, tokens), "héllo wörld");
+
+  // incomplete and invalid sequences fall back to their bytes
+  tokens = tokenizer.Encode("\xe2\x82h\xff");
+  expected = {vocab.bos_token_, vocab.Find("<0xE2>"), vocab.Find("<0x82>"), vocab.Find("h"),
+              vocab.Find("<0xFF>")};
+  EXPECT_EQ(tokens, expected);
+
+  for (auto token : tokenizer.Encode("\U0001f600 äöü"))
+    EXPECT_LT(token, vocab.Size());
+}
+
+TEST(Tokenizer, EncodeChunks)
+{
+  LLaMAVocab vocab = MakeVocab({"▁", "h", "e", "l", "o", "w", "r", "d", "ö", "he", "ll", "hell",
+                                "hello", "▁hello", "▁w", "▁wö", "rl", "▁wörld"});
+  vocab.add_bos_token_ = true;
+  LLaMATokenizer tokenizer(vocab);
+  LLaMATokenizer parallel_tokenizer(vocab, std::make_shared<ThreadPool>(4));
+
+  std::string text;
+  while (text.size() < 3 * LLaMATokenizer::kChunkSize)
+    text += " hello wörld  héllo";
+
+  auto tokens = tokenizer.Encode(text);
+  EXPECT_EQ(parallel_tokenizer.Encode(text), tokens);
+  EXPECT_EQ(Decode(tokenizer, tokens), text);
+}
+
+TEST(Tokenizer, EncodeUnsplittable)
+{
+  // "a▁b" spans a space, so texts can't be split at spaces
+  LLaMAVocab vocab = MakeVocab({"▁", "a", "b", "▁b", "a▁b"});
+  LLaMATokenizer parallel_tokenizer(vocab, std::make_shared<ThreadPool>(4));
+
+  std::string text = "a b";
+  std::vector<LLaMAVocab::token> expected{vocab.Find("a▁b")};
+  while (text.size() < 3 * LLaMATokenizer::kChunkSize)
+  {
+    text += " a b";
+    expected.insert(expected.end(), {vocab.Find("▁"), vocab.Find("a▁b")});
+  }
+
+  EXPECT_EQ(parallel_tokenizer.Encode(text), expected);
+  EXPECT_EQ(LLaMATokenizer(vocab).Encode(text), expected);
+}
+
+TEST(Tokenizer, EncodeUnknown)
+{
+  LLaMAVocab vocab = MakeVocab({"h", "o"}, false);
+  LLaMATokenizer tokenizer(vocab);
+
+  auto tokens = tokenizer.Encode("héo");
+  std::vector<LLaMAVocab::token> expected{vocab.Find("h"), vocab.Find("<unk>"), vocab.Find("o")};
+  EXPECT_EQ(tokens, expected);
+}
+
+TEST(Tokenizer, Decode)
+{
+  LLaMAVocab vocab = MakeVocab({"▁", "h", "i", "▁hi"});
+  LLaMATokenizer tokenizer(vocab);
+
+  EXPECT_EQ(tokenizer.Decode(vocab.Find("▁hi")), " hi");
+  EXPECT_EQ(tokenizer.Decode(vocab.Find("<0x41>")), "A");
+  EXPECT_EQ(tokenizer.Decode(vocab.Find("<unk>")), "");
+  EXPECT_EQ(tokenizer.Decode(vocab.bos_token_), "");
+  EXPECT_EQ(tokenizer.Decode(vocab.eos_token_), "");
+  EXPECT_THROW(tokenizer.Decode(vocab.Size()), std::out_of_range);
+  EXPECT_THROW(tokenizer.Decode(LLaMAVocab::kInvalidToken), std::out_of_range);
+
+  // the decoder holds back the bytes of a character until it is complete
+  LLaMADecoder decoder(tokenizer);
+  std::string text;
+  decoder.Decode(vocab.Find("h"), vocab.Find("<0xC3>"), text);
+  EXPECT_EQ(text, "");
+  decoder.Decode(vocab.Find("<0xC3>"), vocab.Find("<0xA9>"), text);
+  EXPECT_EQ(text, "é");
+  decoder.Decode(vocab.Find("<0xA9>"), vocab.Find("<0xE2>"), text);
+  decoder.Flush(text);
+  EXPECT_EQ(text, "é\xe2");
+}
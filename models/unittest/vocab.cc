@@ -0,0 +1,135 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "llama_vocab.h"
+
+#include "gtest/gtest.h"
+
+using grid::LLaMAVocab;
+using grid::LLaMAVocabHeader;
+
+namespace {
+
+constexpr uint64_t kKey = 0x1234;
+
+// VocabTest writes a snapshot of a small vocabulary to a temporary file.
+class VocabTest : public testing::Test
+{
+ protected:
+  void SetUp() override
+  {
+    std::vector<std::string_view> texts{"<unk>", "<s>", "</s>", "a", "b", "ab", "abb", "bb"};
+    std::vector<float> scores{0, 0, 0, -1, -2, 2, 3, 1};
+    vocab_.Build(texts, scores);
+    vocab_.add_bos_token_ = true;
+
+    path_ = "/tmp/grid_vocab_test." + std::to_string(getpid());
+    std::ofstream ofs(path_, std::ios::binary);
+    vocab_.WriteSnapshot(ofs, kKey);
+    ofs.close();
+
+    std::ifstream ifs(path_, std::ios::binary);
+    data_.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+  }
+
+  void TearDown() override
+  {
+    remove(path_.c_str());
+  }
+
+  // Load writes the data to the snapshot file and loads it.
+  bool Load(const std::vector<char>& data, LLaMAVocab& vocab)
+  {
+    std::ofstream(path_, std::ios::binary | std::ios::trunc).write(data.data(), data.size());
+    return vocab.LoadSnapshot(path_, kKey);
+  }
+
+  // Offsets returns the offset of the token offsets table in the snapshot.
+  size_t Offsets() const                                  { return sizeof(LLaMAVocabHeader) + 4 * vocab_.Size(); }
+
+  // Tokens returns the offset of the token hash table in the snapshot.
+  size_t Tokens() const                                   { return Offsets() + 4 * (vocab_.Size() + 1); }
+
+  LLaMAVocab        vocab_;
+  std::string       path_;
+  std::vector<char> data_;
+};
+
+} // end of namespace
+
+
+TEST_F(VocabTest, SnapshotRoundTrip)
+{
+  LLaMAVocab vocab;
+  ASSERT_TRUE(vocab.LoadSnapshot(path_, kKey));
+
+  ASSERT_EQ(vocab.Size(), vocab_.Size());
+  for (LLaMAVocab::token i = 0; i < vocab.Size(); i++)
+  {
+    EXPECT_EQ(vocab.Text(i), vocab_.Text(i));
+    EXPECT_EQ(vocab.Score(i), vocab_.Score(i));
+    EXPECT_EQ(vocab.Find(vocab.Text(i)), i);
+  }
+  EXPECT_EQ(vocab.FindMerge(vocab.Find("a"), vocab.Find("b")), vocab.Find("ab"));
+  EXPECT_EQ(vocab.FindMerge(vocab.Find("ab"), vocab.Find("b")), vocab.Find("abb"));
+  EXPECT_EQ(vocab.FindMerge(vocab.Find("b"), vocab.Find("a")), LLaMAVocab::kInvalidToken);
+  EXPECT_EQ(vocab.Find("ba"), LLaMAVocab::kInvalidToken);
+  EXPECT_EQ(vocab.max_token_length_, vocab_.max_token_length_);
+  EXPECT_TRUE(vocab.add_bos_token_);
+  EXPECT_FALSE(vocab.add_eos_token_);
+
+  EXPECT_FALSE(vocab.LoadSnapshot(path_, kKey + 1));
+  EXPECT_FALSE(vocab.LoadSnapshot(path_ + ".missing", kKey));
+}
+
+TEST_F(VocabTest, SnapshotTruncated)
+{
+  LLaMAVocab vocab;
+  EXPECT_FALSE(Load({}, vocab));
+  EXPECT_FALSE(Load(std::vector<char>(data_.begin(), data_.begin() + 32), vocab));
+  EXPECT_FALSE(Load(std::vector<char>(data_.begin(), data_.end() - 1), vocab));
+  EXPECT_EQ(vocab.Size(), 0);
+}
+
+TEST_F(VocabTest, SnapshotCorrupt)
+{
+  LLaMAVocab vocab;
+  auto corrupt = [&](size_t offset, uint32_t value) {
+    std::vector<char> data = data_;
+    memcpy(data.data() + offset, &value, sizeof(value));
+    return Load(data, vocab);
+  };
+
+  // offsets that go backwards
+  EXPECT_FALSE(corrupt(Offsets() + 4 * 4, 100));
+  // token entries past the vocabulary
+  EXPECT_FALSE(corrupt(Tokens(), vocab_.Size() + 1));
+  // the begin token
+  EXPECT_FALSE(corrupt(offsetof(LLaMAVocabHeader, bos_token), vocab_.Size()));
+
+  // a token table without an empty slot
+  std::vector<char> data = data_;
+  size_t slots = reinterpret_cast<const LLaMAVocabHeader*>(data.data())->token_slots;
+  for (size_t i = 0; i < slots; i++)
+  {
+    uint32_t entry = 1;
+    memcpy(data.data() + Tokens() + 4 * i, &entry, sizeof(entry));
+  }
+  EXPECT_FALSE(Load(data, vocab));
+
+  EXPECT_TRUE(Load(data_, vocab));
+}
@@ -152,8 +152,8 @@ class Array<T, DeviceMemory<device::Base>>
   const_pointer Data() const                              { return data_; }
 
  protected:
-  size_t  size_;
-  pointer data_;
+  size_t  size_ = 0;
+  pointer data_ = nullptr;
 };
 
 
@@ -0,0 +1,139 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+// DO NOT INCLUDE THIS FILE DIRECTLY
+
+#ifndef GRID_TENSOR_BASE_ATTENTION_H
+#define GRID_TENSOR_BASE_ATTENTION_H
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+#include "../function.h"
+
+namespace grid {
+
+/// AttentionOperator implements a fused attention for rank-2 query, key, and value tensors.
+///
+/// The queries are processed in blocks of kBlockRows rows that iterate over the keys and values
+/// in blocks of kBlockCols rows, so a key/value block stays in cache for all rows of a query
+/// block. For each query row, the operator keeps the running maximum and sum of the softmax and
+/// rescales the accumulated output when the maximum changes (online softmax), so only the scores
+/// of a single block are kept at a time.
+template <> class AttentionOperator<device::Base>
+{
+  static constexpr size_t kBlockRows = 16;
+  static constexpr size_t kBlockCols = 64;
+
+ public:
+  template<std::ranges::input_range I,
+           std::ranges::output_range<std::iter_value_t<std::ranges::iterator_t<I>>> O,
+           typename TKey, typename TValue>
+  requires std::indirectly_copyable<std::ranges::iterator_t<I>, std::ranges::iterator_t<O>>
+  void operator()(I&& in, O&& out, const TKey& key, const TValue& value,
+                  bool causal, typename std::remove_cvref_t<O>::value_type scale) const
+  {
+    using value_type = std::remove_cvref_t<O>::value_type;
+
+    auto first_d = std::ranges::begin(out);
+    auto first_q = std::ranges::cbegin(in);
+
+    auto& strides_d = first_d.Strides();
+    auto& strides_q = first_q.Strides();
+    auto& strides_k = key.Strides();
+    auto& strides_v = value.Strides();
+
+    size_t n_rows = first_d.Extents()[0];
+    size_t head_size = first_d.Extents()[1];
+    size_t kv_rows = key.Dimensions()[0];
+    size_t offset = kv_rows - std::min(n_rows, kv_rows);
+
+    const value_type* q = &*first_q;
+    const value_type* k = key.Data();
+    const value_type* v = value.Data();
+    value_type* d = &*first_d;
+
+    value_type scores[kBlockCols];
+    value_type max[kBlockRows];
+    value_type sum[kBlockRows];
+
+    for (size_t row0 = 0; row0 < n_rows; row0 += kBlockRows)
+    {
+      size_t rows = std::min(kBlockRows, n_rows - row0);
+      size_t kv_end = causal ? std::min(kv_rows, offset + row0 + rows) : kv_rows;
+
+      for (size_t r = 0; r < rows; r++)
+      {
+        value_type* d_row = d + (row0 + r) * strides_d[0];
+        for (size_t i = 0; i < head_size; i++)
+          d_row[i * strides_d[1]] = value_type{0};
+        max[r] = std::numeric_limits<value_type>::lowest();
+        sum[r] = value_type{0};
+      }
+
+      for (size_t col0 = 0; col0 < kv_end; col0 += kBlockCols)
+      {
+        size_t cols = std::min(kBlockCols, kv_end - col0);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+          // number of keys in this block visible to the query row
+          size_t limit = causal ? offset + row0 + r + 1 : kv_rows;
+          size_t count = limit > col0 ? std::min(cols, limit - col0) : 0;
+          if (count == 0)
+            continue;
+
+          const value_type* q_row = q + (row0 + r) * strides_q[0];
+          value_type block_max = std::numeric_limits<value_type>::lowest();
+          for (size_t c = 0; c < count; c++)
+          {
+            const value_type* k_row = k + (col0 + c) * strides_k[0];
+            value_type dot{0};
+            for (size_t i = 0; i < head_size; i++)
+              dot += q_row[i * strides_q[1]] * k_row[i * strides_k[1]];
+            scores[c] = dot * scale;
+            block_max = std::max(block_max, scores[c]);
+          }
+
+          // rescale the accumulated output and sum if the maximum increased
+          value_type* d_row = d + (row0 + r) * strides_d[0];
+          if (block_max > max[r])
+          {
+            value_type alpha = sum[r] != value_type{0} ? exp(max[r] - block_max) : value_type{0};
+            for (size_t i = 0; i < head_size; i++)
+              d_row[i * strides_d[1]] *= alpha;
+            sum[r] *= alpha;
+            max[r] = block_max;
+          }
+
+          for (size_t c = 0; c < count; c++)
+          {
+            const value_type* v_row = v + (col0 + c) * strides_v[0];
+            value_type p = exp(scores[c] - max[r]);
+            sum[r] += p;
+            for (size_t i = 0; i < head_size; i++)
+              d_row[i * strides_d[1]] += p * v_row[i * strides_v[1]];
+          }
+        }
+      }
+
+      for (size_t r = 0; r < rows; r++)
+      {
+        value_type* d_row = d + (row0 + r) * strides_d[0];
+        value_type inverse = sum[r] != value_type{0} ? value_type{1} / sum[r] : value_type{0};
+        for (size_t i = 0; i < head_size; i++)
+          d_row[i * strides_d[1]] *= inverse;
+      }
+    }
+  }
+};
+
+} // end of namespace grid
+
+#endif  // GRID_TENSOR_BASE_ATTENTION_H
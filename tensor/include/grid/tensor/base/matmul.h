@@ -11,7 +11,10 @@
 #ifndef GRID_TENSOR_BASE_MATMUL_H
 #define GRID_TENSOR_BASE_MATMUL_H
 
+#include <vector>
+
 #include "../device.h"
+#include "quantized.h"
 
 namespace grid {
 
@@ -258,6 +261,156 @@ template <> class MatmulOperator<device::Base>
         VecDot(&*first_d, &*first_x, &*first_y, first_x.Extents()[0], strides_x[0], strides_y[0]);
     }
   }
+
+  // Quantized tensors are multiplied by rows of blocks, so only the following combinations are
+  // supported, which require that the (dense) rows of the other tensor are contiguous:
+  //   mat * vec:  W_m_k * V_k -> V_m
+  //   mat * matT: M_m_k * (W_n_k)^T -> M_m_n, e.g. X @ W^T for a batch of vectors
+  //   vec * matT: V_k * (W_n_k)^T -> V_n
+  // Matrices that are repacked into panels are multiplied by one panel of rows at a time.
+  template <QuantizedTensor TQuantized, AnyTensor TTensor, AnyTensor TOutput>
+  void operator()(const TQuantized& in1, const TTensor& in2, TOutput& out) const
+  {
+    auto& strides_w = in1.Strides();
+    auto& strides_y = in2.Strides();
+    if constexpr (TQuantized::rank == 2 && TTensor::rank == 1)
+    {
+      if (strides_w[1] != 1 || strides_y[0] != 1)
+        throw std::runtime_error("quantized matmul requires contiguous rows");
+
+      auto& dims = in1.Dimensions();
+      if (in1.PanelRows() > 1)
+      {
+        if (strides_w[0] != static_cast<ssize_t>(dims[1]))
+          throw std::runtime_error("quantized matmul requires dense panels");
+        QuantizedPanelMatVec(out.Data(), in1.Data(), in2.Data(), dims[0], dims[1], in1.PanelRows(),
+                             out.Strides()[0]);
+      }
+      else
+        QuantizedMatVec(out.Data(), in1.Data(), in2.Data(), dims[0], dims[1], strides_w[0], out.Strides()[0]);
+    }
+    else
+      throw std::runtime_error("unsupported quantized matrix multiplication");
+  }
+
+  template <AnyTensor TTensor, QuantizedTensor TQuantized, AnyTensor TOutput>
+  void operator()(const TTensor& in1, const TQuantized& in2, TOutput& out) const
+  {
+    auto& strides_x = in1.Strides();
+    auto& strides_w = in2.Strides();
+    auto& dims = in2.Dimensions();
+    if (strides_w[0] != 1 || strides_x[TTensor::rank - 1] != 1)
+      throw std::runtime_error("quantized matmul requires contiguous rows");
+
+    size_t panel_rows = in2.PanelRows();
+    if (panel_rows > 1 && strides_w[1] != static_cast<ssize_t>(dims[0]))
+      throw std::runtime_error("quantized matmul requires dense panels");
+
+    if constexpr (TTensor::rank == 1 && TQuantized::rank == 2)
+    {
+      if (panel_rows > 1)
+        QuantizedPanelMatVec(out.Data(), in2.Data(), in1.Data(), dims[1], dims[0], panel_rows, out.Strides()[0]);
+      else
+        QuantizedMatVec(out.Data(), in2.Data(), in1.Data(), dims[1], dims[0], strides_w[1], out.Strides()[0]);
+    }
+    else if constexpr (TTensor::rank == 2 && TQuantized::rank == 2)
+    {
+      auto& strides_d = out.Strides();
+      if (strides_d[1] != 1)
+        throw std::runtime_error("quantized matmul requires contiguous rows");
+
+      // iterate over the weight rows in the outer loop, so each row is read once for the batch.
+      size_t dim_m = in1.Dimensions()[0];
+      size_t blocks = dims[0] / TQuantized::block_type::kQuants;
+      if constexpr (std::is_same_v<typename TQuantized::block_type, BlockQ8_0>)
+      {
+        if (dim_m > 1)
+          return QuantizedMatmulInt8(out.Data(), in1.Data(), in2.Data(), dim_m, dims[1], blocks,
+                                     strides_x[0], strides_w[1], strides_d[0], panel_rows);
+      }
+      if (panel_rows > 1)
+        return QuantizedPanelMatmul(out.Data(), in1.Data(), in2.Data(), dim_m, dims[1], blocks, panel_rows,
+                                    strides_x[0], strides_d[0]);
+
+      for (size_t n = 0; n < dims[1]; n++)
+      {
+        auto* w = in2.Data() + n * strides_w[1] / TQuantized::block_type::kQuants;
+        for (size_t m = 0; m < dim_m; m++)
+          out.Data()[m * strides_d[0] + n] = details::QuantizedDot(w, in1.Data() + m * strides_x[0], blocks);
+      }
+    }
+    else
+      throw std::runtime_error("unsupported quantized matrix multiplication");
+  }
+
+ private:
+  // mat x vec multiplication of a quantized matrix; strides of the matrix rows are in values.
+  template <QuantizedBlock TBlock>
+  inline void QuantizedMatVec(float* d, const TBlock* x, const float* y,
+                              size_t dim_m, size_t dim_n, ssize_t strides_x, ssize_t strides_d) const
+  {
+    size_t blocks = dim_n / TBlock::kQuants;
+    for (size_t m = 0; m < dim_m; m++)
+      d[m * strides_d] = details::QuantizedDot(x + m * strides_x / TBlock::kQuants, y, blocks);
+  }
+
+  // mat x vec multiplication of a quantized matrix that is repacked into panels.
+  template <QuantizedBlock TBlock>
+  inline void QuantizedPanelMatVec(float* d, const TBlock* x, const float* y,
+                                   size_t dim_m, size_t dim_n, size_t panel_rows, ssize_t strides_d) const
+  {
+    size_t blocks = dim_n / TBlock::kQuants;
+    float sums[kQuantizedPanelRows];
+    for (size_t m = 0; m < dim_m; m += panel_rows)
+    {
+      size_t rows = std::min(panel_rows, dim_m - m);
+      details::QuantizedPanelDot(x + m * blocks, y, blocks, rows, sums);
+      for (size_t r = 0; r < rows; r++)
+        d[(m + r) * strides_d] = sums[r];
+    }
+  }
+
+  // mat x matT multiplication of a batch of vectors (floats or Q8_0 blocks) and a quantized matrix
+  // that is repacked into panels; each panel is multiplied by all vectors while it is cached.
+  template <typename TVector, QuantizedBlock TBlock>
+  inline void QuantizedPanelMatmul(float* d, const TVector* x, const TBlock* w,
+                                   size_t dim_m, size_t dim_n, size_t blocks, size_t panel_rows,
+                                   ssize_t strides_x, ssize_t strides_d) const
+  {
+    float sums[kQuantizedPanelRows];
+    for (size_t n = 0; n < dim_n; n += panel_rows)
+    {
+      size_t rows = std::min(panel_rows, dim_n - n);
+      for (size_t m = 0; m < dim_m; m++)
+      {
+        details::QuantizedPanelDot(w + n * blocks, x + m * strides_x, blocks, rows, sums);
+        std::copy_n(sums, rows, d + m * strides_d + n);
+      }
+    }
+  }
+
+  // mat x matT multiplication of Q8_0 weights and a batch of vectors (W8A8). The vectors are
+  // quantized to Q8_0 blocks once, so the products of each block are summed as integers.
+  inline void QuantizedMatmulInt8(float* d, const float* x, const BlockQ8_0* w,
+                                  size_t dim_m, size_t dim_n, size_t blocks,
+                                  ssize_t strides_x, ssize_t strides_w, ssize_t strides_d,
+                                  size_t panel_rows) const
+  {
+    std::vector<BlockQ8_0> quantized(dim_m * blocks);
+    for (size_t m = 0; m < dim_m; m++)
+      details::QuantizeRow(x + m * strides_x, quantized.data() + m * blocks, blocks);
+
+    if (panel_rows > 1)
+      return QuantizedPanelMatmul(d, quantized.data(), w, dim_m, dim_n, blocks, panel_rows,
+                                  static_cast<ssize_t>(blocks), strides_d);
+
+    for (size_t n = 0; n < dim_n; n++)
+    {
+      const BlockQ8_0* row = w + n * strides_w / BlockQ8_0::kQuants;
+      for (size_t m = 0; m < dim_m; m++)
+        d[m * strides_d + n] = details::QuantizedDot(row, quantized.data() + m * blocks, blocks);
+    }
+  }
 };
 
 } // end of namespace grid
@@ -0,0 +1,616 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+// DO NOT INCLUDE THIS FILE DIRECTLY
+
+#ifndef GRID_TENSOR_BASE_QUANTIZED_H
+#define GRID_TENSOR_BASE_QUANTIZED_H
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define GRID_QUANTIZED_AVX2 1
+#endif
+
+#include "../quantized.h"
+
+namespace grid {
+namespace details {
+
+// The dot products of a row of quantized blocks and a float vector dequantize the blocks in
+// registers, so the weights are read in their compressed form only. The AVX2 kernels are
+// selected at runtime, which doesn't require to build for a specific architecture.
+
+// Portable kernels; the sum of each block is scaled once.
+template <QuantizedBlock TBlock>
+inline float QuantizedDotGeneric(const TBlock* x, const float* y, size_t blocks)
+{
+  float values[TBlock::kQuants];
+  float sum = 0.0f;
+  for (size_t b = 0; b < blocks; b++, y += TBlock::kQuants)
+  {
+    Dequantize(x[b], values);
+    for (size_t i = 0; i < TBlock::kQuants; i++)
+      sum += values[i] * y[i];
+  }
+  return sum;
+}
+
+inline float QuantizedDotGeneric(const BlockQ8_0* x, const float* y, size_t blocks)
+{
+  float sum = 0.0f;
+  for (size_t b = 0; b < blocks; b++, y += BlockQ8_0::kQuants)
+  {
+    float block_sum = 0.0f;
+    for (size_t i = 0; i < BlockQ8_0::kQuants; i++)
+      block_sum += x[b].qs[i] * y[i];
+    sum += block_sum * x[b].delta;
+  }
+  return sum;
+}
+
+inline float QuantizedDotGeneric(const BlockQ4_0* x, const float* y, size_t blocks)
+{
+  constexpr size_t half = BlockQ4_0::kQuants / 2;
+  float sum = 0.0f;
+  for (size_t b = 0; b < blocks; b++, y += BlockQ4_0::kQuants)
+  {
+    float block_sum = 0.0f;
+    for (size_t i = 0; i < half; i++)
+      block_sum += ((x[b].qs[i] & 0x0f) - 8) * y[i] + ((x[b].qs[i] >> 4) - 8) * y[i + half];
+    sum += block_sum * x[b].delta;
+  }
+  return sum;
+}
+
+// Half-precision values are converted in groups, which the compiler can vectorize.
+template <typename THalf>
+inline float HalfDotGeneric(const THalf* x, const float* y, size_t count)
+{
+  constexpr size_t group = 16;
+  float values[group];
+  float sum = 0.0f;
+  size_t i = 0;
+  for (; i + group <= count; i += group)
+  {
+    for (size_t j = 0; j < group; j++)
+      values[j] = THalf::ToFloat(x[i + j].bits_);
+    for (size_t j = 0; j < group; j++)
+      sum += values[j] * y[i + j];
+  }
+  for (; i < count; i++)
+    sum += static_cast<float>(x[i]) * y[i];
+  return sum;
+}
+
+inline float QuantizedDotGeneric(const float16_t* x, const float* y, size_t count)
+{
+  return HalfDotGeneric(x, y, count);
+}
+
+inline float QuantizedDotGeneric(const bfloat16_t* x, const float* y, size_t count)
+{
+  return HalfDotGeneric(x, y, count);
+}
+
+// Integer kernels for Q8_0 weights and activations that are quantized to Q8_0 blocks on the fly
+// (W8A8); the products of each block are summed as integers and scaled once.
+inline float QuantizedDotGeneric(const BlockQ8_0* x, const BlockQ8_0* y, size_t blocks)
+{
+  float sum = 0.0f;
+  for (size_t b = 0; b < blocks; b++)
+  {
+    int32_t block_sum = 0;
+    for (size_t i = 0; i < BlockQ8_0::kQuants; i++)
+      block_sum += x[b].qs[i] * y[b].qs[i];
+    sum += static_cast<float>(block_sum) * x[b].delta * y[b].delta;
+  }
+  return sum;
+}
+
+inline void QuantizeRowGeneric(const float* x, BlockQ8_0* y, size_t blocks)
+{
+  for (size_t b = 0; b < blocks; b++)
+    Quantize(x + b * BlockQ8_0::kQuants, y[b]);
+}
+
+// Panel kernels compute the dot products of the rows of a panel (see PanelOffset) and a vector,
+// which is read once for all rows; the sums match the kernels for a single row.
+template <QuantizedBlock TBlock>
+inline void QuantizedPanelDotGeneric(const TBlock* x, const float* y, size_t blocks, size_t rows, float* d)
+{
+  std::fill_n(d, rows, 0.0f);
+  for (size_t b = 0; b < blocks; b++, x += rows, y += TBlock::kQuants)
+    for (size_t r = 0; r < rows; r++)
+      d[r] += QuantizedDotGeneric(x + r, y, 1);
+}
+
+inline void QuantizedPanelDotGeneric(const BlockQ8_0* x, const BlockQ8_0* y, size_t blocks, size_t rows, float* d)
+{
+  std::fill_n(d, rows, 0.0f);
+  for (size_t b = 0; b < blocks; b++, x += rows, y++)
+    for (size_t r = 0; r < rows; r++)
+      d[r] += QuantizedDotGeneric(x + r, y, 1);
+}
+
+#if defined(GRID_QUANTIZED_AVX2)
+
+// HasAvx2 returns true if the cpu supports the AVX2, FMA, and F16C instructions.
+inline bool HasAvx2()
+{
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+  return true;
+#else
+  static const bool avx2 =
+    __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+  return avx2;
+#endif
+}
+
+// HorizontalSum returns the sum of the 8 floats of the vector.
+[[gnu::target("avx2,fma")]] inline float HorizontalSum(__m256 v)
+{
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+// MulAdd8 multiplies 8 signed bytes with 8 floats and adds the products to the accumulator.
+[[gnu::target("avx2,fma")]] inline __m256 MulAdd8(__m128i q, __m256 y, __m256 acc)
+{
+  __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q));
+  return _mm256_fmadd_ps(x, y, acc);
+}
+
+[[gnu::target("avx2,fma")]] inline __m256 MulAdd8(__m128i q, const float* y, __m256 acc)
+{
+  return MulAdd8(q, _mm256_loadu_ps(y), acc);
+}
+
+[[gnu::target("avx2,fma")]] inline float QuantizedDotAvx2(const BlockQ8_0* x, const float* y, size_t blocks)
+{
+  __m256 sum = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++, y += BlockQ8_0::kQuants)
+  {
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x[b].qs));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x[b].qs + 16));
+
+    __m256 block_sum = _mm256_setzero_ps();
+    block_sum = MulAdd8(lo, y, block_sum);
+    block_sum = MulAdd8(_mm_unpackhi_epi64(lo, lo), y + 8, block_sum);
+    block_sum = MulAdd8(hi, y + 16, block_sum);
+    block_sum = MulAdd8(_mm_unpackhi_epi64(hi, hi), y + 24, block_sum);
+
+    sum = _mm256_fmadd_ps(_mm256_set1_ps(x[b].delta), block_sum, sum);
+  }
+  return HorizontalSum(sum);
+}
+
+[[gnu::target("avx2,fma")]] inline float QuantizedDotAvx2(const BlockQ4_0* x, const float* y, size_t blocks)
+{
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i offset = _mm_set1_epi8(8);
+
+  __m256 sum = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++, y += BlockQ4_0::kQuants)
+  {
+    __m128i qs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x[b].qs));
+    __m128i lo = _mm_sub_epi8(_mm_and_si128(qs, mask), offset);
+    __m128i hi = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(qs, 4), mask), offset);
+
+    __m256 block_sum = _mm256_setzero_ps();
+    block_sum = MulAdd8(lo, y, block_sum);
+    block_sum = MulAdd8(_mm_unpackhi_epi64(lo, lo), y + 8, block_sum);
+    block_sum = MulAdd8(hi, y + 16, block_sum);
+    block_sum = MulAdd8(_mm_unpackhi_epi64(hi, hi), y + 24, block_sum);
+
+    sum = _mm256_fmadd_ps(_mm256_set1_ps(x[b].delta), block_sum, sum);
+  }
+  return HorizontalSum(sum);
+}
+
+// Dot32 returns the products of 32 signed bytes with 32 floats summed to 8 lanes.
+[[gnu::target("avx2,fma")]] inline __m256 Dot32(__m256i q, const float* y)
+{
+  __m128i lo = _mm256_castsi256_si128(q);
+  __m128i hi = _mm256_extracti128_si256(q, 1);
+  __m256 sum = MulAdd8(lo, y, _mm256_setzero_ps());
+  sum = MulAdd8(_mm_unpackhi_epi64(lo, lo), y + 8, sum);
+  sum = MulAdd8(hi, y + 16, sum);
+  return MulAdd8(_mm_unpackhi_epi64(hi, hi), y + 24, sum);
+}
+
+// Dot16 returns the products of 16 signed bytes with 16 floats summed to 8 lanes.
+[[gnu::target("avx2,fma")]] inline __m256 Dot16(__m128i q, const float* y)
+{
+  return MulAdd8(_mm_unpackhi_epi64(q, q), y + 8, MulAdd8(q, y, _mm256_setzero_ps()));
+}
+
+// Sum32 returns the sum of 32 floats summed to 8 lanes.
+[[gnu::target("avx2,fma")]] inline __m256 Sum32(const float* y)
+{
+  return _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(y), _mm256_loadu_ps(y + 8)),
+                       _mm256_add_ps(_mm256_loadu_ps(y + 16), _mm256_loadu_ps(y + 24)));
+}
+
+// The minimums of the Q4_K and Q5_K sub-blocks are applied to the sum of the float values:
+//   sum(delta * scale * q[i] * y[i] - min * m * y[i]) = delta * scale * sum(q[i] * y[i]) - min * m * sum(y[i])
+
+[[gnu::target("avx2,fma")]] inline float QuantizedDotAvx2(const BlockQ4_K* x, const float* y, size_t blocks)
+{
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+
+  __m256 sum = _mm256_setzero_ps();
+  __m256 sum_mins = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++)
+  {
+    float delta = x[b].delta;
+    float min = x[b].min;
+    for (size_t j = 0; j < 8; j += 2, y += 64)
+    {
+      auto [scale_lo, min_lo] = UnpackScaleMin(j, x[b].scales);
+      auto [scale_hi, min_hi] = UnpackScaleMin(j + 1, x[b].scales);
+
+      __m256i qs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs + j * 16));
+      __m256i lo = _mm256_and_si256(qs, mask);
+      __m256i hi = _mm256_and_si256(_mm256_srli_epi16(qs, 4), mask);
+
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(delta * scale_lo), Dot32(lo, y), sum);
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(delta * scale_hi), Dot32(hi, y + 32), sum);
+      sum_mins = _mm256_fmadd_ps(_mm256_set1_ps(min * min_lo), Sum32(y), sum_mins);
+      sum_mins = _mm256_fmadd_ps(_mm256_set1_ps(min * min_hi), Sum32(y + 32), sum_mins);
+    }
+  }
+  return HorizontalSum(_mm256_sub_ps(sum, sum_mins));
+}
+
+[[gnu::target("avx2,fma")]] inline float QuantizedDotAvx2(const BlockQ5_K* x, const float* y, size_t blocks)
+{
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  const __m256i one = _mm256_set1_epi8(1);
+
+  __m256 sum = _mm256_setzero_ps();
+  __m256 sum_mins = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++)
+  {
+    float delta = x[b].delta;
+    float min = x[b].min;
+    __m256i qh = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qh));
+    for (size_t j = 0; j < 8; j += 2, y += 64)
+    {
+      auto [scale_lo, min_lo] = UnpackScaleMin(j, x[b].scales);
+      auto [scale_hi, min_hi] = UnpackScaleMin(j + 1, x[b].scales);
+
+      // bit j (j + 1) of qh is the 5th bit of the lower (upper) nibbles
+      __m256i qs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs + j * 16));
+      __m256i bits_lo = _mm256_and_si256(_mm256_srl_epi16(qh, _mm_cvtsi32_si128(j)), one);
+      __m256i bits_hi = _mm256_and_si256(_mm256_srl_epi16(qh, _mm_cvtsi32_si128(j + 1)), one);
+      __m256i lo = _mm256_or_si256(_mm256_and_si256(qs, mask), _mm256_slli_epi16(bits_lo, 4));
+      __m256i hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(qs, 4), mask), _mm256_slli_epi16(bits_hi, 4));
+
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(delta * scale_lo), Dot32(lo, y), sum);
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(delta * scale_hi), Dot32(hi, y + 32), sum);
+      sum_mins = _mm256_fmadd_ps(_mm256_set1_ps(min * min_lo), Sum32(y), sum_mins);
+      sum_mins = _mm256_fmadd_ps(_mm256_set1_ps(min * min_hi), Sum32(y + 32), sum_mins);
+    }
+  }
+  return HorizontalSum(_mm256_sub_ps(sum, sum_mins));
+}
+
+[[gnu::target("avx2,fma")]] inline float QuantizedDotAvx2(const BlockQ6_K* x, const float* y, size_t blocks)
+{
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  const __m256i mask_hi = _mm256_set1_epi8(0x30);
+  const __m256i offset = _mm256_set1_epi8(32);
+
+  __m256 sum = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++)
+  {
+    float delta = x[b].delta;
+    for (size_t n = 0; n < 2; n++, y += 128)
+    {
+      const uint8_t* ql = x[b].ql + n * 64;
+      const int8_t* scales = x[b].scales + n * 8;
+      __m256i qh = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qh + n * 32));
+      __m256i ql0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ql));
+      __m256i ql1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ql + 32));
+
+      // 4 groups of 32 values each with the lower 4 bits from ql and the upper 2 bits from qh
+      __m256i q[4] = {
+        _mm256_or_si256(_mm256_and_si256(ql0, mask), _mm256_and_si256(_mm256_slli_epi16(qh, 4), mask_hi)),
+        _mm256_or_si256(_mm256_and_si256(ql1, mask), _mm256_and_si256(_mm256_slli_epi16(qh, 2), mask_hi)),
+        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql0, 4), mask), _mm256_and_si256(qh, mask_hi)),
+        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql1, 4), mask), _mm256_and_si256(_mm256_srli_epi16(qh, 2), mask_hi)),
+      };
+
+      // each group has two sub-blocks of 16 values with their own scales
+      for (size_t g = 0; g < 4; g++)
+      {
+        __m256i values = _mm256_sub_epi8(q[g], offset);
+        sum = _mm256_fmadd_ps(_mm256_set1_ps(delta * scales[2 * g]),
+                              Dot16(_mm256_castsi256_si128(values), y + g * 32), sum);
+        sum = _mm256_fmadd_ps(_mm256_set1_ps(delta * scales[2 * g + 1]),
+                              Dot16(_mm256_extracti128_si256(values, 1), y + g * 32 + 16), sum);
+      }
+    }
+  }
+  return HorizontalSum(sum);
+}
+
+// The half-precision kernels convert 8 values at a time; F16C for float16 and a shift for bfloat16.
+
+[[gnu::target("avx2,fma,f16c")]] inline __m256 LoadHalf(const float16_t* x)
+{
+  return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)));
+}
+
+[[gnu::target("avx2,fma")]] inline __m256 LoadHalf(const bfloat16_t* x)
+{
+  __m256i bits = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16));
+}
+
+template <typename THalf>
+[[gnu::target("avx2,fma,f16c")]] inline float HalfDotAvx2(const THalf* x, const float* y, size_t count)
+{
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    sum0 = _mm256_fmadd_ps(LoadHalf(x + i), _mm256_loadu_ps(y + i), sum0);
+    sum1 = _mm256_fmadd_ps(LoadHalf(x + i + 8), _mm256_loadu_ps(y + i + 8), sum1);
+  }
+  if (i + 8 <= count)
+  {
+    sum0 = _mm256_fmadd_ps(LoadHalf(x + i), _mm256_loadu_ps(y + i), sum0);
+    i += 8;
+  }
+
+  float sum = HorizontalSum(_mm256_add_ps(sum0, sum1));
+  for (; i < count; i++)
+    sum += static_cast<float>(x[i]) * y[i];
+  return sum;
+}
+
+inline float QuantizedDotAvx2(const float16_t* x, const float* y, size_t count)
+{
+  return HalfDotAvx2(x, y, count);
+}
+
+inline float QuantizedDotAvx2(const bfloat16_t* x, const float* y, size_t count)
+{
+  return HalfDotAvx2(x, y, count);
+}
+
+// HasVnni returns true if the cpu supports the AVX-512 VNNI instructions for 256-bit vectors.
+inline bool HasVnni()
+{
+  static const bool vnni = __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl");
+  return vnni;
+}
+
+// maddubs multiplies unsigned and signed bytes, so the sign of x is moved to y: x * y = |x| * (y * sign(x))
+[[gnu::target("avx2,fma")]] inline float QuantizedDotAvx2(const BlockQ8_0* x, const BlockQ8_0* y, size_t blocks)
+{
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  __m256 sum = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++)
+  {
+    __m256i qx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs));
+    __m256i qy = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y[b].qs));
+    __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(qx, qx), _mm256_sign_epi8(qy, qx));
+    __m256 block_sum = _mm256_cvtepi32_ps(_mm256_madd_epi16(products, ones));
+    sum = _mm256_fmadd_ps(_mm256_set1_ps(x[b].delta * y[b].delta), block_sum, sum);
+  }
+  return HorizontalSum(sum);
+}
+
+[[gnu::target("avx2,fma,avx512vnni,avx512vl")]]
+inline float QuantizedDotVnni(const BlockQ8_0* x, const BlockQ8_0* y, size_t blocks)
+{
+  __m256 sum = _mm256_setzero_ps();
+  for (size_t b = 0; b < blocks; b++)
+  {
+    __m256i qx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[b].qs));
+    __m256i qy = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y[b].qs));
+    __m256i products = _mm256_dpbusd_epi32(_mm256_setzero_si256(), _mm256_sign_epi8(qx, qx), _mm256_sign_epi8(qy, qx));
+    sum = _mm256_fmadd_ps(_mm256_set1_ps(x[b].delta * y[b].delta), _mm256_cvtepi32_ps(products), sum);
+  }
+  return HorizontalSum(sum);
+}
+
+// QuantizeRowAvx2 rounds to the nearest even value, unlike Quantize, which rounds ties away from zero.
+[[gnu::target("avx2,fma")]] inline void QuantizeRowAvx2(const float* x, BlockQ8_0* y, size_t blocks)
+{
+  const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+  const __m256i permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  for (size_t b = 0; b < blocks; b++, x += BlockQ8_0::kQuants)
+  {
+    __m256 v[4];
+    __m256 max = _mm256_setzero_ps();
+    for (size_t i = 0; i < 4; i++)
+    {
+      v[i] = _mm256_loadu_ps(x + i * 8);
+      max = _mm256_max_ps(max, _mm256_andnot_ps(sign_mask, v[i]));
+    }
+    __m128 max4 = _mm_max_ps(_mm256_castps256_ps128(max), _mm256_extractf128_ps(max, 1));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+    float amax = _mm_cvtss_f32(max4);
+
+    float delta = amax / 127.0f;
+    y[b].delta = float16_t(delta);
+    __m256 inverse = _mm256_set1_ps(delta != 0.0f ? 1.0f / delta : 0.0f);
+
+    __m256i q[4];
+    for (size_t i = 0; i < 4; i++)
+      q[i] = _mm256_cvtps_epi32(_mm256_round_ps(_mm256_mul_ps(v[i], inverse),
+                                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+
+    // packs interleaves the 128-bit lanes, which the permutation restores
+    __m256i q16_lo = _mm256_packs_epi32(q[0], q[1]);
+    __m256i q16_hi = _mm256_packs_epi32(q[2], q[3]);
+    __m256i q8 = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(q16_lo, q16_hi), permute);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(y[b].qs), q8);
+  }
+}
+
+// The panel kernels keep the sums of all rows in registers and load each block of the vector once.
+
+[[gnu::target("avx2,fma")]]
+inline void QuantizedPanelDotAvx2(const BlockQ8_0* x, const float* y, size_t blocks, float* d)
+{
+  __m256 sum[kQuantizedPanelRows];
+  for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    sum[r] = _mm256_setzero_ps();
+
+  for (size_t b = 0; b < blocks; b++, x += kQuantizedPanelRows, y += BlockQ8_0::kQuants)
+  {
+    __m256 y0 = _mm256_loadu_ps(y);
+    __m256 y1 = _mm256_loadu_ps(y + 8);
+    __m256 y2 = _mm256_loadu_ps(y + 16);
+    __m256 y3 = _mm256_loadu_ps(y + 24);
+    for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    {
+      __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x[r].qs));
+      __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x[r].qs + 16));
+
+      __m256 block_sum = MulAdd8(lo, y0, _mm256_setzero_ps());
+      block_sum = MulAdd8(_mm_unpackhi_epi64(lo, lo), y1, block_sum);
+      block_sum = MulAdd8(hi, y2, block_sum);
+      block_sum = MulAdd8(_mm_unpackhi_epi64(hi, hi), y3, block_sum);
+
+      sum[r] = _mm256_fmadd_ps(_mm256_set1_ps(x[r].delta), block_sum, sum[r]);
+    }
+  }
+
+  for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    d[r] = HorizontalSum(sum[r]);
+}
+
+[[gnu::target("avx2,fma")]]
+inline void QuantizedPanelDotAvx2(const BlockQ4_0* x, const float* y, size_t blocks, float* d)
+{
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i offset = _mm_set1_epi8(8);
+
+  __m256 sum[kQuantizedPanelRows];
+  for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    sum[r] = _mm256_setzero_ps();
+
+  for (size_t b = 0; b < blocks; b++, x += kQuantizedPanelRows, y += BlockQ4_0::kQuants)
+  {
+    __m256 y0 = _mm256_loadu_ps(y);
+    __m256 y1 = _mm256_loadu_ps(y + 8);
+    __m256 y2 = _mm256_loadu_ps(y + 16);
+    __m256 y3 = _mm256_loadu_ps(y + 24);
+    for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    {
+      __m128i qs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x[r].qs));
+      __m128i lo = _mm_sub_epi8(_mm_and_si128(qs, mask), offset);
+      __m128i hi = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(qs, 4), mask), offset);
+
+      __m256 block_sum = MulAdd8(lo, y0, _mm256_setzero_ps());
+      block_sum = MulAdd8(_mm_unpackhi_epi64(lo, lo), y1, block_sum);
+      block_sum = MulAdd8(hi, y2, block_sum);
+      block_sum = MulAdd8(_mm_unpackhi_epi64(hi, hi), y3, block_sum);
+
+      sum[r] = _mm256_fmadd_ps(_mm256_set1_ps(x[r].delta), block_sum, sum[r]);
+    }
+  }
+
+  for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    d[r] = HorizontalSum(sum[r]);
+}
+
+[[gnu::target("avx2,fma")]]
+inline void QuantizedPanelDotAvx2(const BlockQ8_0* x, const BlockQ8_0* y, size_t blocks, float* d)
+{
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  __m256 sum[kQuantizedPanelRows];
+  for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    sum[r] = _mm256_setzero_ps();
+
+  for (size_t b = 0; b < blocks; b++, x += kQuantizedPanelRows)
+  {
+    __m256i qy = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y[b].qs));
+    float delta = y[b].delta;
+    for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    {
+      __m256i qx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x[r].qs));
+      __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(qx, qx), _mm256_sign_epi8(qy, qx));
+      __m256 block_sum = _mm256_cvtepi32_ps(_mm256_madd_epi16(products, ones));
+      sum[r] = _mm256_fmadd_ps(_mm256_set1_ps(x[r].delta * delta), block_sum, sum[r]);
+    }
+  }
+
+  for (size_t r = 0; r < kQuantizedPanelRows; r++)
+    d[r] = HorizontalSum(sum[r]);
+}
+
+#endif  // GRID_QUANTIZED_AVX2
+
+/// QuantizedDot returns the dot product of a row of quantized blocks and a contiguous vector.
+template <QuantizedBlock TBlock>
+inline float QuantizedDot(const TBlock* x, const float* y, size_t blocks)
+{
+#if defined(GRID_QUANTIZED_AVX2)
+  if (HasAvx2())
+    return QuantizedDotAvx2(x, y, blocks);
+#endif
+  return QuantizedDotGeneric(x, y, blocks);
+}
+
+/// QuantizedDot returns the dot product of two rows of Q8_0 blocks.
+inline float QuantizedDot(const BlockQ8_0* x, const BlockQ8_0* y, size_t blocks)
+{
+#if defined(GRID_QUANTIZED_AVX2)
+  if (HasVnni())
+    return QuantizedDotVnni(x, y, blocks);
+  if (HasAvx2())
+    return QuantizedDotAvx2(x, y, blocks);
+#endif
+  return QuantizedDotGeneric(x, y, blocks);
+}
+
+/// QuantizedPanelDot computes the dot products of the rows of a panel and a contiguous vector of
+/// floats or Q8_0 blocks, and writes them to d {rows}.
+template <QuantizedBlock TBlock, typename TVector>
+inline void QuantizedPanelDot(const TBlock* x, const TVector* y, size_t blocks, size_t rows, float* d)
+{
+#if defined(GRID_QUANTIZED_AVX2)
+  if constexpr (requires { QuantizedPanelDotAvx2(x, y, blocks, d); })
+  {
+    if (rows == kQuantizedPanelRows && HasAvx2())
+      return QuantizedPanelDotAvx2(x, y, blocks, d);
+  }
+#endif
+  QuantizedPanelDotGeneric(x, y, blocks, rows, d);
+}
+
+/// QuantizeRow quantizes a contiguous row of floats to Q8_0 blocks.
+inline void QuantizeRow(const float* x, BlockQ8_0* y, size_t blocks)
+{
+#if defined(GRID_QUANTIZED_AVX2)
+  if (HasAvx2())
+    return QuantizeRowAvx2(x, y, blocks);
+#endif
+  QuantizeRowGeneric(x, y, blocks);
+}
+
+} // end of namespace details
+} // end of namespace grid
+
+#endif  // GRID_TENSOR_BASE_QUANTIZED_H
@@ -156,8 +156,8 @@ class Array<T, DeviceMemory<device::Cuda>>
   const_pointer Data() const                              { return data_; }
 
  protected:
-  size_t  size_;
-  pointer data_;
+  size_t  size_ = 0;
+  pointer data_ = nullptr;
 };
 
 
@@ -0,0 +1,126 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef GRID_TENSOR_FLOAT16_H
+#define GRID_TENSOR_FLOAT16_H
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace grid {
+
+/// float16_t is an IEEE 754 half-precision (binary16) floating-point value.
+///
+/// Values are stored as raw bits and converted to and from float, using the F16C instructions
+/// if available. Note that the conversion from float is explicit to avoid ambiguous arithmetic.
+struct float16_t
+{
+  /// Number of values, so half-precision weights can be used like quantized blocks.
+  static constexpr size_t kQuants = 1;
+
+  float16_t() = default;
+  explicit float16_t(float value) : bits_(FromFloat(value)) {}
+
+  operator float() const                                  { return ToFloat(bits_); }
+
+  /// FromFloat converts a float to the half-precision bits rounding to the nearest even value.
+  static uint16_t FromFloat(float value)
+  {
+#if defined(__F16C__)
+    return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+    constexpr uint32_t f32_infinity = 255 << 23;
+    constexpr uint32_t f16_max = (127 + 16) << 23;
+    constexpr uint32_t denorm_magic = ((127 - 15) + (23 - 10) + 1) << 23;
+
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+
+    uint16_t result;
+    if (bits >= f16_max)                // overflow, infinity, or NaN
+      result = bits > f32_infinity ? 0x7e00 : 0x7c00;
+    else if (bits < (113 << 23))        // subnormal or zero; let the FPU do the rounding
+      result = std::bit_cast<uint32_t>(std::bit_cast<float>(bits) + std::bit_cast<float>(denorm_magic)) -
+               denorm_magic;
+    else
+    {
+      uint32_t mant_odd = (bits >> 13) & 1;
+      bits += ((15 - 127) << 23) + 0xfff + mant_odd;
+      result = bits >> 13;
+    }
+    return result | (sign >> 16);
+#endif
+  }
+
+  /// ToFloat converts the half-precision bits to a float.
+  static float ToFloat(uint16_t value)
+  {
+#if defined(__F16C__)
+    return _cvtsh_ss(value);
+#else
+    constexpr uint32_t shifted_exp = 0x7c00 << 13;
+    constexpr float magic = std::bit_cast<float>(uint32_t{113 << 23});
+
+    uint32_t bits = (value & 0x7fff) << 13;
+    uint32_t exp = bits & shifted_exp;
+    bits += (127 - 15) << 23;
+
+    if (exp == shifted_exp)             // infinity or NaN
+      bits += (128 - 16) << 23;
+    else if (exp == 0)                  // zero or subnormal
+      bits = std::bit_cast<uint32_t>(std::bit_cast<float>(bits + (1 << 23)) - magic);
+
+    return std::bit_cast<float>(bits | ((value & 0x8000u) << 16));
+#endif
+  }
+
+  uint16_t bits_;
+};
+
+
+/// bfloat16_t is a brain floating-point value, the upper 16 bits of a float.
+///
+/// It has the range of a float with a precision of 8 bits. The conversion to float is a shift,
+/// and the conversion from float rounds to the nearest even value.
+struct bfloat16_t
+{
+  /// Number of values, so half-precision weights can be used like quantized blocks.
+  static constexpr size_t kQuants = 1;
+
+  bfloat16_t() = default;
+  explicit bfloat16_t(float value) : bits_(FromFloat(value)) {}
+
+  operator float() const                                  { return ToFloat(bits_); }
+
+  /// FromFloat converts a float to the bfloat16 bits rounding to the nearest even value.
+  static uint16_t FromFloat(float value)
+  {
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    if ((bits & 0x7fffffffu) > 0x7f800000u)   // NaN; keep it quiet
+      return (bits >> 16) | 0x40;
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+  }
+
+  /// ToFloat converts the bfloat16 bits to a float.
+  static float ToFloat(uint16_t value)
+  {
+    return std::bit_cast<float>(uint32_t{value} << 16);
+  }
+
+  uint16_t bits_;
+};
+
+} // end of namespace grid
+
+#endif  // GRID_TENSOR_FLOAT16_H
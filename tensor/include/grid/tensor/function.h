@@ -12,6 +12,7 @@
 #include <algorithm>
 #include <ranges>
 #include <span>
+#include <stdexcept>
 #include <tuple>
 
 #include "concepts.h"
@@ -94,6 +95,7 @@ template <typename TOperator, AnyTensor TTensor, typename... Args>
 TOperator Function<TOperator, TTensor, Args...>::operator_;
 
 
+template <typename> class AttentionOperator;
 template <typename> class RmsNormOperator;
 template <typename> class RopeOperator;
 template <typename> class SoftMaxOperator;
@@ -121,6 +123,26 @@ auto SoftMax(TTensor&& tensor)
   return Function(SoftMaxOperator<tensor_device_t<TTensor>>(), std::forward<TTensor>(tensor));
 }
 
+/// @brief Attention returns softmax(query * key^T * scale) * value without materializing the
+/// score matrix.
+///
+/// The query is {seq, head_size} and key and value are {kv_seq, head_size}. With causal masking,
+/// the queries are aligned with the last keys, i.e. query i attends to the keys
+/// [0, kv_seq - seq + i]. Note that key and value are captured by value; use views for tensors.
+template <TensorConvertible TQuery, AnyTensor TKey, AnyTensor TValue>
+requires (std::remove_cvref_t<TQuery>::rank == 2 &&
+          std::remove_cvref_t<TKey>::rank == 2 &&
+          std::remove_cvref_t<TValue>::rank == 2)
+auto Attention(TQuery&& query, TKey&& key, TValue&& value, bool causal,
+               typename std::remove_cvref_t<TQuery>::value_type scale)
+{
+  if (key.Dimensions() != value.Dimensions() || query.Dimensions()[1] != key.Dimensions()[1])
+    throw std::runtime_error("mismatching dimensions in attention");
+
+  return Function(AttentionOperator<tensor_device_t<TQuery>>(), std::forward<TQuery>(query),
+                  std::forward<TKey>(key), std::forward<TValue>(value), std::move(causal), std::move(scale));
+}
+
 } // end of namespace grid
 
 #endif  // GRID_TENSOR_FUNCTION_H
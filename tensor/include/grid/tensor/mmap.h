@@ -21,6 +21,8 @@
 #include <numeric>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace grid {
 
@@ -28,28 +30,60 @@ namespace grid {
 class MMap
 {
  protected:
-  MMap(char* addr, size_t file_size) : addr_(addr), file_size_(file_size) {}
+  MMap(char* addr, size_t file_size, size_t length)
+    : addr_(addr), file_size_(file_size), length_(length)
+  {}
 
  public:
-  MMap() : addr_(nullptr), file_size_(0) {}
+  /// Flags lists the options for mapping a file.
+  enum Flags
+  {
+    kPopulate = 1,          ///> read the whole file into memory when it is mapped (MAP_POPULATE)
+    kRead = 2,              ///> read the file into anonymous memory instead of mapping it
+    kHugePages = 4,         ///> use huge pages for the anonymous memory (MAP_HUGETLB), or
+                            ///> transparent huge pages if none are available
+  };
+
+  /// Advice lists the expected access patterns of the mapped memory (see madvise).
+  enum Advice
+  {
+    kAdviceNormal,          ///> default read-ahead
+    kAdviceSequential,      ///> aggressive read-ahead (MADV_SEQUENTIAL)
+    kAdviceRandom,          ///> no read-ahead (MADV_RANDOM)
+    kAdviceWillNeed,        ///> read the pages asynchronously (MADV_WILLNEED)
+    kAdviceHugePage,        ///> use transparent huge pages, if supported (MADV_HUGEPAGE)
+  };
+
+  MMap() : addr_(nullptr), file_size_(0), length_(0) {}
 
   ~MMap()
   {
-    if (addr_ != nullptr && file_size_ > 0)
-      munmap(addr_, file_size_);
+    if (addr_ != nullptr && length_ > 0)
+      munmap(addr_, length_);
   }
 
   /// Move constructor.
-  MMap(MMap&& other) : addr_(other.addr_), file_size_(other.file_size_) {}
+  MMap(MMap&& other)
+    : addr_(other.addr_), file_size_(other.file_size_), length_(other.length_), locked_(other.locked_),
+      read_(other.read_)
+  {
+    other.addr_ = nullptr;
+    other.file_size_ = other.length_ = 0;
+  }
 
   /// Move assignment operator.
   MMap& operator=(MMap&& other)
   {
-    if (addr_ != nullptr && file_size_ != 0)
-      munmap(addr_, file_size_);
+    if (addr_ != nullptr && length_ != 0)
+      munmap(addr_, length_);
 
     addr_ = other.addr_;
     file_size_ = other.file_size_;
+    length_ = other.length_;
+    locked_ = other.locked_;
+    read_ = other.read_;
+    other.addr_ = nullptr;
+    other.file_size_ = other.length_ = 0;
     return *this;
   }
 
@@ -67,16 +101,61 @@ class MMap
   // End of the mmaped region
   void* End() const                                       { return addr_ + file_size_; }
 
+  /// Locked returns true if the pages of the file are locked in memory.
+  bool Locked() const                                     { return locked_; }
+
+  /// Release drops the pages of the range from memory, e.g. after the data was converted. The
+  /// range is rounded inward to full pages, and the pages are read again from the file if the
+  /// range is accessed later. Files that were read into anonymous memory (kRead) have no file
+  /// pages to read again, so their pages are kept.
+  void Release(const void* addr, size_t size);
+
+  /// Advise advises the kernel of the access pattern of the range, or of the whole file if size
+  /// is 0. It returns false if the advice isn't supported, which leaves the mapping unchanged.
+  bool Advise(Advice advice, const void* addr = nullptr, size_t size = 0) const;
+
+  /// Lock locks the pages of the file in memory (mlock), which reads the whole file. It returns
+  /// false if the pages cannot be locked, e.g. because of the RLIMIT_MEMLOCK limit.
+  bool Lock();
+
+  /// Prefetch reads the pages of the range into memory by touching each page and returns when
+  /// the range is resident.
+  void Prefetch(const void* addr, size_t size) const;
+
+  /// Resident returns the number of bytes of the range, or of the whole file if size is 0, that
+  /// are resident in memory (mincore).
+  size_t Resident(const void* addr = nullptr, size_t size = 0) const;
+
 
   /// Static function for creating a memory-mapped file specified by the file name/path.
-  static MMap* MMapFile(const std::string& name);
+  /// With kRead, the file is read with the provided number of threads (0 uses all cores).
+  static MMap* MMapFile(const std::string& name, int flags = 0, size_t threads = 0);
 
   /// Static function for creating a memory-mapped file specified by file-descriptor and memory-mapped size.
-  static MMap* MMapFile(int fd, size_t file_size);
+  static MMap* MMapFile(int fd, size_t file_size, int flags = 0, size_t threads = 0);
+
+  /// Static function for mapping multiple files, e.g. the shards of a model, into one consecutive
+  /// range. The files are placed in order at offsets aligned to the page size, and they are mapped
+  /// or read in parallel with the provided number of threads.
+  static MMap* MMapFiles(const std::vector<std::string>& names, int flags = 0, size_t threads = 0);
+
+  /// PageSize returns the page size.
+  static size_t PageSize();
 
  protected:
+  /// MapFiles maps the files at the offsets into a range of the total size.
+  static MMap* MapFiles(const std::vector<int>& fds, const std::vector<size_t>& sizes,
+                        const std::vector<size_t>& offsets, size_t total, int flags, size_t threads);
+
+  /// ReadFiles reads the files into anonymous memory with parallel positional reads.
+  static MMap* ReadFiles(const std::vector<int>& fds, const std::vector<size_t>& sizes,
+                         const std::vector<size_t>& offsets, size_t total, int flags, size_t threads);
+
   char*   addr_;
   size_t  file_size_;
+  size_t  length_;                  // length of the mapping
+  bool    locked_ = false;
+  bool    read_ = false;            // read into anonymous memory (kRead)
 };
 
 
@@ -91,7 +170,7 @@ class MMapView
     : mmap_(mmap),
       base_(static_cast<char*>(mmap->Address()) + offset),
       addr_(static_cast<char*>(mmap->Address()) + offset),
-      end_(static_cast<char*>(mmap->End()) - offset)
+      end_(static_cast<char*>(mmap->End()))
   {}
 
   /// Read returns the value of the specified type at the current position and advances the position.
@@ -138,19 +217,22 @@ class MMapView
   /// advances the position.
   std::string ReadString()
   {
-    char* next = addr_ + 1;
-    if (next >  end_)
-      throw std::out_of_range("mmap readstring: exceeding memory-mapped area");
+    return std::string(ReadStringView<uint32_t>());
+  }
 
-    uint32_t len;
-    memcpy(&len, addr_, sizeof(uint32_t));
-    char* str = next;
-    next += len;
-    if (next > end_)
+  /// ReadStringView returns a view of the string at the current position encoded as length
+  /// (of type TLength) and characters and advances the position. The view refers to the mapped
+  /// memory and is valid for the lifetime of the mapping.
+  template <typename TLength = uint64_t>
+  std::string_view ReadStringView()
+  {
+    TLength len = Read<TLength>();
+    if (len > Remaining())
       throw std::out_of_range("mmap readstring: exceeding memory-mapped area");
 
-    addr_ = next;
-    return std::string(str, len);
+    char* str = addr_;
+    addr_ += len;
+    return std::string_view(str, len);
   }
 
   /// ReadString returns a string of the provided length from the current position and advances
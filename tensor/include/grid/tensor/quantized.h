@@ -0,0 +1,522 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef GRID_TENSOR_QUANTIZED_H
+#define GRID_TENSOR_QUANTIZED_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+#include "float16.h"
+#include "tensor.h"
+
+namespace grid {
+
+//
+// Quantization blocks
+//
+// The block layouts are compatible with the ggml (gguf) formats, so memory-mapped files can be
+// used without conversion. Each block quantizes kQuants consecutive values of a row.
+//
+
+/// BlockQ8_0 quantizes 32 values to 8-bit integers with a common scale: x = delta * qs[i]
+struct BlockQ8_0
+{
+  static constexpr size_t kQuants = 32;
+
+  float16_t delta;
+  int8_t    qs[kQuants];
+};
+
+/// BlockQ4_0 quantizes 32 values to 4-bit integers with a common scale: x = delta * (q[i] - 8)
+/// The lower nibbles of qs hold the values [0, 16), the upper nibbles the values [16, 32).
+struct BlockQ4_0
+{
+  static constexpr size_t kQuants = 32;
+
+  float16_t delta;
+  uint8_t   qs[kQuants / 2];
+};
+
+// K-quants combine 256 values into a super-block of sub-blocks with their own quantized scales
+// (and minimums). The 6-bit scales and minimums of the Q4_K and Q5_K sub-blocks are packed into
+// 12 bytes, see UnpackScaleMin.
+
+/// BlockQ4_K quantizes 8 sub-blocks of 32 values to 4 bits: x = delta * scale[j] * q[i] - min * m[j]
+struct BlockQ4_K
+{
+  static constexpr size_t kQuants = 256;
+
+  float16_t delta;
+  float16_t min;
+  uint8_t   scales[12];
+  uint8_t   qs[kQuants / 2];
+};
+
+/// BlockQ5_K quantizes 8 sub-blocks of 32 values to 5 bits with the 5th bit stored in qh.
+struct BlockQ5_K
+{
+  static constexpr size_t kQuants = 256;
+
+  float16_t delta;
+  float16_t min;
+  uint8_t   scales[12];
+  uint8_t   qh[kQuants / 8];
+  uint8_t   qs[kQuants / 2];
+};
+
+/// BlockQ6_K quantizes 16 sub-blocks of 16 values to 6 bits with 8-bit scales:
+/// x = delta * scales[j] * (q[i] - 32); the upper 2 bits of q are stored in qh.
+struct BlockQ6_K
+{
+  static constexpr size_t kQuants = 256;
+
+  uint8_t   ql[kQuants / 2];
+  uint8_t   qh[kQuants / 4];
+  int8_t    scales[kQuants / 16];
+  float16_t delta;
+};
+
+
+/// UnpackScaleMin returns the 6-bit scale and minimum of sub-block j of a Q4_K or Q5_K block.
+/// The first 4 scales and minimums are stored in the lower 6 bits of bytes [0, 8), and the last
+/// 4 in the nibbles of bytes [8, 12) with the upper 2 bits in the upper bits of bytes [0, 8).
+inline std::tuple<uint8_t, uint8_t> UnpackScaleMin(size_t j, const uint8_t* scales)
+{
+  if (j < 4)
+    return {scales[j] & 63, scales[j + 4] & 63};
+  else
+    return {(scales[j + 4] & 0x0f) | ((scales[j - 4] >> 6) << 4),
+            (scales[j + 4] >> 4) | ((scales[j] >> 6) << 4)};
+}
+
+/// PackScaleMin stores the 6-bit scale and minimum of sub-block j; j has to be increasing.
+inline void PackScaleMin(size_t j, uint8_t* scales, uint8_t scale, uint8_t min)
+{
+  if (j < 4)
+  {
+    scales[j] = scale;
+    scales[j + 4] = min;
+  }
+  else
+  {
+    scales[j + 4] = (scale & 0x0f) | ((min & 0x0f) << 4);
+    scales[j - 4] |= (scale >> 4) << 6;
+    scales[j] |= (min >> 4) << 6;
+  }
+}
+
+
+// Half-precision values are "blocks" of a single value.
+
+inline void Dequantize(const float16_t& value, float* y)  { *y = value; }
+inline void Dequantize(const bfloat16_t& value, float* y) { *y = value; }
+inline void Quantize(const float* x, float16_t& value)    { value = float16_t(*x); }
+inline void Quantize(const float* x, bfloat16_t& value)   { value = bfloat16_t(*x); }
+
+
+/// Dequantize converts a block to kQuants floats.
+inline void Dequantize(const BlockQ8_0& block, float* y)
+{
+  float delta = block.delta;
+  for (size_t i = 0; i < BlockQ8_0::kQuants; i++)
+    y[i] = delta * block.qs[i];
+}
+
+inline void Dequantize(const BlockQ4_0& block, float* y)
+{
+  constexpr size_t half = BlockQ4_0::kQuants / 2;
+  float delta = block.delta;
+  for (size_t i = 0; i < half; i++)
+  {
+    y[i] =        delta * ((block.qs[i] & 0x0f) - 8);
+    y[i + half] = delta * ((block.qs[i] >> 4) - 8);
+  }
+}
+
+inline void Dequantize(const BlockQ4_K& block, float* y)
+{
+  float delta = block.delta;
+  float min = block.min;
+  const uint8_t* qs = block.qs;
+  for (size_t j = 0; j < 8; j += 2, qs += 32, y += 64)
+  {
+    auto [scale_lo, min_lo] = UnpackScaleMin(j, block.scales);
+    auto [scale_hi, min_hi] = UnpackScaleMin(j + 1, block.scales);
+    for (size_t i = 0; i < 32; i++)
+    {
+      y[i] =      delta * scale_lo * (qs[i] & 0x0f) - min * min_lo;
+      y[i + 32] = delta * scale_hi * (qs[i] >> 4) - min * min_hi;
+    }
+  }
+}
+
+inline void Dequantize(const BlockQ5_K& block, float* y)
+{
+  float delta = block.delta;
+  float min = block.min;
+  const uint8_t* qs = block.qs;
+  for (size_t j = 0; j < 8; j += 2, qs += 32, y += 64)
+  {
+    auto [scale_lo, min_lo] = UnpackScaleMin(j, block.scales);
+    auto [scale_hi, min_hi] = UnpackScaleMin(j + 1, block.scales);
+    for (size_t i = 0; i < 32; i++)
+    {
+      int q_lo = (qs[i] & 0x0f) | (((block.qh[i] >> j) & 1) << 4);
+      int q_hi = (qs[i] >> 4) | (((block.qh[i] >> (j + 1)) & 1) << 4);
+      y[i] =      delta * scale_lo * q_lo - min * min_lo;
+      y[i + 32] = delta * scale_hi * q_hi - min * min_hi;
+    }
+  }
+}
+
+inline void Dequantize(const BlockQ6_K& block, float* y)
+{
+  float delta = block.delta;
+  const uint8_t* ql = block.ql;
+  const uint8_t* qh = block.qh;
+  const int8_t* scales = block.scales;
+  for (size_t n = 0; n < BlockQ6_K::kQuants; n += 128, ql += 64, qh += 32, scales += 8, y += 128)
+  {
+    for (size_t i = 0; i < 32; i++)
+    {
+      size_t s = i / 16;
+      y[i] =      delta * scales[s + 0] * (((ql[i] & 0x0f) | (((qh[i] >> 0) & 3) << 4)) - 32);
+      y[i + 32] = delta * scales[s + 2] * (((ql[i + 32] & 0x0f) | (((qh[i] >> 2) & 3) << 4)) - 32);
+      y[i + 64] = delta * scales[s + 4] * (((ql[i] >> 4) | (((qh[i] >> 4) & 3) << 4)) - 32);
+      y[i + 96] = delta * scales[s + 6] * (((ql[i + 32] >> 4) | (((qh[i] >> 6) & 3) << 4)) - 32);
+    }
+  }
+}
+
+
+/// Quantize converts kQuants floats to a block, using the same rounding as ggml.
+inline void Quantize(const float* x, BlockQ8_0& block)
+{
+  float amax = 0.0f;
+  for (size_t i = 0; i < BlockQ8_0::kQuants; i++)
+    amax = std::max(amax, std::abs(x[i]));
+
+  float delta = amax / 127.0f;
+  float inverse = delta != 0.0f ? 1.0f / delta : 0.0f;
+  block.delta = float16_t(delta);
+  for (size_t i = 0; i < BlockQ8_0::kQuants; i++)
+    block.qs[i] = static_cast<int8_t>(std::round(x[i] * inverse));
+}
+
+inline void Quantize(const float* x, BlockQ4_0& block)
+{
+  // the value with the largest magnitude maps to -8, which keeps its sign in the scale
+  float amax = 0.0f;
+  float max = 0.0f;
+  for (size_t i = 0; i < BlockQ4_0::kQuants; i++)
+  {
+    if (std::abs(x[i]) > amax)
+    {
+      amax = std::abs(x[i]);
+      max = x[i];
+    }
+  }
+
+  constexpr size_t half = BlockQ4_0::kQuants / 2;
+  float delta = max / -8.0f;
+  float inverse = delta != 0.0f ? 1.0f / delta : 0.0f;
+  block.delta = float16_t(delta);
+  for (size_t i = 0; i < half; i++)
+  {
+    uint8_t lo = std::min(15, static_cast<int>(x[i] * inverse + 8.5f));
+    uint8_t hi = std::min(15, static_cast<int>(x[i + half] * inverse + 8.5f));
+    block.qs[i] = lo | (hi << 4);
+  }
+}
+
+
+namespace details {
+
+// QuantizeScaleMin quantizes the sub-blocks of 32 values of a K-quant block to the levels
+// [0, max_level] with a scale and minimum each, and stores the 6-bit scales and minimums. It
+// returns the quantized values. Note that this uses the range of each sub-block instead of the
+// iterative search of ggml, which gives slightly larger errors.
+template <typename TBlock>
+inline std::array<uint8_t, 256> QuantizeScaleMin(const float* x, TBlock& block, int max_level)
+{
+  float scales[8];
+  float mins[8];
+  float max_scale = 0.0f;
+  float max_min = 0.0f;
+  for (size_t j = 0; j < 8; j++)
+  {
+    auto [lo, hi] = std::minmax_element(x + j * 32, x + j * 32 + 32);
+    mins[j] = -std::min(*lo, 0.0f);
+    scales[j] = (*hi + mins[j]) / max_level;
+    max_scale = std::max(max_scale, scales[j]);
+    max_min = std::max(max_min, mins[j]);
+  }
+
+  float inverse_scale = max_scale > 0.0f ? 63.0f / max_scale : 0.0f;
+  float inverse_min = max_min > 0.0f ? 63.0f / max_min : 0.0f;
+  block.delta = float16_t(max_scale / 63.0f);
+  block.min = float16_t(max_min / 63.0f);
+  for (size_t j = 0; j < 8; j++)
+    PackScaleMin(j, block.scales,
+                 std::min(63, static_cast<int>(std::round(scales[j] * inverse_scale))),
+                 std::min(63, static_cast<int>(std::round(mins[j] * inverse_min))));
+
+  std::array<uint8_t, 256> levels;
+  for (size_t j = 0; j < 8; j++)
+  {
+    auto [scale, min] = UnpackScaleMin(j, block.scales);
+    float delta = static_cast<float>(block.delta) * scale;
+    float offset = static_cast<float>(block.min) * min;
+    for (size_t i = j * 32; i < j * 32 + 32; i++)
+      levels[i] = delta > 0.0f ? std::clamp(static_cast<int>(std::round((x[i] + offset) / delta)), 0, max_level) : 0;
+  }
+  return levels;
+}
+
+} // end of namespace details
+
+inline void Quantize(const float* x, BlockQ4_K& block)
+{
+  auto levels = details::QuantizeScaleMin(x, block, 15);
+  for (size_t j = 0; j < BlockQ4_K::kQuants; j += 64)
+    for (size_t i = 0; i < 32; i++)
+      block.qs[j / 2 + i] = levels[j + i] | (levels[j + i + 32] << 4);
+}
+
+inline void Quantize(const float* x, BlockQ5_K& block)
+{
+  auto levels = details::QuantizeScaleMin(x, block, 31);
+  std::fill(std::begin(block.qh), std::end(block.qh), 0);
+  for (size_t j = 0; j < BlockQ5_K::kQuants; j += 64)
+  {
+    size_t shift = j / 32;
+    for (size_t i = 0; i < 32; i++)
+    {
+      uint8_t lo = levels[j + i];
+      uint8_t hi = levels[j + i + 32];
+      block.qs[j / 2 + i] = (lo & 0x0f) | ((hi & 0x0f) << 4);
+      block.qh[i] |= ((lo >> 4) << shift) | ((hi >> 4) << (shift + 1));
+    }
+  }
+}
+
+inline void Quantize(const float* x, BlockQ6_K& block)
+{
+  // each sub-block of 16 values maps the value with the largest magnitude to -32
+  float scales[16];
+  float max_scale = 0.0f;
+  for (size_t j = 0; j < 16; j++)
+  {
+    float amax = 0.0f;
+    scales[j] = 0.0f;
+    for (size_t i = j * 16; i < j * 16 + 16; i++)
+    {
+      if (std::abs(x[i]) > amax)
+      {
+        amax = std::abs(x[i]);
+        scales[j] = x[i] / -32.0f;
+      }
+    }
+    if (std::abs(scales[j]) > std::abs(max_scale))
+      max_scale = scales[j];
+  }
+
+  float inverse = max_scale != 0.0f ? -128.0f / max_scale : 0.0f;
+  block.delta = float16_t(max_scale != 0.0f ? 1.0f / inverse : 0.0f);
+
+  uint8_t levels[BlockQ6_K::kQuants];
+  for (size_t j = 0; j < 16; j++)
+  {
+    block.scales[j] = std::min(127, static_cast<int>(std::round(scales[j] * inverse)));
+    float delta = static_cast<float>(block.delta) * block.scales[j];
+    for (size_t i = j * 16; i < j * 16 + 16; i++)
+      levels[i] = (delta != 0.0f ? std::clamp(static_cast<int>(std::round(x[i] / delta)), -32, 31) : 0) + 32;
+  }
+
+  for (size_t n = 0; n < BlockQ6_K::kQuants; n += 128)
+  {
+    uint8_t* ql = block.ql + n / 2;
+    uint8_t* qh = block.qh + n / 4;
+    const uint8_t* l = levels + n;
+    for (size_t i = 0; i < 32; i++)
+    {
+      ql[i] =      (l[i] & 0x0f) | ((l[i + 64] & 0x0f) << 4);
+      ql[i + 32] = (l[i + 32] & 0x0f) | ((l[i + 96] & 0x0f) << 4);
+      qh[i] = (l[i] >> 4) | ((l[i + 32] >> 4) << 2) | ((l[i + 64] >> 4) << 4) | ((l[i + 96] >> 4) << 6);
+    }
+  }
+}
+
+
+/// QuantizedBlock requires a block type that packs kQuants values and can be dequantized.
+template <typename TBlock>
+concept QuantizedBlock = requires (const TBlock& block, float* y)
+{
+  { TBlock::kQuants } -> std::convertible_to<size_t>;
+  Dequantize(block, y);
+};
+
+
+//
+// Panels
+//
+// A matrix of blocks can be repacked into panels of kQuantizedPanelRows consecutive rows, which
+// interleave the blocks of the rows for each block column. The kernels then compute the dot
+// products of all rows of a panel with the same vector, and read the weights sequentially.
+//
+
+/// kQuantizedPanelRows is the number of rows of a panel, which the optimized kernels require.
+inline constexpr size_t kQuantizedPanelRows = 8;
+
+/// PanelOffset returns the index of the block of a row in a matrix {rows, blocks} that is repacked
+/// into panels of panel_rows rows. The last panel holds the remaining rows.
+inline size_t PanelOffset(size_t row, size_t block, size_t rows, size_t blocks, size_t panel_rows)
+{
+  size_t first = row - row % panel_rows;
+  return first * blocks + block * std::min(panel_rows, rows - first) + row - first;
+}
+
+
+/// Tensor<TBlock, Rank, MemoryMapped> is a tensor of block-quantized values in an externally
+/// managed buffer, such as a memory-mapped file. This includes half-precision values.
+///
+/// The dimensions and strides are in values, and the tensor is read as float (value_type). The
+/// values of each block are consecutive, so the axis with a stride of 1 has to be a multiple of
+/// the block size. Reshape only changes the dimensions and strides, e.g. for a transposed matrix,
+/// and the tensor doesn't provide views or iterators; use Dequantize to read the values.
+///
+/// A matrix can be repacked into panels (see PanelOffset), which the tensor records with the
+/// number of rows of a panel (PanelRows). The strides then describe the dense row-major matrix.
+template <QuantizedBlock TBlock, size_t TRank>
+class Tensor<TBlock, TRank, MemoryMapped>
+{
+ public:
+  using value_type = float;
+  using block_type = TBlock;
+  using memory_type = MemoryMapped;
+  using pointer = const block_type*;
+  using const_pointer = const block_type*;
+  constexpr static size_t rank = TRank;
+
+  Tensor() = default;
+
+  explicit Tensor(const std::array<size_t, TRank>& dimensions, const std::tuple<pointer, size_t>& array)
+    : dimensions_(dimensions),
+      strides_{make_strides(dimensions_)},
+      size_(dimensions_[0] * strides_[0] / TBlock::kQuants * sizeof(TBlock)),
+      data_(std::get<0>(array))
+  {
+    if (dimensions_[TRank - 1] % TBlock::kQuants != 0)
+      throw std::runtime_error("dimension " + std::to_string(dimensions_[TRank - 1]) +
+                               " is not a multiple of the block size");
+    if (size_ > std::get<1>(array))
+      throw std::runtime_error("dimensions exceed allotted size: " + std::to_string(size_) + " > " +
+          std::to_string(std::get<1>(array)));
+    if (size_ == 0UL)
+      throw std::runtime_error("attempting to create a zero-size memory mapped tensor");
+  }
+
+  explicit Tensor(const size_t(&& dimensions)[TRank], const std::tuple<pointer, size_t>& array)
+    : Tensor(std::to_array(dimensions), array)
+  {}
+
+  /// Constructor for a matrix {rows, cols} that is repacked into panels of panel_rows rows.
+  explicit Tensor(const std::array<size_t, TRank>& dimensions, const std::tuple<pointer, size_t>& array,
+                  size_t panel_rows) requires (TRank == 2)
+    : Tensor(dimensions, array)
+  {
+    if (panel_rows == 0 || panel_rows > kQuantizedPanelRows)
+      throw std::runtime_error("invalid number of panel rows: " + std::to_string(panel_rows));
+    panel_rows_ = panel_rows;
+  }
+
+  Tensor(const Tensor& other) = default;
+  Tensor& operator=(const Tensor& other) = default;
+
+
+  /// Reshape returns a tensor for the same blocks with a different shape. The blocks have to be
+  /// contiguous along the axis with stride 1, and panels can only be transposed.
+  template <size_t TViewRank>
+  auto Reshape(const std::array<size_t, TViewRank>& dimensions,
+               const std::array<ssize_t, TViewRank>& strides) const
+  {
+    if (panel_rows_ > 1 && TViewRank != 2)
+      throw std::runtime_error("reshape would split panels");
+
+    for (size_t i = 0; i < TViewRank; i++)
+    {
+      if ((strides[i] == 1 && dimensions[i] % TBlock::kQuants != 0) ||
+          (strides[i] != 1 && strides[i] % TBlock::kQuants != 0))
+        throw std::runtime_error("reshape would split quantization blocks");
+    }
+
+    Tensor<TBlock, TViewRank, MemoryMapped> result;
+    result.dimensions_ = dimensions;
+    result.strides_ = strides;
+    result.size_ = size_;
+    result.data_ = data_;
+    result.panel_rows_ = panel_rows_;
+    return result;
+  }
+
+
+  /// Rank returns the rank of the tensor.
+  constexpr static size_t Rank()                          { return TRank; }
+
+  /// Dimensions returns the dimensions of the tensor.
+  const std::array<size_t, TRank>& Dimensions() const     { return dimensions_; }
+
+  /// Strides returns the strides of the tensor in values.
+  const std::array<ssize_t, TRank>& Strides() const       { return strides_; }
+
+  /// Size returns the data buffer size.
+  size_t Size() const                                     { return size_; }
+
+  /// Data returns a pointer to the first block.
+  const_pointer Data() const                              { return data_; }
+
+  /// Offset returns the offset in the buffer.
+  size_t Offset() const                                   { return 0UL; }
+
+  /// PanelRows returns the number of rows of a panel, or 1 for a row-major matrix.
+  size_t PanelRows() const                                { return panel_rows_; }
+
+ private:
+  template <typename, size_t, typename> friend class Tensor;
+
+  std::array<size_t, TRank>   dimensions_{};
+  std::array<ssize_t, TRank>  strides_{};
+  size_t                      size_ = 0;
+  pointer                     data_ = nullptr;
+  size_t                      panel_rows_ = 1;
+};
+
+template <QuantizedBlock TBlock, size_t N>
+explicit Tensor(const size_t(&)[N], const std::tuple<TBlock*, size_t>&) -> Tensor<TBlock, N, MemoryMapped>;
+template <QuantizedBlock TBlock, size_t N>
+explicit Tensor(const std::array<size_t, N>&, const std::tuple<TBlock*, size_t>&) -> Tensor<TBlock, N, MemoryMapped>;
+
+
+/// is_quantized_tensor_v checks if a tensor holds block-quantized values.
+template <typename> inline constexpr bool is_quantized_tensor_v = false;
+template <QuantizedBlock TBlock, size_t TRank>
+inline constexpr bool is_quantized_tensor_v<Tensor<TBlock, TRank, MemoryMapped>> = true;
+
+/// QuantizedTensor requires a tensor of block-quantized values.
+template <typename TTensor>
+concept QuantizedTensor = is_quantized_tensor_v<std::remove_cvref_t<TTensor>>;
+
+} // end of namespace grid
+
+#endif  // GRID_TENSOR_QUANTIZED_H
@@ -335,6 +335,12 @@ class Tensor : public Array<T, TMemory>
     return operator=(Add(*this, std::forward<TOperator>(oper)()));
   }
 
+  template <PrimitiveTensor TTensor>
+  Tensor& operator+=(const TTensor& tensor)
+  {
+    return operator=(Add(*this, tensor));
+  }
+
 
   /// View returns a view of the proivded tensor.
   template <typename... Ts>
@@ -15,6 +15,7 @@
 
 #include "base/tensor.h"
 
+#include "base/attention.h"
 #include "base/binary.h"
 #include "base/device.h"
 #include "base/generator.h"
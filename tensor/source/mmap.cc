@@ -6,30 +6,277 @@
 // The contents of this file are confidential and proprietary to Chris Zankel.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+#include <tuple>
+#include <vector>
+
 #include <grid/tensor/mmap.h>
+#include <grid/util/thread_pool.h>
 
 namespace grid {
 
-MMap* MMap::MMapFile(const std::string& name)
+namespace {
+
+const uintptr_t kPageSize = sysconf(_SC_PAGESIZE);
+
+// Files are read in chunks of this size, which are aligned in the file and in memory.
+constexpr size_t kReadChunkSize = 16UL << 20;
+
+// HugePageSize returns the size of the default huge pages, which is required to unmap them.
+size_t HugePageSize()
+{
+  std::ifstream meminfo("/proc/meminfo");
+  std::string key;
+  size_t size;
+  while (meminfo >> key >> size)
+  {
+    if (key == "Hugepagesize:")
+      return size << 10;
+    meminfo.ignore(256, '\n');
+  }
+  return 2UL << 20;
+}
+
+// PageRange returns the range of full pages that includes the range, or the whole file if size is 0.
+std::tuple<char*, size_t> PageRange(const MMap& mmap, const void* addr, size_t size)
+{
+  if (size == 0)
+    return std::make_tuple(static_cast<char*>(mmap.Address()), mmap.Size());
+
+  uintptr_t begin = reinterpret_cast<uintptr_t>(addr) & ~(kPageSize - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+  return std::make_tuple(reinterpret_cast<char*>(begin), end - begin);
+}
+
+} // end of namespace
+
+
+MMap* MMap::MMapFile(const std::string& name, int flags, size_t threads)
 {
-  int fd = open(name.c_str(), O_RDONLY);
-  if (fd < 0)
-    throw("no such file: " + name);
+  return MMapFiles({name}, flags, threads);
+}
+
+MMap* MMap::MMapFiles(const std::vector<std::string>& names, int flags, size_t threads)
+{
+  std::vector<int> fds;
+  std::vector<size_t> sizes;
+  std::vector<size_t> offsets;
+  size_t total = 0;
 
-  auto mmap = MMapFile(fd, lseek(fd, 0, SEEK_END));
-  close(fd);
+  MMap* mmap = nullptr;
+  try
+  {
+    for (auto& name : names)
+    {
+      int fd = open(name.c_str(), O_RDONLY);
+      if (fd < 0)
+        throw("no such file: " + name);
+      fds.push_back(fd);
+      sizes.push_back(lseek(fd, 0, SEEK_END));
+      offsets.push_back(total);
+      total = names.size() > 1 ? (total + sizes.back() + kPageSize - 1) & ~(kPageSize - 1) : sizes.back();
+    }
+    mmap = MapFiles(fds, sizes, offsets, total, flags, threads);
+  }
+  catch (...)
+  {
+    for (int fd : fds)
+      close(fd);
+    throw;
+  }
 
+  for (int fd : fds)
+    close(fd);
   return mmap;
 }
 
-MMap* MMap::MMapFile(int fd, size_t file_size)
+MMap* MMap::MMapFile(int fd, size_t file_size, int flags, size_t threads)
+{
+  return MapFiles({fd}, {file_size}, {0}, file_size, flags, threads);
+}
+
+MMap* MMap::MapFiles(const std::vector<int>& fds, const std::vector<size_t>& sizes,
+                     const std::vector<size_t>& offsets, size_t total, int flags, size_t threads)
+{
+  if ((flags & kRead) != 0)
+    return ReadFiles(fds, sizes, offsets, total, flags, threads);
+
+  int mmap_flags = MAP_FILE | MAP_SHARED;
+#ifdef MAP_POPULATE
+  if ((flags & kPopulate) != 0)
+    mmap_flags |= MAP_POPULATE;
+#endif
+
+  // A single file is mapped directly; multiple files are mapped into a reserved range.
+  char* addr;
+  if (fds.size() == 1)
+  {
+    void* file_addr = mmap(NULL, sizes[0], PROT_READ, mmap_flags, fds[0], 0);
+    if (file_addr == MAP_FAILED)
+      throw("mmap failed");
+    addr = static_cast<char*>(file_addr);
+  }
+  else
+  {
+    void* range = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED)
+      throw("mmap failed");
+    addr = static_cast<char*>(range);
+
+    // map the files in parallel as populating the pages reads the files
+    std::atomic<bool> failed{false};
+    ThreadPool(threads).Parallel(fds.size(), [&](size_t i) {
+      if (sizes[i] > 0 && mmap(addr + offsets[i], sizes[i], PROT_READ, mmap_flags | MAP_FIXED, fds[i], 0) == MAP_FAILED)
+        failed = true;
+    });
+
+    if (failed)
+    {
+      munmap(addr, total);
+      throw("mmap failed");
+    }
+  }
+
+  auto* result = new MMap(addr, total, total);
+#ifndef MAP_POPULATE
+  // read the files with the mapping where MAP_POPULATE isn't available
+  if ((flags & kPopulate) != 0)
+    result->Prefetch(addr, total);
+#endif
+  return result;
+}
+
+MMap* MMap::ReadFiles(const std::vector<int>& fds, const std::vector<size_t>& sizes,
+                      const std::vector<size_t>& offsets, size_t total, int flags, size_t threads)
 {
-  void* addr = mmap(NULL, file_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+  void* addr = MAP_FAILED;
+  size_t length = total;
+#ifdef MAP_HUGETLB
+  if ((flags & kHugePages) != 0)
+  {
+    size_t huge_page_size = HugePageSize();
+    length = (total + huge_page_size - 1) & ~(huge_page_size - 1);
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+
+  // fall back to regular pages, backed by transparent huge pages if enabled
   if (addr == MAP_FAILED)
-    throw("mmap failed");
+  {
+    length = total;
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+      throw("mmap failed");
+#ifdef MADV_HUGEPAGE
+    if ((flags & kHugePages) != 0)
+      madvise(addr, length, MADV_HUGEPAGE);
+#endif
+  }
+
+  std::unique_ptr<MMap> result(new MMap(static_cast<char*>(addr), total, length));
+  result->read_ = true;
+
+  // split the files into chunks (file, offset)
+  std::vector<std::tuple<size_t, size_t>> chunks;
+  for (size_t i = 0; i < fds.size(); i++)
+    for (size_t offset = 0; offset < sizes[i]; offset += kReadChunkSize)
+      chunks.emplace_back(i, offset);
+
+  // the threads read the chunks in order and retry short or interrupted reads
+  std::atomic<bool> failed{false};
+  ThreadPool(threads).Parallel(chunks.size(), [&](size_t chunk) {
+    auto [file, offset] = chunks[chunk];
+    size_t end = std::min(offset + kReadChunkSize, sizes[file]);
+    char* dest = static_cast<char*>(addr) + offsets[file];
+    while (!failed && offset < end)
+    {
+      ssize_t count = pread(fds[file], dest + offset, end - offset, offset);
+      if (count > 0)
+        offset += count;
+      else if (count == 0 || errno != EINTR)
+        failed = true;
+    }
+  });
+
+  if (failed)
+    throw("failed to read file");
+
+  mprotect(addr, length, PROT_READ);
+  return result.release();
+}
+
+void MMap::Release(const void* addr, size_t size)
+{
+  // dropping anonymous pages would zero them
+  if (read_)
+    return;
+
+  uintptr_t begin = (reinterpret_cast<uintptr_t>(addr) + kPageSize - 1) & ~(kPageSize - 1);
+  uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + size) & ~(kPageSize - 1);
+  if (begin < end)
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+}
+
+size_t MMap::PageSize()
+{
+  return kPageSize;
+}
+
+bool MMap::Advise(Advice advice, const void* addr, size_t size) const
+{
+  int madv;
+  switch (advice)
+  {
+    case kAdviceNormal:     madv = MADV_NORMAL; break;
+    case kAdviceSequential: madv = MADV_SEQUENTIAL; break;
+    case kAdviceRandom:     madv = MADV_RANDOM; break;
+    case kAdviceWillNeed:   madv = MADV_WILLNEED; break;
+#ifdef MADV_HUGEPAGE
+    case kAdviceHugePage:   madv = MADV_HUGEPAGE; break;
+#endif
+    default: return false;
+  }
 
-  return new MMap(reinterpret_cast<char*>(addr), file_size);
+  auto [begin, length] = PageRange(*this, addr, size);
+  return length == 0 || madvise(begin, length, madv) == 0;
+}
+
+bool MMap::Lock()
+{
+  if (!locked_ && file_size_ > 0)
+    locked_ = mlock(addr_, file_size_) == 0;
+  return locked_;
 }
 
+void MMap::Prefetch(const void* addr, size_t size) const
+{
+  // read one byte of each page; the sum keeps the compiler from dropping the reads
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+  char sum = 0;
+  for (uintptr_t p = reinterpret_cast<uintptr_t>(addr) & ~(kPageSize - 1); p < end; p += kPageSize)
+    sum += *reinterpret_cast<const volatile char*>(p);
+  [[maybe_unused]] volatile char result = sum;
+}
+
+size_t MMap::Resident(const void* addr, size_t size) const
+{
+  auto [begin, length] = PageRange(*this, addr, size);
+  size_t pages = (length + kPageSize - 1) / kPageSize;
+#ifdef __APPLE__
+  std::vector<char> resident(pages);
+#else
+  std::vector<unsigned char> resident(pages);
+#endif
+  if (pages == 0 || mincore(begin, length, resident.data()) != 0)
+    return 0;
+
+  size_t count = 0;
+  for (auto r : resident)
+    count += r & 1;
+  return std::min(count * kPageSize, length);
+}
 
 } // end of namespace grid
@@ -0,0 +1,139 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cmath>
+#include <limits>
+
+#include <grid/tensor/tensor.h>
+#include <grid/tensor/generator.h>
+#include <grid/tensor/precision.h>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include <grid/tensor/base/tensor.h>
+#include <grid/tensor/base/attention.h>
+#include <grid/tensor/base/generator.h>
+#include "tensor_base.h"
+
+using grid::view::Extent;
+
+template <typename T> class AttentionTestSuite : public testing::Test {};
+TYPED_TEST_SUITE_P(AttentionTestSuite);
+
+// Attention computes the reference attention for tensors with the provided row stride (ld).
+template <typename T>
+void Attention(T* d, const T* q, const T* k, const T* v,
+               size_t rows, size_t kv_rows, size_t head_size, bool causal, T scale, size_t ld)
+{
+  std::vector<T> scores(kv_rows);
+  for (size_t r = 0; r < rows; r++, d += head_size, q += ld)
+  {
+    size_t count = causal ? kv_rows - rows + r + 1 : kv_rows;
+    T max = std::numeric_limits<T>::lowest();
+    for (size_t c = 0; c < count; c++)
+    {
+      T dot{0};
+      for (size_t i = 0; i < head_size; i++)
+        dot += q[i] * k[c * ld + i];
+      scores[c] = dot * scale;
+      max = std::max(max, scores[c]);
+    }
+
+    T sum{0};
+    for (size_t c = 0; c < count; c++)
+      sum += scores[c] = std::exp(scores[c] - max);
+
+    for (size_t i = 0; i < head_size; i++)
+    {
+      T value{0};
+      for (size_t c = 0; c < count; c++)
+        value += scores[c] * v[c * ld + i];
+      d[i] = value / sum;
+    }
+  }
+}
+
+
+TYPED_TEST_P(AttentionTestSuite, TensorAttentionSmall)
+{
+  typename TypeParam::Tensor query = grid::Tensor{ { 1.0f, 0.0f }, { 0.0f, 1.0f } };
+  typename TypeParam::Tensor key =   grid::Tensor{ { 1.0f, 0.0f }, { 0.0f, 1.0f } };
+  typename TypeParam::Tensor value = grid::Tensor{ { 1.0f, 2.0f }, { 3.0f, 4.0f } };
+
+  float e = std::exp(1.0f);
+  typename TypeParam::Tensor expected = grid::Tensor{
+    { (e + 3.0f) / (e + 1.0f), (2.0f * e + 4.0f) / (e + 1.0f) },
+    { (1.0f + 3.0f * e) / (e + 1.0f), (2.0f + 4.0f * e) / (e + 1.0f) } };
+
+  grid::Precision p(10.f);
+  typename TypeParam::Tensor result = grid::Attention(query, key.View(), value.View(), false, 1.0f);
+  EXPECT_EQ(result, expected);
+
+  // the first query only attends to the first key
+  typename TypeParam::Tensor causal = grid::Attention(query, key.View(), value.View(), true, 1.0f);
+  EXPECT_EQ(causal.View(0), value.View(0));
+  EXPECT_EQ(causal.View(1), expected.View(1));
+}
+
+
+TYPED_TEST_P(AttentionTestSuite, TensorAttentionLarge)
+{
+  const size_t rows = 77, kv_rows = 301, head_size = 48;
+  float scale = 1.0f / std::sqrt(static_cast<float>(head_size));
+
+  auto query = grid::Random<grid::Tensor, float>({rows, head_size})();
+  auto key = grid::Random<grid::Tensor, float>({kv_rows, head_size})();
+  auto value = grid::Random<grid::Tensor, float>({kv_rows, head_size})();
+
+  grid::Precision p(100.f);
+  for (bool causal: { false, true })
+  {
+    grid::Tensor expected({rows, head_size}, grid::Uninitialized<float>{});
+    Attention(expected.Data(), query.Data(), key.Data(), value.Data(),
+              rows, kv_rows, head_size, causal, scale, head_size);
+
+    typename TypeParam::Tensor result = grid::Attention(query, key.View(), value.View(), causal, scale);
+    EXPECT_EQ(result, expected);
+  }
+}
+
+
+TYPED_TEST_P(AttentionTestSuite, TensorAttentionStrided)
+{
+  const size_t rows = 20, kv_rows = 70, head_size = 16, n_heads = 3;
+  float scale = 0.25f;
+
+  auto query = grid::Random<grid::Tensor, float>({rows, n_heads * head_size})();
+  auto key = grid::Random<grid::Tensor, float>({kv_rows, n_heads * head_size})();
+  auto value = grid::Random<grid::Tensor, float>({kv_rows, n_heads * head_size})();
+
+  grid::Precision p(100.f);
+  for (size_t head = 0; head < n_heads; head++)
+  {
+    size_t offset = head * head_size;
+    grid::Tensor expected({rows, head_size}, grid::Uninitialized<float>{});
+    Attention(expected.Data(), query.Data() + offset, key.Data() + offset, value.Data() + offset,
+              rows, kv_rows, head_size, true, scale, n_heads * head_size);
+
+    typename TypeParam::Tensor result = grid::Attention(
+        query.View(Extent(rows), Extent(head * head_size, head_size)),
+        key.View(Extent(kv_rows), Extent(head * head_size, head_size)),
+        value.View(Extent(kv_rows), Extent(head * head_size, head_size)),
+        true, scale);
+    EXPECT_EQ(result, expected);
+  }
+}
+
+
+REGISTER_TYPED_TEST_SUITE_P(AttentionTestSuite,
+    TensorAttentionSmall,
+    TensorAttentionLarge,
+    TensorAttentionStrided);
+
+INSTANTIATE_TYPED_TEST_SUITE_P(AttentionTestBase, AttentionTestSuite, TensorBaseType);
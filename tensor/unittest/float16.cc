@@ -0,0 +1,80 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cmath>
+#include <limits>
+
+#include <grid/tensor/float16.h>
+
+#include "gtest/gtest.h"
+
+using grid::float16_t;
+
+TEST(Float16, Conversion)
+{
+  EXPECT_EQ(float16_t::FromFloat(0.0f), 0x0000);
+  EXPECT_EQ(float16_t::FromFloat(-0.0f), 0x8000);
+  EXPECT_EQ(float16_t::FromFloat(1.0f), 0x3c00);
+  EXPECT_EQ(float16_t::FromFloat(-2.0f), 0xc000);
+  EXPECT_EQ(float16_t::FromFloat(65504.0f), 0x7bff);
+  EXPECT_EQ(float16_t::FromFloat(1e6f), 0x7c00);
+  EXPECT_EQ(float16_t::FromFloat(5.9604645e-8f), 0x0001);
+  EXPECT_EQ(float16_t::FromFloat(std::numeric_limits<float>::infinity()), 0x7c00);
+  EXPECT_TRUE(std::isnan(float16_t::ToFloat(float16_t::FromFloat(std::nanf("")))));
+
+  EXPECT_EQ(float16_t::ToFloat(0x3555), 0.33325195f);
+  EXPECT_EQ(float16_t::ToFloat(0x0001), 5.9604645e-8f);
+  EXPECT_EQ(float16_t::ToFloat(0xfc00), -std::numeric_limits<float>::infinity());
+}
+
+TEST(Float16, Rounding)
+{
+  // 1 + 2^-11 is halfway between 1 and 1 + 2^-10 and rounds to even
+  EXPECT_EQ(float16_t::FromFloat(1.0f + 0x1p-11f), 0x3c00);
+  EXPECT_EQ(float16_t::FromFloat(1.0f + 0x1p-10f + 0x1p-11f), 0x3c02);
+  EXPECT_EQ(float16_t::FromFloat(1.0f + 0x1p-11f + 0x1p-20f), 0x3c01);
+}
+
+TEST(Float16, RoundTrip)
+{
+  for (uint32_t bits = 0; bits < 0x10000; bits++)
+  {
+    float value = float16_t::ToFloat(bits);
+    if (!std::isnan(value))
+    {
+      EXPECT_EQ(float16_t::FromFloat(value), bits);
+    }
+  }
+  EXPECT_EQ(static_cast<float>(float16_t(0.5f)), 0.5f);
+}
+
+TEST(BFloat16, Conversion)
+{
+  using grid::bfloat16_t;
+
+  EXPECT_EQ(bfloat16_t::FromFloat(0.0f), 0x0000);
+  EXPECT_EQ(bfloat16_t::FromFloat(-0.0f), 0x8000);
+  EXPECT_EQ(bfloat16_t::FromFloat(1.0f), 0x3f80);
+  EXPECT_EQ(bfloat16_t::FromFloat(-2.0f), 0xc000);
+  EXPECT_EQ(bfloat16_t::FromFloat(std::numeric_limits<float>::infinity()), 0x7f80);
+  EXPECT_TRUE(std::isnan(bfloat16_t::ToFloat(bfloat16_t::FromFloat(std::nanf("")))));
+
+  // 1 + 2^-8 is halfway between 1 and 1 + 2^-7 and rounds to even
+  EXPECT_EQ(bfloat16_t::FromFloat(1.0f + 0x1p-8f), 0x3f80);
+  EXPECT_EQ(bfloat16_t::FromFloat(1.0f + 0x1p-7f + 0x1p-8f), 0x3f82);
+  EXPECT_EQ(bfloat16_t::FromFloat(1.0f + 0x1p-8f + 0x1p-20f), 0x3f81);
+
+  for (uint32_t bits = 0; bits < 0x10000; bits++)
+  {
+    float value = bfloat16_t::ToFloat(bits);
+    if (!std::isnan(value))
+    {
+      EXPECT_EQ(bfloat16_t::FromFloat(value), bits);
+    }
+  }
+}
@@ -0,0 +1,69 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <grid/tensor/mmap.h>
+
+#include "gtest/gtest.h"
+
+using grid::MMap;
+
+namespace {
+
+// WriteFile writes a file of the provided number of pages with a pattern and returns its path.
+std::string WriteFile(size_t pages, std::vector<char>& data)
+{
+  data.resize(pages * MMap::PageSize());
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<char>(i * 7 + i / 4096);
+
+  std::string path = "/tmp/grid_mmap_test." + std::to_string(getpid());
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+  return path;
+}
+
+} // end of namespace
+
+
+TEST(MMap, ReleaseMapped)
+{
+  std::vector<char> data;
+  std::string path = WriteFile(4, data);
+  std::unique_ptr<MMap> mmap(MMap::MMapFile(path));
+  remove(path.c_str());
+
+  // released pages of a mapped file are read again from the file
+  mmap->Release(mmap->Address(), mmap->Size());
+  ASSERT_EQ(mmap->Size(), data.size());
+  EXPECT_EQ(memcmp(mmap->Address(), data.data(), data.size()), 0);
+}
+
+TEST(MMap, ReleaseRead)
+{
+  std::vector<char> data;
+  std::string path = WriteFile(4, data);
+  std::unique_ptr<MMap> mmap(MMap::MMapFile(path, MMap::kRead, 2));
+  remove(path.c_str());
+
+  // the pages of a file read into anonymous memory survive
+  mmap->Release(mmap->Address(), mmap->Size());
+  ASSERT_EQ(mmap->Size(), data.size());
+  EXPECT_EQ(memcmp(mmap->Address(), data.data(), data.size()), 0);
+
+  MMap moved(std::move(*mmap));
+  moved.Release(moved.Address(), moved.Size());
+  EXPECT_EQ(memcmp(moved.Address(), data.data(), data.size()), 0);
+}
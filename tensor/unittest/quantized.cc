@@ -0,0 +1,265 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <grid/tensor/tensor.h>
+#include <grid/tensor/quantized.h>
+
+#include "gtest/gtest.h"
+
+#include <grid/tensor/base/tensor.h>
+#include <grid/tensor/base/matmul.h>
+
+using grid::BlockQ4_0;
+using grid::BlockQ8_0;
+using grid::BlockQ4_K;
+using grid::BlockQ5_K;
+using grid::BlockQ6_K;
+using grid::float16_t;
+using grid::bfloat16_t;
+
+template <typename TBlock> class QuantizedTestSuite : public testing::Test {};
+using QuantizedTypes = testing::Types<BlockQ8_0, BlockQ4_0, BlockQ4_K, BlockQ5_K, BlockQ6_K, float16_t, bfloat16_t>;
+TYPED_TEST_SUITE(QuantizedTestSuite, QuantizedTypes);
+
+// Quantize returns the blocks for the random values of a {rows, cols} matrix and the dequantized values.
+template <typename TBlock>
+std::tuple<std::vector<TBlock>, std::vector<float>> Quantize(size_t rows, size_t cols, unsigned seed)
+{
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  std::vector<float> values(rows * cols);
+  for (auto& v: values)
+    v = dist(gen);
+
+  std::vector<TBlock> blocks(rows * cols / TBlock::kQuants);
+  std::vector<float> dequantized(rows * cols);
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    grid::Quantize(values.data() + i * TBlock::kQuants, blocks[i]);
+    grid::Dequantize(blocks[i], dequantized.data() + i * TBlock::kQuants);
+  }
+  return {blocks, dequantized};
+}
+
+// Steps is the number of quantization steps over the range [-max, max] of the values.
+template <typename TBlock> constexpr float kSteps = 0.0f;
+template <> constexpr float kSteps<BlockQ8_0> = 254.0f;
+template <> constexpr float kSteps<BlockQ4_0> = 16.0f;
+template <> constexpr float kSteps<BlockQ4_K> = 15.0f;
+template <> constexpr float kSteps<BlockQ5_K> = 31.0f;
+template <> constexpr float kSteps<BlockQ6_K> = 48.0f;
+template <> constexpr float kSteps<float16_t> = 4096.0f;
+template <> constexpr float kSteps<bfloat16_t> = 512.0f;
+
+TYPED_TEST(QuantizedTestSuite, TensorQuantizeRoundTrip)
+{
+  using TBlock = TypeParam;
+  constexpr size_t quants = TBlock::kQuants;
+
+  std::vector<float> values(quants);
+  for (size_t i = 0; i < quants; i++)
+    values[i] = std::sin(static_cast<float>(i)) * 3.0f;
+
+  TBlock block;
+  std::vector<float> result(quants);
+  grid::Quantize(values.data(), block);
+  grid::Dequantize(block, result.data());
+
+  // values are rounded to the nearest step, except the largest values may be clamped and the
+  // scales of the sub-blocks of the K-quants are quantized as well
+  float step = 2.0f * 3.0f / kSteps<TBlock>;
+  for (size_t i = 0; i < quants; i++)
+    EXPECT_LE(std::abs(result[i] - values[i]), step * 1.001f) << "index " << i;
+
+  std::vector<float> zeros(quants, 0.0f);
+  grid::Quantize(zeros.data(), block);
+  grid::Dequantize(block, result.data());
+  EXPECT_EQ(result, zeros);
+}
+
+TYPED_TEST(QuantizedTestSuite, TensorQuantizedDot)
+{
+  using TBlock = TypeParam;
+  size_t cols = 8 * TBlock::kQuants;
+  auto [blocks, dequantized] = Quantize<TBlock>(1, cols, 1);
+  auto [unused, y] = Quantize<TBlock>(1, cols, 2);
+
+  double expected = 0.0;
+  for (size_t i = 0; i < cols; i++)
+    expected += static_cast<double>(dequantized[i]) * y[i];
+
+  EXPECT_NEAR(grid::details::QuantizedDot(blocks.data(), y.data(), blocks.size()), expected, 1e-4);
+  EXPECT_NEAR(grid::details::QuantizedDotGeneric(blocks.data(), y.data(), blocks.size()), expected, 1e-4);
+}
+
+TYPED_TEST(QuantizedTestSuite, TensorQuantizedMatVec)
+{
+  using TBlock = TypeParam;
+  const size_t rows = 7;
+  const size_t cols = 4 * TBlock::kQuants;
+  auto [blocks, dequantized] = Quantize<TBlock>(rows, cols, 3);
+  auto [unused, values] = Quantize<TBlock>(1, cols, 4);
+
+  grid::Tensor weights({rows, cols}, std::make_tuple(blocks.data(), blocks.size() * sizeof(TBlock)));
+  grid::Tensor<float, 1, grid::DeviceMemory<grid::device::Base>> x({cols}, grid::Uninitialized<float>{});
+  std::copy(values.begin(), values.end(), x.Data());
+
+  grid::Tensor result = grid::Matmul(weights, x);
+  ASSERT_EQ(result.Dimensions()[0], rows);
+  for (size_t r = 0; r < rows; r++)
+  {
+    double expected = 0.0;
+    for (size_t c = 0; c < cols; c++)
+      expected += static_cast<double>(dequantized[r * cols + c]) * values[c];
+    EXPECT_NEAR(result.Data()[r], expected, 1e-4) << "row " << r;
+  }
+}
+
+TYPED_TEST(QuantizedTestSuite, TensorQuantizedMatmulTransposed)
+{
+  using TBlock = TypeParam;
+  const size_t rows = 5;
+  const size_t cols = 3 * TBlock::kQuants;
+  const size_t batch = 4;
+  auto [blocks, dequantized] = Quantize<TBlock>(rows, cols, 5);
+  auto [x_blocks, x_dequantized] = Quantize<TBlock>(batch, cols, 6);
+  auto [unused, values] = Quantize<TBlock>(batch, cols, 6);
+
+  // Q8_0 weights are multiplied by the vectors quantized to Q8_0 blocks (W8A8)
+  auto& x_values = std::is_same_v<TBlock, BlockQ8_0> ? x_dequantized : values;
+
+  grid::Tensor weights({rows, cols}, std::make_tuple(blocks.data(), blocks.size() * sizeof(TBlock)));
+  auto transposed = weights.Reshape(std::array<size_t, 2>{cols, rows}, std::array<ssize_t, 2>{1, cols});
+
+  grid::Tensor<float, 2, grid::DeviceMemory<grid::device::Base>> x({batch, cols}, grid::Uninitialized<float>{});
+  std::copy(values.begin(), values.end(), x.Data());
+
+  grid::Tensor result = grid::Matmul(x, transposed);
+  ASSERT_EQ(result.Dimensions()[0], batch);
+  ASSERT_EQ(result.Dimensions()[1], rows);
+  for (size_t b = 0; b < batch; b++)
+  {
+    for (size_t r = 0; r < rows; r++)
+    {
+      double expected = 0.0;
+      for (size_t c = 0; c < cols; c++)
+        expected += static_cast<double>(x_values[b * cols + c]) * dequantized[r * cols + c];
+      EXPECT_NEAR(result.Data()[b * rows + r], expected, 1e-4) << "batch " << b << " row " << r;
+    }
+  }
+
+  if constexpr (TBlock::kQuants > 1)
+  {
+    EXPECT_THROW(weights.Reshape(std::array<size_t, 2>{rows, cols}, std::array<ssize_t, 2>{1, rows}),
+                 std::runtime_error);
+  }
+}
+
+TYPED_TEST(QuantizedTestSuite, TensorQuantizedPanels)
+{
+  using TBlock = TypeParam;
+  const size_t rows = 2 * grid::kQuantizedPanelRows + 3;
+  const size_t cols = 4 * TBlock::kQuants;
+  const size_t blocks = cols / TBlock::kQuants;
+  const size_t batch = 3;
+  auto [row_major, unused] = Quantize<TBlock>(rows, cols, 11);
+  auto [x_blocks, values] = Quantize<TBlock>(batch, cols, 12);
+
+  std::vector<TBlock> panels(row_major.size());
+  for (size_t r = 0; r < rows; r++)
+    for (size_t b = 0; b < blocks; b++)
+      panels[grid::PanelOffset(r, b, rows, blocks, grid::kQuantizedPanelRows)] = row_major[r * blocks + b];
+
+  grid::Tensor weights({rows, cols}, std::make_tuple(row_major.data(), row_major.size() * sizeof(TBlock)));
+  grid::Tensor<TBlock, 2, grid::MemoryMapped> packed({rows, cols}, std::make_tuple(panels.data(),
+                                                     panels.size() * sizeof(TBlock)), grid::kQuantizedPanelRows);
+  EXPECT_EQ(packed.PanelRows(), grid::kQuantizedPanelRows);
+
+  grid::Tensor<float, 1, grid::DeviceMemory<grid::device::Base>> x({cols}, grid::Uninitialized<float>{});
+  std::copy(values.begin(), values.begin() + cols, x.Data());
+  grid::Tensor expected = grid::Matmul(weights, x);
+  grid::Tensor result = grid::Matmul(packed, x);
+  for (size_t r = 0; r < rows; r++)
+    EXPECT_NEAR(result.Data()[r], expected.Data()[r], 1e-4) << "row " << r;
+
+  auto transposed = weights.Reshape(std::array<size_t, 2>{cols, rows}, std::array<ssize_t, 2>{1, cols});
+  auto packed_transposed = packed.Reshape(std::array<size_t, 2>{cols, rows}, std::array<ssize_t, 2>{1, cols});
+  EXPECT_EQ(packed_transposed.PanelRows(), grid::kQuantizedPanelRows);
+
+  grid::Tensor<float, 2, grid::DeviceMemory<grid::device::Base>> xs({batch, cols}, grid::Uninitialized<float>{});
+  std::copy(values.begin(), values.end(), xs.Data());
+  grid::Tensor expected_batch = grid::Matmul(xs, transposed);
+  grid::Tensor result_batch = grid::Matmul(xs, packed_transposed);
+  for (size_t i = 0; i < batch * rows; i++)
+    EXPECT_NEAR(result_batch.Data()[i], expected_batch.Data()[i], 1e-4) << "index " << i;
+
+  EXPECT_THROW(packed.Reshape(std::array<size_t, 1>{rows * cols}, std::array<ssize_t, 1>{1}), std::runtime_error);
+}
+
+TEST(QuantizedTestSuite, TensorQuantizedDotInt8)
+{
+  const size_t cols = 8 * BlockQ8_0::kQuants;
+  auto [x, x_dequantized] = Quantize<BlockQ8_0>(1, cols, 9);
+  auto [unused, values] = Quantize<BlockQ8_0>(1, cols, 10);
+
+  std::vector<BlockQ8_0> y(cols / BlockQ8_0::kQuants);
+  std::vector<BlockQ8_0> y_generic(cols / BlockQ8_0::kQuants);
+  grid::details::QuantizeRow(values.data(), y.data(), y.size());
+  grid::details::QuantizeRowGeneric(values.data(), y_generic.data(), y.size());
+
+  std::vector<float> y_dequantized(cols);
+  for (size_t b = 0; b < y.size(); b++)
+  {
+    EXPECT_EQ(static_cast<float>(y[b].delta), static_cast<float>(y_generic[b].delta));
+    for (size_t i = 0; i < BlockQ8_0::kQuants; i++)
+      EXPECT_NEAR(y[b].qs[i], y_generic[b].qs[i], 1) << "block " << b << " index " << i;
+    grid::Dequantize(y[b], y_dequantized.data() + b * BlockQ8_0::kQuants);
+  }
+
+  double expected = 0.0;
+  for (size_t i = 0; i < cols; i++)
+    expected += static_cast<double>(x_dequantized[i]) * y_dequantized[i];
+
+  EXPECT_NEAR(grid::details::QuantizedDot(x.data(), y.data(), y.size()), expected, 1e-4);
+  EXPECT_NEAR(grid::details::QuantizedDotGeneric(x.data(), y.data(), y.size()), expected, 1e-4);
+#if defined(GRID_QUANTIZED_AVX2)
+  if (grid::details::HasAvx2())
+  {
+    EXPECT_NEAR(grid::details::QuantizedDotAvx2(x.data(), y.data(), y.size()), expected, 1e-4);
+  }
+#endif
+}
+
+TEST(QuantizedTestSuite, TensorHalfDot)
+{
+  // lengths that aren't a multiple of the vector size
+  for (size_t cols: {5UL, 24UL, 75UL})
+  {
+    auto [halfs, dequantized] = Quantize<float16_t>(1, cols, 7);
+    auto [bhalfs, bdequantized] = Quantize<bfloat16_t>(1, cols, 7);
+    auto [unused, y] = Quantize<float16_t>(1, cols, 8);
+
+    double expected = 0.0;
+    double bexpected = 0.0;
+    for (size_t i = 0; i < cols; i++)
+    {
+      expected += static_cast<double>(dequantized[i]) * y[i];
+      bexpected += static_cast<double>(bdequantized[i]) * y[i];
+    }
+
+    EXPECT_NEAR(grid::details::QuantizedDot(halfs.data(), y.data(), cols), expected, 1e-4);
+    EXPECT_NEAR(grid::details::QuantizedDotGeneric(halfs.data(), y.data(), cols), expected, 1e-4);
+    EXPECT_NEAR(grid::details::QuantizedDot(bhalfs.data(), y.data(), cols), bexpected, 1e-4);
+    EXPECT_NEAR(grid::details::QuantizedDotGeneric(bhalfs.data(), y.data(), cols), bexpected, 1e-4);
+  }
+}
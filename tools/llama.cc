@@ -7,6 +7,7 @@
 //
 
 #include <chrono>
+#include <exception>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -17,6 +18,27 @@
 #include <grid/tensor/tensor_base.h>
 #include <grid/util/demangle.h>
 
+namespace {
+
+// PrintUsage prints the options and their values.
+void PrintUsage(std::ostream& os)
+{
+  os << "Usage: llama [-i] [-t gguf|karpathy|grid] [-c cache] [-d device] [-j threads] [-k f16|i8] "
+        "[-l head] [-p mode ...] [-q q8_0|q4_0] [-r] [-s steps] -m model [prompt]\n"
+        "Modes: populate, lock, prefetch, stream, read, hugetlb, sequential, random, willneed, "
+        "hugepage" << std::endl;
+}
+
+// Invalid reports an invalid option value and the usage, and exits.
+[[noreturn]] void Invalid(const std::string& what, const char* value)
+{
+  std::cerr << "Error: unsupported " << what << ": " << value << std::endl;
+  PrintUsage(std::cerr);
+  exit(1);
+}
+
+} // end of namespace
+
 int main(int argc, char** argv)
 {
   int                   opt;
@@ -26,14 +48,14 @@ int main(int argc, char** argv)
 
   int                   steps = 256;
   bool                  show_info = false;
+  grid::LLaMAModel::Options options;
 
-  while ((opt = getopt(argc, argv, "vhid:m:s:t:")) != -1)
+  while ((opt = getopt(argc, argv, "vhic:d:j:k:l:m:p:q:rs:t:")) != -1)
   {
     switch (opt)
     {
       case 'h': // help
-        // FIXME: TODO
-        std::cout << "Help : TODO" << std::endl;
+        PrintUsage(std::cout);
         exit(0);
 
       case 'i': // info
@@ -45,15 +67,80 @@ int main(int argc, char** argv)
         std::cout << "Version: " << std::endl;
         break;
 
+      case 'c': // directory of tokenizer snapshots
+        options.tokenizer_cache_ = optarg;
+        break;
+
       case 'd': // device
         device_name = optarg;
         std::cout << "Using device: " << device_name << std::endl;
         break;
 
+      case 'j': // threads
+        options.threads_ = std::strtoul(optarg, NULL, 0);
+        break;
+
+      case 'k': // key/value cache type
+        if (std::string(optarg) == "f16")
+          options.kv_cache_type_ = grid::LLaMAModel::kCacheFloat16;
+        else if (std::string(optarg) == "i8")
+          options.kv_cache_type_ = grid::LLaMAModel::kCacheInt8;
+        else
+          Invalid("key/value cache type", optarg);
+        break;
+
+      case 'l': // key/value cache layout
+        if (std::string(optarg) == "head")
+          options.kv_cache_layout_ = grid::LLaMAModel::kCacheHeadMajor;
+        else
+          Invalid("key/value cache layout", optarg);
+        break;
+
       case 'm': // model file
         model_path = optarg;
         break;
 
+      case 'p': // residency of the mapped model file
+      {
+        std::string mode(optarg);
+        if (mode == "populate")
+          options.mmap_populate_ = true;
+        else if (mode == "lock")
+          options.mmap_lock_ = true;
+        else if (mode == "prefetch")
+          options.prefetch_ = true;
+        else if (mode == "stream")
+          options.stream_layers_ = true;
+        else if (mode == "read")
+          options.mmap_ = false;
+        else if (mode == "hugetlb")
+          options.mmap_ = false, options.huge_pages_ = true;
+        else if (mode == "sequential")
+          options.mmap_advice_ = grid::MMap::kAdviceSequential;
+        else if (mode == "random")
+          options.mmap_advice_ = grid::MMap::kAdviceRandom;
+        else if (mode == "willneed")
+          options.mmap_advice_ = grid::MMap::kAdviceWillNeed;
+        else if (mode == "hugepage")
+          options.mmap_advice_ = grid::MMap::kAdviceHugePage;
+        else
+          Invalid("residency mode", optarg);
+        break;
+      }
+
+      case 'q': // quantize float weights when loaded
+        if (std::string(optarg) == "q8_0")
+          options.weight_type_ = grid::LLaMAModel::kWeightQ8_0;
+        else if (std::string(optarg) == "q4_0")
+          options.weight_type_ = grid::LLaMAModel::kWeightQ4_0;
+        else
+          Invalid("weight type", optarg);
+        break;
+
+      case 'r': // repack weight matrices into panels
+        options.repack_weights_ = true;
+        break;
+
       case 's': // steps
         steps = std::strtol(optarg, NULL, 0);
         break;
@@ -62,6 +149,12 @@ int main(int argc, char** argv)
         std::string type(optarg);
         if (type == "karpathy")
           model_type = grid::LLaMAFile::kKarpathy;
+        else if (type == "grid")
+          model_type = grid::LLaMAFile::kGrid;
+        else if (type == "gguf")
+          model_type = grid::LLaMAFile::kGgml;
+        else
+          Invalid("file type", optarg);
         break;
     }
   }
@@ -72,42 +165,58 @@ int main(int argc, char** argv)
       exit(1);
   }
 
-  std::unique_ptr<grid::LLaMAFile> file;
   try
   {
-    file.reset(grid::LLaMAFile::Open(model_type, model_path));
-  }
-  catch(std::string err)
-  {
-    std::cerr << "Error: " << err << std::endl;
-    exit(1);
-  }
+    std::unique_ptr<grid::LLaMAFile> file(grid::LLaMAFile::Open(model_type, model_path));
 
-  if (show_info)
-    file->PrintModelInfo(std::cout);
+    if (show_info)
+      file->PrintModelInfo(std::cout);
 
-  if (optind == argc)
-    exit(0);
+    if (optind == argc)
+      exit(0);
 
-  // take extra arguments as text input; concatenate with a space.
-  std::string prompt;
-  for ( ; optind < argc; optind++)
-    prompt.append(argv[optind]).append(1, ' ');
-  prompt.resize(prompt.size() - 1);
+    // take extra arguments as text input; concatenate with a space.
+    std::string prompt;
+    for ( ; optind < argc; optind++)
+      prompt.append(argv[optind]).append(1, ' ');
+    prompt.resize(prompt.size() - 1);
 
-  std::cout << "Loading model ... " << std::flush;
-  std::unique_ptr<grid::LLaMAModel> model(grid::LLaMAModel::Load(*file, device_name));
-  std::cout << "done\n";
+    std::cout << "Loading model ... " << std::flush;
+    std::unique_ptr<grid::LLaMAModel> model(grid::LLaMAModel::Load(*file, device_name, options));
+    std::cout << "done\n";
 
-  std::cout << "Prompt: " << prompt << std::endl;
+    if (show_info)
+    {
+      auto [mapped, resident] = model->Residency();
+      std::cout << "Resident Memory ............ " << (resident >> 20) << " of " << (mapped >> 20) << " MiB ("
+                << (mapped > 0 ? resident * 100 / mapped : 0) << "%)\n";
+    }
+
+    std::cout << "Prompt: " << prompt << std::endl;
 
-  std::chrono::steady_clock::time_point start_time;
-  start_time = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point start_time;
+    start_time = std::chrono::steady_clock::now();
 
-  model->Predict(prompt, steps);
+    model->Predict(prompt, steps);
 
-  auto Duration = duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
-  std::cout << "Duration " << Duration.count() << " microseconds." << std::endl;
+    auto Duration = duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+    std::cout << "Duration " << Duration.count() << " microseconds." << std::endl;
+  }
+  catch (const std::string& err)
+  {
+    std::cerr << "Error: " << err << std::endl;
+    exit(1);
+  }
+  catch (const char* err)
+  {
+    std::cerr << "Error: " << err << std::endl;
+    exit(1);
+  }
+  catch (const std::exception& err)
+  {
+    std::cerr << "Error: " << err.what() << std::endl;
+    exit(1);
+  }
 
   return 0;
 }
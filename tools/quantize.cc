@@ -0,0 +1,518 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+// quantize converts a LLaMA model file to a GGUF or grid file with a selectable data type per
+// tensor and reports the RMS quantization error of each tensor:
+//
+//   quantize [-t karpathy|grid] [-f gguf|grid] [-j threads] [-q type] [-T pattern=type ...]
+//            -m model -o output
+//
+// The -q option sets the data type of all weight matrices (default q8_0), and each -T option the
+// data type of the weight matrices with a name that includes the pattern, e.g. -T attn=q8_0
+// -T ffn=q4_k. The last matching option wins. Normalization weights are always stored as f32.
+// Grid files store the Q8_0 and Q4_0 weight matrices (except the embeddings) in panels.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <grid/models/llama.h>
+#include <grid/tensor/quantized.h>
+#include <grid/util/thread_pool.h>
+
+#include "ggml.h"
+#include "grid.h"
+
+namespace {
+
+using grid::GgmlDataType;
+
+struct DataType
+{
+  const char*   name;
+  GgmlDataType  type;
+  uint32_t      file_type;    // general.file_type for files that mostly use this type
+};
+
+const DataType kDataTypes[] =
+{
+  { "f32",  grid::kGgmlDataTypeF32,   0 },
+  { "f16",  grid::kGgmlDataTypeF16,   1 },
+  { "q4_0", grid::kGgmlDataTypeQ4_0,  2 },
+  { "q8_0", grid::kGgmlDataTypeQ8_0,  7 },
+  { "q4_k", grid::kGgmlDataTypeQ4_K, 15 },
+  { "q5_k", grid::kGgmlDataTypeQ5_K, 17 },
+  { "q6_k", grid::kGgmlDataTypeQ6_K, 18 },
+  { "bf16", grid::kGgmlDataTypeBF16, 32 },
+};
+
+const DataType& FindDataType(const std::string& name)
+{
+  for (auto& data_type : kDataTypes)
+    if (name == data_type.name)
+      return data_type;
+  throw std::runtime_error("unsupported data type: " + name);
+}
+
+const char* DataTypeName(GgmlDataType type)
+{
+  for (auto& data_type : kDataTypes)
+    if (type == data_type.type)
+      return data_type.name;
+  return "?";
+}
+
+// Tensor describes a tensor of the model and its data type in the output file.
+struct Tensor
+{
+  grid::LLaMAFile::TensorType type;
+  size_t                      layer;
+  bool                        per_layer;
+  std::string                 name;
+  size_t                      rows;   // 0 for vectors
+  size_t                      cols;
+  GgmlDataType                output_type;
+  size_t                      panel_rows = 1;
+};
+
+
+// Source reads the rows of a tensor of the input file as floats.
+class Source
+{
+ public:
+  Source(const std::type_info& type, const char* data, size_t cols)
+    : type_(type), data_(data), cols_(cols)
+  {
+    if (type == typeid(float))                  row_size_ = cols * sizeof(float), block_size_ = sizeof(float);
+    else if (type == typeid(grid::float16_t))   row_size_ = RowSize<grid::float16_t>();
+    else if (type == typeid(grid::bfloat16_t))  row_size_ = RowSize<grid::bfloat16_t>();
+    else if (type == typeid(grid::BlockQ8_0))   row_size_ = RowSize<grid::BlockQ8_0>();
+    else if (type == typeid(grid::BlockQ4_0))   row_size_ = RowSize<grid::BlockQ4_0>();
+    else if (type == typeid(grid::BlockQ4_K))   row_size_ = RowSize<grid::BlockQ4_K>();
+    else if (type == typeid(grid::BlockQ5_K))   row_size_ = RowSize<grid::BlockQ5_K>();
+    else if (type == typeid(grid::BlockQ6_K))   row_size_ = RowSize<grid::BlockQ6_K>();
+    else
+      throw std::runtime_error("unsupported data type of the input tensor");
+  }
+
+  /// Row returns a pointer to the data of the row.
+  const char* Row(size_t row) const                       { return data_ + row * row_size_; }
+
+  /// RowSize returns the size of a row in bytes.
+  size_t RowSize() const                                  { return row_size_; }
+
+  /// BlockSize returns the size of a block in bytes.
+  size_t BlockSize() const                                { return block_size_; }
+
+  /// Read converts the row to floats.
+  void Read(size_t row, float* y) const
+  {
+    if (type_ == typeid(float))                   memcpy(y, Row(row), cols_ * sizeof(float));
+    else if (type_ == typeid(grid::float16_t))    Read<grid::float16_t>(row, y);
+    else if (type_ == typeid(grid::bfloat16_t))   Read<grid::bfloat16_t>(row, y);
+    else if (type_ == typeid(grid::BlockQ8_0))    Read<grid::BlockQ8_0>(row, y);
+    else if (type_ == typeid(grid::BlockQ4_0))    Read<grid::BlockQ4_0>(row, y);
+    else if (type_ == typeid(grid::BlockQ4_K))    Read<grid::BlockQ4_K>(row, y);
+    else if (type_ == typeid(grid::BlockQ5_K))    Read<grid::BlockQ5_K>(row, y);
+    else if (type_ == typeid(grid::BlockQ6_K))    Read<grid::BlockQ6_K>(row, y);
+  }
+
+  /// Is returns true if the data type of the source is the provided type.
+  bool Is(GgmlDataType type) const
+  {
+    switch (type)
+    {
+      case grid::kGgmlDataTypeF32:  return type_ == typeid(float);
+      case grid::kGgmlDataTypeF16:  return type_ == typeid(grid::float16_t);
+      case grid::kGgmlDataTypeBF16: return type_ == typeid(grid::bfloat16_t);
+      case grid::kGgmlDataTypeQ8_0: return type_ == typeid(grid::BlockQ8_0);
+      case grid::kGgmlDataTypeQ4_0: return type_ == typeid(grid::BlockQ4_0);
+      case grid::kGgmlDataTypeQ4_K: return type_ == typeid(grid::BlockQ4_K);
+      case grid::kGgmlDataTypeQ5_K: return type_ == typeid(grid::BlockQ5_K);
+      case grid::kGgmlDataTypeQ6_K: return type_ == typeid(grid::BlockQ6_K);
+      default: return false;
+    }
+  }
+
+ private:
+  template <typename TBlock>
+  size_t RowSize()
+  {
+    if (cols_ % TBlock::kQuants != 0)
+      throw std::runtime_error("row size is not a multiple of the block size");
+    block_size_ = sizeof(TBlock);
+    return cols_ / TBlock::kQuants * sizeof(TBlock);
+  }
+
+  template <typename TBlock>
+  void Read(size_t row, float* y) const
+  {
+    auto* blocks = reinterpret_cast<const TBlock*>(Row(row));
+    for (size_t i = 0; i < cols_ / TBlock::kQuants; i++)
+      grid::Dequantize(blocks[i], y + i * TBlock::kQuants);
+  }
+
+  const std::type_info& type_;
+  const char*           data_;
+  size_t                cols_;
+  size_t                row_size_;
+  size_t                block_size_;
+};
+
+
+// QuantizeRow converts a row of floats to the output type, and returns the dequantized values.
+template <typename TBlock>
+void QuantizeRow(const float* x, char* data, float* y, size_t cols)
+{
+  auto* blocks = reinterpret_cast<TBlock*>(data);
+  for (size_t i = 0; i < cols / TBlock::kQuants; i++)
+  {
+    grid::Quantize(x + i * TBlock::kQuants, blocks[i]);
+    grid::Dequantize(blocks[i], y + i * TBlock::kQuants);
+  }
+}
+
+void QuantizeRow(GgmlDataType type, const float* x, char* data, float* y, size_t cols)
+{
+  switch (type)
+  {
+    case grid::kGgmlDataTypeF32:
+      memcpy(data, x, cols * sizeof(float));
+      memcpy(y, x, cols * sizeof(float));
+      break;
+    case grid::kGgmlDataTypeF16:  QuantizeRow<grid::float16_t>(x, data, y, cols); break;
+    case grid::kGgmlDataTypeBF16: QuantizeRow<grid::bfloat16_t>(x, data, y, cols); break;
+    case grid::kGgmlDataTypeQ8_0: QuantizeRow<grid::BlockQ8_0>(x, data, y, cols); break;
+    case grid::kGgmlDataTypeQ4_0: QuantizeRow<grid::BlockQ4_0>(x, data, y, cols); break;
+    case grid::kGgmlDataTypeQ4_K: QuantizeRow<grid::BlockQ4_K>(x, data, y, cols); break;
+    case grid::kGgmlDataTypeQ5_K: QuantizeRow<grid::BlockQ5_K>(x, data, y, cols); break;
+    case grid::kGgmlDataTypeQ6_K: QuantizeRow<grid::BlockQ6_K>(x, data, y, cols); break;
+    default: throw std::runtime_error("unsupported output data type");
+  }
+}
+
+size_t BlockSize(GgmlDataType type)
+{
+  switch (type)
+  {
+    case grid::kGgmlDataTypeQ8_0: return grid::BlockQ8_0::kQuants;
+    case grid::kGgmlDataTypeQ4_0: return grid::BlockQ4_0::kQuants;
+    case grid::kGgmlDataTypeQ4_K: return grid::BlockQ4_K::kQuants;
+    case grid::kGgmlDataTypeQ5_K: return grid::BlockQ5_K::kQuants;
+    case grid::kGgmlDataTypeQ6_K: return grid::BlockQ6_K::kQuants;
+    default: return 1;
+  }
+}
+
+// Repack copies the blocks of a matrix {rows, cols} from the row-major to the panel layout, or
+// from the panel to the row-major layout if unpack is set.
+void Repack(const char* src, char* dst, size_t rows, size_t blocks, size_t block_size, size_t panel_rows,
+            bool unpack = false)
+{
+  for (size_t row = 0; row < rows; row++)
+  {
+    for (size_t b = 0; b < blocks; b++)
+    {
+      size_t offset = grid::PanelOffset(row, b, rows, blocks, panel_rows) * block_size;
+      size_t row_major = (row * blocks + b) * block_size;
+      if (unpack)
+        memcpy(dst + row_major, src + offset, block_size);
+      else
+        memcpy(dst + offset, src + row_major, block_size);
+    }
+  }
+}
+
+} // end of namespace
+
+
+int main(int argc, char** argv)
+{
+  int                   opt;
+  std::string           model_path;
+  std::string           output_path;
+  grid::LLaMAFile::Type model_type = grid::LLaMAFile::kGgml;
+  grid::LLaMAFile::Type output_type = grid::LLaMAFile::kGgml;
+  size_t                threads = 0;
+
+  const DataType* default_type = &FindDataType("q8_0");
+  std::vector<std::pair<std::string, GgmlDataType>> tensor_types;
+
+  try
+  {
+    while ((opt = getopt(argc, argv, "f:hj:m:o:q:t:T:")) != -1)
+    {
+      switch (opt)
+      {
+        case 'h': // help
+          std::cout << "Usage: quantize [-t karpathy|grid] [-f gguf|grid] [-j threads] [-q type] "
+                       "[-T pattern=type ...] -m model -o output\n"
+                       "Types: f32, f16, bf16, q8_0, q4_0, q4_k, q5_k, q6_k" << std::endl;
+          exit(0);
+
+        case 'f': // output format
+          if (std::string(optarg) == "grid")
+            output_type = grid::LLaMAFile::kGrid;
+          else if (std::string(optarg) != "gguf")
+            throw std::runtime_error("unsupported output format: " + std::string(optarg));
+          break;
+
+        case 'j': // threads
+          threads = std::strtoul(optarg, NULL, 0);
+          break;
+
+        case 'm': // model file
+          model_path = optarg;
+          break;
+
+        case 'o': // output file
+          output_path = optarg;
+          break;
+
+        case 'q': // data type of all weight matrices
+          default_type = &FindDataType(optarg);
+          break;
+
+        case 'T': // data type of the weight matrices with a matching name
+        {
+          std::string arg(optarg);
+          size_t pos = arg.find('=');
+          if (pos == std::string::npos)
+            throw std::runtime_error("invalid tensor type, use pattern=type: " + arg);
+          tensor_types.emplace_back(arg.substr(0, pos), FindDataType(arg.substr(pos + 1)).type);
+          break;
+        }
+
+        case 't': // file type/format
+          if (std::string(optarg) == "karpathy")
+            model_type = grid::LLaMAFile::kKarpathy;
+          else if (std::string(optarg) == "grid")
+            model_type = grid::LLaMAFile::kGrid;
+          break;
+      }
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (model_path.empty() || output_path.empty())
+  {
+    std::cerr << "no model or output file provided" << std::endl;
+    exit(1);
+  }
+
+  try
+  {
+    std::unique_ptr<grid::LLaMAFile> file(grid::LLaMAFile::Open(model_type, model_path));
+
+    grid::LLaMAModel::Parameters params;
+    grid::LLaMAVocab vocab;
+    file->GetParameters(params);
+    file->GetTokenizer(vocab);
+
+    std::unique_ptr<grid::MMap> mmap(file->MapTensors());
+    char* base = static_cast<char*>(mmap->Address());
+
+    size_t dim = params.dim_;
+    size_t kv_dim = dim * params.num_kv_heads_ / params.num_heads_;
+    size_t hidden_dim = params.hidden_dim_;
+
+    // list the tensors in the order of the llama.cpp files
+    std::vector<Tensor> tensors;
+    auto add = [&](grid::LLaMAFile::TensorType type, size_t rows, size_t cols, bool per_layer, size_t layer) {
+      tensors.push_back(Tensor{type, layer, per_layer, grid::GgmlWriter::TensorName(type, layer), rows, cols,
+                               grid::kGgmlDataTypeF32});
+    };
+    add(grid::LLaMAFile::kEmbeddings, params.vocab_size_, dim, false, 0);
+    for (size_t i = 0; i < params.num_layers_; i++)
+    {
+      add(grid::LLaMAFile::kAttentionRms, 0, dim, true, i);
+      add(grid::LLaMAFile::kAttentionQuery, dim, dim, true, i);
+      add(grid::LLaMAFile::kAttentionKey, kv_dim, dim, true, i);
+      add(grid::LLaMAFile::kAttentionValue, kv_dim, dim, true, i);
+      add(grid::LLaMAFile::kFeedForwardWo, dim, dim, true, i);
+      add(grid::LLaMAFile::kFeedForwardW1, hidden_dim, dim, true, i);
+      add(grid::LLaMAFile::kFeedForwardW2, dim, hidden_dim, true, i);
+      add(grid::LLaMAFile::kFeedForwardW3, hidden_dim, dim, true, i);
+      add(grid::LLaMAFile::kFeedForwardRms, 0, dim, true, i);
+    }
+    add(grid::LLaMAFile::kFinalRms, 0, dim, false, 0);
+    add(grid::LLaMAFile::kOutput, params.vocab_size_, dim, false, 0);
+
+    // select the output types; rows that aren't a multiple of the block size use q8_0 or f32
+    for (auto& tensor : tensors)
+    {
+      if (tensor.rows == 0)
+        continue;
+
+      tensor.output_type = default_type->type;
+      for (auto& [pattern, type] : tensor_types)
+        if (tensor.name.find(pattern) != std::string::npos)
+          tensor.output_type = type;
+
+      if (tensor.cols % BlockSize(tensor.output_type) != 0)
+        tensor.output_type = tensor.cols % grid::BlockQ8_0::kQuants == 0 ? grid::kGgmlDataTypeQ8_0
+                                                                          : grid::kGgmlDataTypeF32;
+
+      if (output_type == grid::LLaMAFile::kGrid && tensor.type != grid::LLaMAFile::kEmbeddings &&
+          (tensor.output_type == grid::kGgmlDataTypeQ8_0 || tensor.output_type == grid::kGgmlDataTypeQ4_0))
+        tensor.panel_rows = grid::kQuantizedPanelRows;
+    }
+
+    std::unique_ptr<grid::GgmlWriter> ggml_writer;
+    std::unique_ptr<grid::GridWriter> grid_writer;
+    if (output_type == grid::LLaMAFile::kGrid)
+      grid_writer = std::make_unique<grid::GridWriter>(params, vocab, default_type->type);
+    else
+      ggml_writer = std::make_unique<grid::GgmlWriter>(params, vocab, default_type->file_type);
+
+    for (auto& tensor : tensors)
+    {
+      if (grid_writer)
+        grid_writer->AddTensor(tensor.type, tensor.layer, tensor.output_type, tensor.panel_rows,
+                               tensor.rows, tensor.cols);
+      else
+        ggml_writer->AddTensor(tensor.name, tensor.output_type, tensor.rows, tensor.cols);
+    }
+
+    std::ofstream ofs(output_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!ofs)
+      throw std::runtime_error("failed to create " + output_path);
+    if (grid_writer)
+      grid_writer->WriteHeader(ofs);
+    else
+      ggml_writer->WriteHeader(ofs);
+
+    grid::ThreadPool thread_pool(threads);
+    constexpr size_t kRowsPerTask = 16;
+
+    std::cout << std::left << std::setw(32) << "tensor" << std::setw(6) << "type"
+              << std::setw(14) << "dimensions" << std::right << std::setw(12) << "rms error"
+              << std::setw(12) << "relative" << std::endl;
+
+    double total_squared_error = 0.0;
+    double total_squared = 0.0;
+    for (auto& tensor : tensors)
+    {
+      auto& info = file->GetTensorInfo(tensor.type, tensor.per_layer ? tensor.layer : 0);
+      auto& data_type = *info.data_type;
+      auto [data, size] = file->GetTensor<char>(base, info);
+      size_t rows = std::max(tensor.rows, size_t{1});
+
+      // tensors of grid files may be stored in panels
+      size_t input_panel_rows = info.panel_rows;
+      std::vector<char> input;
+      if (input_panel_rows > 1)
+      {
+        Source packed(data_type, data, tensor.cols);
+        if (packed.RowSize() * rows > size)
+          throw std::runtime_error("tensor " + tensor.name + " exceeds the file");
+        input.resize(packed.RowSize() * rows);
+        Repack(data, input.data(), rows, packed.RowSize() / packed.BlockSize(), packed.BlockSize(),
+               input_panel_rows, true);
+        data = input.data();
+      }
+      Source source(data_type, data, tensor.cols);
+
+      // tensors that already have the output type are copied
+      size_t row_size = tensor.cols / BlockSize(tensor.output_type) *
+                        grid::GgmlFileTypeSize[tensor.output_type];
+      std::vector<char> output(rows * row_size);
+      double squared_error = 0.0;
+      double squared = 0.0;
+      if (source.Is(tensor.output_type))
+      {
+        if (source.RowSize() * rows > size)
+          throw std::runtime_error("tensor " + tensor.name + " exceeds the file");
+        memcpy(output.data(), source.Row(0), output.size());
+      }
+      else
+      {
+        size_t tasks = (rows + kRowsPerTask - 1) / kRowsPerTask;
+        std::vector<double> task_errors(tasks);
+        std::vector<double> task_squares(tasks);
+        thread_pool.Parallel(tasks, [&](size_t task) {
+          std::vector<float> x(tensor.cols);
+          std::vector<float> y(tensor.cols);
+          for (size_t row = task * kRowsPerTask; row < std::min(rows, (task + 1) * kRowsPerTask); row++)
+          {
+            source.Read(row, x.data());
+            QuantizeRow(tensor.output_type, x.data(), output.data() + row * row_size, y.data(), tensor.cols);
+            for (size_t i = 0; i < tensor.cols; i++)
+            {
+              task_errors[task] += (double{y[i]} - x[i]) * (double{y[i]} - x[i]);
+              task_squares[task] += double{x[i]} * x[i];
+            }
+          }
+        });
+        for (size_t task = 0; task < tasks; task++)
+        {
+          squared_error += task_errors[task];
+          squared += task_squares[task];
+        }
+      }
+
+      if (tensor.panel_rows > 1)
+      {
+        std::vector<char> panels(output.size());
+        size_t block_size = grid::GgmlFileTypeSize[tensor.output_type];
+        Repack(output.data(), panels.data(), rows, row_size / block_size, block_size, tensor.panel_rows);
+        output.swap(panels);
+      }
+
+      if (grid_writer)
+        grid_writer->WriteTensor(ofs, output.data(), output.size());
+      else
+        ggml_writer->WriteTensor(ofs, output.data(), output.size());
+
+      size_t count = rows * tensor.cols;
+      total_squared_error += squared_error;
+      total_squared += squared;
+      std::string dims = tensor.rows == 0 ? std::to_string(tensor.cols)
+                                          : std::to_string(tensor.rows) + "x" + std::to_string(tensor.cols);
+      std::cout << std::left << std::setw(32) << tensor.name << std::setw(6) << DataTypeName(tensor.output_type)
+                << std::setw(14) << dims << std::right << std::scientific << std::setprecision(3);
+      if (source.Is(tensor.output_type))
+        std::cout << std::setw(12) << "copied";
+      else
+        std::cout << std::setw(12) << std::sqrt(squared_error / count)
+                  << std::setw(12) << (squared > 0.0 ? std::sqrt(squared_error / squared) : 0.0);
+      std::cout << std::defaultfloat << std::endl;
+    }
+
+    ofs.close();
+    if (!ofs.good())
+      throw std::runtime_error("failed to write " + output_path);
+
+    std::cout << "total relative rms error: " << std::scientific << std::setprecision(3)
+              << (total_squared > 0.0 ? std::sqrt(total_squared_error / total_squared) : 0.0) << std::endl;
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    exit(1);
+  }
+  catch (const std::string& err)
+  {
+    std::cerr << "Error: " << err << std::endl;
+    exit(1);
+  }
+
+  return 0;
+}
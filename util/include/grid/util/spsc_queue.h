@@ -0,0 +1,109 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef GRID_UTIL_SPSC_QUEUE_H
+#define GRID_UTIL_SPSC_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <vector>
+
+namespace grid {
+
+/// SPSCQueue is a bounded lock-free queue for a single producer and a single consumer thread.
+///
+/// The producer never blocks: TryPush fails if the queue is full. The consumer can poll with
+/// TryPop or wait in Pop, which sleeps on the tail index (std::atomic::wait) until the producer
+/// pushes a value or closes the queue.
+template <typename T>
+class SPSCQueue
+{
+  // kClosed is the bit of the tail index that marks the queue as closed.
+  static constexpr size_t kClosed = size_t{1} << (sizeof(size_t) * 8 - 1);
+
+ public:
+  /// Constructor
+  ///
+  /// @param capacity  Minimum number of values; rounded up to a power of two.
+  explicit SPSCQueue(size_t capacity)
+    : slots_(std::bit_ceil(std::max(capacity, size_t{1}))),
+      mask_(slots_.size() - 1)
+  {}
+
+  // Copy constructor and assignments are not permissible
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  /// Capacity returns the maximum number of values in the queue.
+  size_t Capacity() const                                 { return slots_.size(); }
+
+  /// TryPush moves the value to the end of the queue and returns false if the queue is full or
+  /// closed. It must only be called by the producer.
+  bool TryPush(T&& value)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if ((tail & kClosed) != 0 || tail - head_.load(std::memory_order_acquire) == slots_.size())
+      return false;
+
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    tail_.notify_one();
+    return true;
+  }
+
+  /// Close marks the end of the values and wakes the waiting consumer. It must only be called by
+  /// the producer.
+  void Close()
+  {
+    tail_.store(tail_.load(std::memory_order_relaxed) | kClosed, std::memory_order_release);
+    tail_.notify_one();
+  }
+
+  /// TryPop moves the first value of the queue to value and returns false if the queue is empty.
+  /// It must only be called by the consumer.
+  bool TryPop(T& value)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if ((tail_.load(std::memory_order_acquire) & ~kClosed) == head)
+      return false;
+
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Pop waits for the first value of the queue and moves it to value. It returns false if the
+  /// queue is empty and closed. It must only be called by the consumer.
+  bool Pop(T& value)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail;
+    while (((tail = tail_.load(std::memory_order_acquire)) & ~kClosed) == head)
+    {
+      if ((tail & kClosed) != 0)
+        return false;
+      tail_.wait(tail, std::memory_order_acquire);
+    }
+
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T>                  slots_;
+  size_t                          mask_;
+  alignas(64) std::atomic<size_t> head_{0};   // written by the consumer
+  alignas(64) std::atomic<size_t> tail_{0};   // written by the producer; kClosed when closed
+};
+
+} // end of namespace grid
+
+#endif  // GRID_UTIL_SPSC_QUEUE_H
@@ -0,0 +1,188 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#ifndef GRID_UTIL_THREAD_POOL_H
+#define GRID_UTIL_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace grid {
+
+/// ThreadPool runs tasks on a fixed set of worker threads.
+///
+/// Parallel distributes the iterations of a loop across the workers and the calling thread, and
+/// Submit runs a single task asynchronously. Parallel can also be called from within a task as
+/// the calling thread processes any iterations not picked up by other workers.
+class ThreadPool
+{
+  // Shared state of a Parallel call; kept alive by any worker that has not run yet.
+  struct Loop
+  {
+    std::function<void(size_t)> function_;
+    size_t                      count_;
+    std::atomic<size_t>         next_{0};
+    std::atomic<size_t>         done_{0};
+    std::mutex                  mutex_;
+    std::condition_variable     finished_;
+    std::exception_ptr          exception_;
+  };
+
+ public:
+  /// Constructor
+  ///
+  /// @param threads  Number of threads including the calling thread; 0 uses all cores.
+  explicit ThreadPool(size_t threads = 0)
+  {
+    if (threads == 0)
+      threads = std::max(1U, std::thread::hardware_concurrency());
+
+    for (size_t i = 1; i < threads; i++)
+      workers_.emplace_back([this] { Run(); });
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    available_.notify_all();
+    for (auto& worker: workers_)
+      worker.join();
+  }
+
+  // Copy constructor and assignments are not permissible
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /// Size returns the number of threads including the calling thread.
+  size_t Size() const                                     { return workers_.size() + 1; }
+
+  /// Parallel calls the function for all indices [0, count) and returns when all calls have
+  /// completed. Any exception is rethrown in the calling thread.
+  void Parallel(size_t count, std::function<void(size_t)> function)
+  {
+    if (count == 0)
+      return;
+
+    if (count == 1 || workers_.empty())
+    {
+      for (size_t i = 0; i < count; i++)
+        function(i);
+      return;
+    }
+
+    auto loop = std::make_shared<Loop>();
+    loop->function_ = std::move(function);
+    loop->count_ = count;
+
+    size_t helpers = std::min(count - 1, workers_.size());
+    {
+      std::lock_guard lock(mutex_);
+      for (size_t i = 0; i < helpers; i++)
+        tasks_.emplace_back([loop] { Iterate(*loop); });
+    }
+    if (helpers == 1)
+      available_.notify_one();
+    else
+      available_.notify_all();
+
+    Iterate(*loop);
+
+    std::unique_lock lock(loop->mutex_);
+    loop->finished_.wait(lock, [&] { return loop->done_ == loop->count_; });
+    if (loop->exception_)
+      std::rethrow_exception(loop->exception_);
+  }
+
+  /// Submit runs the function asynchronously on a worker and returns a future for the result.
+  /// The function runs in the calling thread when the pool has no workers.
+  template <typename F>
+  auto Submit(F&& function)
+  {
+    using result_type = std::invoke_result_t<F>;
+    auto task = std::make_shared<std::packaged_task<result_type()>>(std::forward<F>(function));
+    auto future = task->get_future();
+
+    if (workers_.empty())
+      (*task)();
+    else
+    {
+      {
+        std::lock_guard lock(mutex_);
+        tasks_.emplace_back([task] { (*task)(); });
+      }
+      available_.notify_one();
+    }
+    return future;
+  }
+
+ private:
+  // Iterate runs the iterations of the loop that are not claimed by other threads.
+  static void Iterate(Loop& loop)
+  {
+    for (size_t i; (i = loop.next_++) < loop.count_; )
+    {
+      try
+      {
+        loop.function_(i);
+      }
+      catch (...)
+      {
+        std::lock_guard lock(loop.mutex_);
+        if (!loop.exception_)
+          loop.exception_ = std::current_exception();
+      }
+
+      if (++loop.done_ == loop.count_)
+      {
+        std::lock_guard lock(loop.mutex_);
+        loop.finished_.notify_all();
+      }
+    }
+  }
+
+  // Run is the main function of a worker thread.
+  void Run()
+  {
+    for (;;)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock lock(mutex_);
+        available_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+ private:
+  std::vector<std::thread>          workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex                        mutex_;
+  std::condition_variable           available_;
+  bool                              stop_ = false;
+};
+
+} // end of namespace grid
+
+#endif  // GRID_UTIL_THREAD_POOL_H
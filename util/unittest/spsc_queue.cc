@@ -0,0 +1,85 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <grid/util/spsc_queue.h>
+
+#include "gtest/gtest.h"
+
+using grid::SPSCQueue;
+
+TEST(SPSCQueue, PushPop)
+{
+  SPSCQueue<int> queue(3);
+  EXPECT_EQ(queue.Capacity(), 4);
+
+  int value;
+  EXPECT_FALSE(queue.TryPop(value));
+  for (int i = 0; i < 4; i++)
+    EXPECT_TRUE(queue.TryPush(int{i}));
+  EXPECT_FALSE(queue.TryPush(4));
+
+  // values are popped in order, and slots are reused after wrapping around
+  for (int round = 0; round < 3; round++)
+  {
+    EXPECT_TRUE(queue.TryPop(value));
+    EXPECT_EQ(value, round);
+    EXPECT_TRUE(queue.TryPush(int{round + 4}));
+  }
+  for (int i = 3; i < 7; i++)
+  {
+    EXPECT_TRUE(queue.Pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(SPSCQueue, Close)
+{
+  SPSCQueue<std::unique_ptr<std::string>> queue(4);
+  EXPECT_TRUE(queue.TryPush(std::make_unique<std::string>("first")));
+  EXPECT_TRUE(queue.TryPush(std::make_unique<std::string>("second")));
+  queue.Close();
+  EXPECT_FALSE(queue.TryPush(std::make_unique<std::string>("third")));
+
+  // the values before closing the queue are still popped
+  std::unique_ptr<std::string> value;
+  EXPECT_TRUE(queue.Pop(value));
+  EXPECT_EQ(*value, "first");
+  EXPECT_TRUE(queue.TryPop(value));
+  EXPECT_EQ(*value, "second");
+  EXPECT_FALSE(queue.Pop(value));
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(SPSCQueue, Threads)
+{
+  constexpr size_t kCount = 100000;
+  SPSCQueue<size_t> queue(16);
+
+  // the producer retries when the queue is full; the consumer waits in Pop
+  std::thread producer([&] {
+    for (size_t i = 0; i < kCount; i++)
+      while (!queue.TryPush(size_t{i}))
+        std::this_thread::yield();
+    queue.Close();
+  });
+
+  size_t expected = 0;
+  size_t value;
+  while (queue.Pop(value))
+  {
+    ASSERT_EQ(value, expected);
+    expected++;
+  }
+  producer.join();
+  EXPECT_EQ(expected, kCount);
+}
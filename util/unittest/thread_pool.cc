@@ -0,0 +1,72 @@
+//
+// Copyright (C) Chris Zankel. All rights reserved.
+// This code is subject to U.S. and other copyright laws and
+// intellectual property protections.
+//
+// The contents of this file are confidential and proprietary to Chris Zankel.
+//
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <grid/util/thread_pool.h>
+
+#include "gtest/gtest.h"
+
+using grid::ThreadPool;
+
+TEST(ThreadPool, Parallel)
+{
+  for (size_t threads : {1, 2, 4})
+  {
+    ThreadPool pool(threads);
+    EXPECT_EQ(pool.Size(), threads);
+
+    std::vector<std::atomic<int>> counts(1000);
+    pool.Parallel(counts.size(), [&](size_t i) { counts[i]++; });
+    for (auto& count : counts)
+      EXPECT_EQ(count, 1);
+
+    pool.Parallel(0, [](size_t) { FAIL(); });
+  }
+}
+
+TEST(ThreadPool, NestedParallel)
+{
+  // the calling threads of the inner loops run any iterations not picked up by busy workers
+  ThreadPool pool(3);
+  std::vector<std::atomic<int>> counts(16 * 64);
+  pool.Parallel(16, [&](size_t i) {
+    pool.Parallel(64, [&](size_t j) { counts[i * 64 + j]++; });
+  });
+  for (auto& count : counts)
+    EXPECT_EQ(count, 1);
+}
+
+TEST(ThreadPool, Exception)
+{
+  ThreadPool pool(4);
+  std::atomic<int> calls{0};
+  EXPECT_THROW(pool.Parallel(100, [&](size_t i) {
+    calls++;
+    if (i == 42)
+      throw std::runtime_error("failed");
+  }), std::runtime_error);
+  EXPECT_EQ(calls, 100);
+
+  // the pool is still usable
+  std::atomic<int> count{0};
+  pool.Parallel(10, [&](size_t) { count++; });
+  EXPECT_EQ(count, 10);
+}
+
+TEST(ThreadPool, Submit)
+{
+  ThreadPool pool(2);
+  auto future = pool.Submit([] { return 42; });
+  EXPECT_EQ(future.get(), 42);
+
+  ThreadPool serial(1);
+  EXPECT_EQ(serial.Submit([] { return 7; }).get(), 7);
+}